@@ -27,11 +27,14 @@ cd miniport
 build -cZg
 cd ../display
 build -cZg
+cd ../qxlcap
+build -cZg
 cd ../
 
 :copy_local
 copy display\obj%BUILD_ALT_DIR%\i386\qxldd.dll %TARGET%
 copy miniport\obj%BUILD_ALT_DIR%\i386\qxl.sys %TARGET%
+copy qxlcap\obj%BUILD_ALT_DIR%\i386\qxlcap.exe %TARGET%
 copy miniport\qxl.inf %TARGET%
 copy display\obj%BUILD_ALT_DIR%\i386\qxldd.pdb %TARGET%
 copy miniport\obj%BUILD_ALT_DIR%\i386\qxl.pdb %TARGET%
@@ -43,6 +43,302 @@
 
 #define QXLDD_DEBUG_PREFIX "qxldd: "
 
+/* The drawing entry points are registered through these wrappers, which time each call into
+ * the latency histogram of the entry point while perf stats are enabled, record it into
+ * the capture buffer while capturing, and let lazily restored surfaces move back to VRAM.
+ * Debug messages queued by a call are handed to the device when it returns to GDI. */
+static _inline PDev *PerfGetPDev(SURFOBJ *dest, SURFOBJ *src)
+{
+    return (PDev *)(dest->iType != STYPE_BITMAP || !src ? dest->dhpdev : src->dhpdev);
+}
+
+static _inline RECTL *CaptureSrcRect(RECTL *src_rect, RECTL *dest_rect, POINTL *src_pos)
+{
+    if (!src_pos || !dest_rect) {
+        return NULL;
+    }
+    src_rect->left = src_pos->x;
+    src_rect->top = src_pos->y;
+    src_rect->right = src_pos->x + dest_rect->right - dest_rect->left;
+    src_rect->bottom = src_pos->y + dest_rect->bottom - dest_rect->top;
+    return src_rect;
+}
+
+/* A NULL dhpdev (i.e. GDI calling after DrvDisablePDEV) is left to the Drv function
+ * guards, the wrappers don't touch the pdev then. */
+#define RESTORE_POINT(pdev, dest, src, mask) {                          \
+    if ((pdev) && !(pdev)->call_depth &&                                \
+        (!RingIsEmpty(pdev, &(pdev)->restore_surfaces) || (pdev)->admit_pending_surfaces)) { \
+        RestoreSurfacesOnCall(pdev, dest, src, mask);                   \
+    }                                                                   \
+}
+
+#define PERF_CALL(pdev, counter, call) {                                \
+    LONGLONG perf_start;                                                \
+    BOOL ret;                                                           \
+                                                                        \
+    if (!(pdev)) {                                                      \
+        return call;                                                    \
+    }                                                                   \
+    PerfStart(pdev, &perf_start);                                       \
+    (pdev)->call_depth++;                                               \
+    ret = call;                                                         \
+    (pdev)->call_depth--;                                               \
+    PerfEnd(pdev, &(pdev)->perf_calls[counter], &perf_start);          \
+    if (!(pdev)->call_depth && (pdev)->log_queue.used) {                \
+        DebugFlush(pdev);                                               \
+    }                                                                   \
+    return ret;                                                         \
+}
+
+static BOOL APIENTRY PerfCopyBits(SURFOBJ *dest, SURFOBJ *src, CLIPOBJ *clip,
+                                  XLATEOBJ *color_trans, RECTL *dest_rect, POINTL *src_pos)
+{
+    PDev *pdev = PerfGetPDev(dest, src);
+
+    RESTORE_POINT(pdev, dest, src, NULL);
+
+    if (pdev && pdev->capture_buf) {
+        RECTL src_rect;
+
+        CaptureCall(pdev, CALL_COUNTER_COPY_BITS, dest, src, NULL, clip, color_trans, dest_rect,
+                    CaptureSrcRect(&src_rect, dest_rect, src_pos), NULL, 0xcccc, 0, NULL, NULL,
+                    NULL);
+    }
+
+    PERF_CALL(pdev, CALL_COUNTER_COPY_BITS,
+              DrvCopyBits(dest, src, clip, color_trans, dest_rect, src_pos));
+}
+
+static BOOL APIENTRY PerfBitBlt(SURFOBJ *dest, SURFOBJ *src, SURFOBJ *mask, CLIPOBJ *clip,
+                                XLATEOBJ *color_trans, RECTL *dest_rect, POINTL *src_pos,
+                                POINTL *mask_pos, BRUSHOBJ *brush, POINTL *brush_pos, ROP4 rop4)
+{
+    PDev *pdev = PerfGetPDev(dest, src);
+
+    RESTORE_POINT(pdev, dest, src, mask);
+
+    if (pdev && pdev->capture_buf) {
+        RECTL src_rect;
+
+        CaptureCall(pdev, CALL_COUNTER_BIT_BLT, dest, src, mask, clip, color_trans, dest_rect,
+                    CaptureSrcRect(&src_rect, dest_rect, src_pos), brush, rop4, 0, NULL, NULL,
+                    NULL);
+    }
+
+    PERF_CALL(pdev, CALL_COUNTER_BIT_BLT,
+              DrvBitBlt(dest, src, mask, clip, color_trans, dest_rect, src_pos, mask_pos,
+                        brush, brush_pos, rop4));
+}
+
+static BOOL APIENTRY PerfTextOut(SURFOBJ *surf, STROBJ *str, FONTOBJ *font, CLIPOBJ *clip,
+                                 RECTL *ignored, RECTL *opaque_rect, BRUSHOBJ *fore_brush,
+                                 BRUSHOBJ *back_brush, POINTL *brush_pos, MIX mix)
+{
+    PDev *pdev = (PDev *)surf->dhpdev;
+
+    RESTORE_POINT(pdev, surf, NULL, NULL);
+
+    if (pdev && pdev->capture_buf) {
+        CaptureCall(pdev, CALL_COUNTER_TEXT_OUT, surf, NULL, NULL, clip, NULL,
+                    opaque_rect ? opaque_rect : &str->rclBkGround, NULL, fore_brush, mix, 0,
+                    NULL, font, str);
+    }
+
+    PERF_CALL(pdev, CALL_COUNTER_TEXT_OUT,
+              DrvTextOut(surf, str, font, clip, ignored, opaque_rect, fore_brush, back_brush,
+                         brush_pos, mix));
+}
+
+static BOOL APIENTRY PerfStrokePath(SURFOBJ *surf, PATHOBJ *path, CLIPOBJ *clip,
+                                    XFORMOBJ *width_transform, BRUSHOBJ *brush,
+                                    POINTL *brush_pos, LINEATTRS *line_attr, MIX mix)
+{
+    PDev *pdev = (PDev *)surf->dhpdev;
+
+    RESTORE_POINT(pdev, surf, NULL, NULL);
+
+    if (pdev && pdev->capture_buf) {
+        CaptureCall(pdev, CALL_COUNTER_STROKE_PATH, surf, NULL, NULL, clip, NULL, NULL, NULL,
+                    brush, mix, 0, path, NULL, NULL);
+    }
+
+    PERF_CALL(pdev, CALL_COUNTER_STROKE_PATH,
+              DrvStrokePath(surf, path, clip, width_transform, brush, brush_pos, line_attr,
+                            mix));
+}
+
+static BOOL APIENTRY PerfStretchBlt(SURFOBJ *dest, SURFOBJ *src, SURFOBJ *mask, CLIPOBJ *clip,
+                                    XLATEOBJ *color_trans, COLORADJUSTMENT *color_adjust,
+                                    POINTL *halftone_brush_pos, RECTL *dest_rect,
+                                    RECTL *src_rect, POINTL *mask_pos, ULONG mode)
+{
+    PDev *pdev = PerfGetPDev(dest, src);
+
+    RESTORE_POINT(pdev, dest, src, mask);
+
+    if (pdev && pdev->capture_buf) {
+        CaptureCall(pdev, CALL_COUNTER_STRETCH_BLT, dest, src, mask, clip, color_trans,
+                    dest_rect, src_rect, NULL, 0xcccc, mode, NULL, NULL, NULL);
+    }
+
+    PERF_CALL(pdev, CALL_COUNTER_STRETCH_BLT,
+              DrvStretchBlt(dest, src, mask, clip, color_trans, color_adjust,
+                            halftone_brush_pos, dest_rect, src_rect, mask_pos, mode));
+}
+
+static BOOL APIENTRY PerfStretchBltROP(SURFOBJ *dest, SURFOBJ *src, SURFOBJ *mask,
+                                       CLIPOBJ *clip, XLATEOBJ *color_trans,
+                                       COLORADJUSTMENT *color_adjust, POINTL *brush_pos,
+                                       RECTL *dest_rect, RECTL *src_rect, POINTL *mask_pos,
+                                       ULONG mode, BRUSHOBJ *brush, DWORD rop4)
+{
+    PDev *pdev = PerfGetPDev(dest, src);
+
+    RESTORE_POINT(pdev, dest, src, mask);
+
+    if (pdev && pdev->capture_buf) {
+        CaptureCall(pdev, CALL_COUNTER_STRETCH_BLT_ROP, dest, src, mask, clip, color_trans,
+                    dest_rect, src_rect, brush, rop4, mode, NULL, NULL, NULL);
+    }
+
+    PERF_CALL(pdev, CALL_COUNTER_STRETCH_BLT_ROP,
+              DrvStretchBltROP(dest, src, mask, clip, color_trans, color_adjust, brush_pos,
+                               dest_rect, src_rect, mask_pos, mode, brush, rop4));
+}
+
+static BOOL APIENTRY PerfTransparentBlt(SURFOBJ *dest, SURFOBJ *src, CLIPOBJ *clip,
+                                        XLATEOBJ *color_trans, RECTL *dest_rect,
+                                        RECTL *src_rect, ULONG trans_color, ULONG reserved)
+{
+    PDev *pdev = PerfGetPDev(dest, src);
+
+    RESTORE_POINT(pdev, dest, src, NULL);
+
+    if (pdev && pdev->capture_buf) {
+        CaptureCall(pdev, CALL_COUNTER_TRANSPARENT_BLT, dest, src, NULL, clip, color_trans,
+                    dest_rect, src_rect, NULL, 0xcccc, trans_color, NULL, NULL, NULL);
+    }
+
+    PERF_CALL(pdev, CALL_COUNTER_TRANSPARENT_BLT,
+              DrvTransparentBlt(dest, src, clip, color_trans, dest_rect, src_rect, trans_color,
+                                reserved));
+}
+
+static BOOL APIENTRY PerfAlphaBlend(SURFOBJ *dest, SURFOBJ *src, CLIPOBJ *clip,
+                                    XLATEOBJ *color_trans, RECTL *dest_rect, RECTL *src_rect,
+                                    BLENDOBJ *bland)
+{
+    PDev *pdev = PerfGetPDev(dest, src);
+
+    RESTORE_POINT(pdev, dest, src, NULL);
+
+    if (pdev && pdev->capture_buf) {
+        CaptureCall(pdev, CALL_COUNTER_ALPHA_BLEND, dest, src, NULL, clip, color_trans,
+                    dest_rect, src_rect, NULL, 0xcccc, *(UINT32 *)&bland->BlendFunction, NULL,
+                    NULL, NULL);
+    }
+
+    PERF_CALL(pdev, CALL_COUNTER_ALPHA_BLEND,
+              DrvAlphaBlend(dest, src, clip, color_trans, dest_rect, src_rect, bland));
+}
+
+static BOOL APIENTRY PerfFillPath(SURFOBJ *surf, PATHOBJ *path, CLIPOBJ *clip,
+                                  BRUSHOBJ *brush, POINTL *brush_pos, MIX mix, FLONG options)
+{
+    PDev *pdev = (PDev *)surf->dhpdev;
+
+    RESTORE_POINT(pdev, surf, NULL, NULL);
+
+    if (pdev && pdev->capture_buf) {
+        CaptureCall(pdev, CALL_COUNTER_FILL_PATH, surf, NULL, NULL, clip, NULL, NULL, NULL,
+                    brush, mix, options, path, NULL, NULL);
+    }
+
+    PERF_CALL(pdev, CALL_COUNTER_FILL_PATH,
+              DrvFillPath(surf, path, clip, brush, brush_pos, mix, options));
+}
+
+static BOOL APIENTRY PerfStrokeAndFillPath(SURFOBJ *surf, PATHOBJ *path, CLIPOBJ *clip,
+                                           XFORMOBJ *width_transform,
+                                           BRUSHOBJ *stroke_brush, LINEATTRS *line_attr,
+                                           BRUSHOBJ *fill_brush, POINTL *brush_pos, MIX mix,
+                                           FLONG options)
+{
+    PDev *pdev = (PDev *)surf->dhpdev;
+
+    RESTORE_POINT(pdev, surf, NULL, NULL);
+
+    if (pdev && pdev->capture_buf) {
+        CaptureCall(pdev, CALL_COUNTER_STROKE_AND_FILL_PATH, surf, NULL, NULL, clip, NULL,
+                    NULL, NULL, fill_brush, mix, options, path, NULL, NULL);
+    }
+
+    PERF_CALL(pdev, CALL_COUNTER_STROKE_AND_FILL_PATH,
+              DrvStrokeAndFillPath(surf, path, clip, width_transform, stroke_brush,
+                                   line_attr, fill_brush, brush_pos, mix, options));
+}
+
+static BOOL APIENTRY PerfGradientFill(SURFOBJ *dest, CLIPOBJ *clip, XLATEOBJ *color_trans,
+                                      TRIVERTEX *vertices, ULONG num_vertices, PVOID mesh,
+                                      ULONG num_mesh, RECTL *extents, POINTL *dither_org,
+                                      ULONG mode)
+{
+    PDev *pdev = (PDev *)dest->dhpdev;
+
+    RESTORE_POINT(pdev, dest, NULL, NULL);
+
+    if (pdev && pdev->capture_buf) {
+        CaptureCall(pdev, CALL_COUNTER_GRADIENT_FILL, dest, NULL, NULL, clip, color_trans,
+                    extents, NULL, NULL, 0xcccc, mode, NULL, NULL, NULL);
+    }
+
+    PERF_CALL(pdev, CALL_COUNTER_GRADIENT_FILL,
+              DrvGradientFill(dest, clip, color_trans, vertices, num_vertices, mesh, num_mesh,
+                              extents, dither_org, mode));
+}
+
+static BOOL APIENTRY PerfLineTo(SURFOBJ *surf, CLIPOBJ *clip, BRUSHOBJ *brush, LONG x1,
+                                LONG y1, LONG x2, LONG y2, RECTL *bounds, MIX mix)
+{
+    PDev *pdev = (PDev *)surf->dhpdev;
+
+    RESTORE_POINT(pdev, surf, NULL, NULL);
+
+    if (pdev && pdev->capture_buf) {
+        RECTL line;
+
+        line.left = x1;
+        line.top = y1;
+        line.right = x2;
+        line.bottom = y2;
+        CaptureCall(pdev, CALL_COUNTER_LINE_TO, surf, NULL, NULL, clip, NULL, bounds, &line,
+                    brush, mix, 0, NULL, NULL, NULL);
+    }
+
+    PERF_CALL(pdev, CALL_COUNTER_LINE_TO,
+              DrvLineTo(surf, clip, brush, x1, y1, x2, y2, bounds, mix));
+}
+
+static BOOL APIENTRY PerfPlgBlt(SURFOBJ *dest, SURFOBJ *src, SURFOBJ *mask, CLIPOBJ *clip,
+                                XLATEOBJ *color_trans, COLORADJUSTMENT *color_adjust,
+                                POINTL *brush_pos, POINTFIX *points, RECTL *src_rect,
+                                POINTL *mask_pos, ULONG mode)
+{
+    PDev *pdev = PerfGetPDev(dest, src);
+
+    RESTORE_POINT(pdev, dest, src, mask);
+
+    if (pdev && pdev->capture_buf) {
+        CaptureCall(pdev, CALL_COUNTER_PLG_BLT, dest, src, mask, clip, color_trans, NULL,
+                    src_rect, NULL, 0xcccc, mode, NULL, NULL, NULL);
+    }
+
+    PERF_CALL(pdev, CALL_COUNTER_PLG_BLT,
+              DrvPlgBlt(dest, src, mask, clip, color_trans, color_adjust, brush_pos, points,
+                        src_rect, mask_pos, mode));
+}
+
 static DRVFN drv_calls[] = {
     {INDEX_DrvDisableDriver, (PFN)DrvDisableDriver},
     {INDEX_DrvEscape, (PFN)DrvEscape},
@@ -54,31 +350,26 @@ static DRVFN drv_calls[] = {
     {INDEX_DrvAssertMode, (PFN)DrvAssertMode},
     {INDEX_DrvGetModes, (PFN)DrvGetModes},
     {INDEX_DrvSynchronize, (PFN)DrvSynchronize},
-    {INDEX_DrvCopyBits, (PFN)DrvCopyBits},
-    {INDEX_DrvBitBlt, (PFN)DrvBitBlt},
-    {INDEX_DrvTextOut, (PFN)DrvTextOut},
-    {INDEX_DrvStrokePath, (PFN)DrvStrokePath},
+    {INDEX_DrvCopyBits, (PFN)PerfCopyBits},
+    {INDEX_DrvBitBlt, (PFN)PerfBitBlt},
+    {INDEX_DrvTextOut, (PFN)PerfTextOut},
+    {INDEX_DrvStrokePath, (PFN)PerfStrokePath},
     {INDEX_DrvRealizeBrush, (PFN)DrvRealizeBrush},
     {INDEX_DrvSetPointerShape, (PFN)DrvSetPointerShape},
     {INDEX_DrvMovePointer, (PFN)DrvMovePointer},
-    {INDEX_DrvStretchBlt, (PFN)DrvStretchBlt},
-    {INDEX_DrvStretchBltROP, (PFN)DrvStretchBltROP},
-    {INDEX_DrvTransparentBlt, (PFN)DrvTransparentBlt},
-    {INDEX_DrvAlphaBlend, (PFN)DrvAlphaBlend},
+    {INDEX_DrvStretchBlt, (PFN)PerfStretchBlt},
+    {INDEX_DrvStretchBltROP, (PFN)PerfStretchBltROP},
+    {INDEX_DrvTransparentBlt, (PFN)PerfTransparentBlt},
+    {INDEX_DrvAlphaBlend, (PFN)PerfAlphaBlend},
     {INDEX_DrvCreateDeviceBitmap, (PFN)DrvCreateDeviceBitmap},
     {INDEX_DrvDeleteDeviceBitmap, (PFN)DrvDeleteDeviceBitmap},
-
-#ifdef CALL_TEST
-    {INDEX_DrvFillPath, (PFN)DrvFillPath},
-    {INDEX_DrvGradientFill, (PFN)DrvGradientFill},
-    {INDEX_DrvLineTo, (PFN)DrvLineTo},
-    {INDEX_DrvPlgBlt, (PFN)DrvPlgBlt},
-    {INDEX_DrvStrokeAndFillPath, (PFN)DrvStrokeAndFillPath},
-#endif
+    {INDEX_DrvFillPath, (PFN)PerfFillPath},
+    {INDEX_DrvStrokeAndFillPath, (PFN)PerfStrokeAndFillPath},
+    {INDEX_DrvGradientFill, (PFN)PerfGradientFill},
+    {INDEX_DrvLineTo, (PFN)PerfLineTo},
+    {INDEX_DrvPlgBlt, (PFN)PerfPlgBlt},
 };
 
-#ifdef CALL_TEST
-
 typedef struct CallCounter {
     const char *name;
     BOOL effective;
@@ -91,7 +382,7 @@ static CallCounterInfo counters_info[NUM_CALL_COUNTERS] = {
     { "DrvStrokePath", TRUE},
     { "DrvStretchBlt", FALSE},
     { "DrvStretchBltROP", TRUE},
-    { "TransparentBlt", FALSE},
+    { "DrvTransparentBlt", FALSE},
     { "DrvAlphaBlend", FALSE},
 
     { "DrvFillPath", FALSE},
@@ -101,22 +392,236 @@ static CallCounterInfo counters_info[NUM_CALL_COUNTERS] = {
     { "DrvStrokeAndFillPath", FALSE},
 };
 
-#endif
-
 #define DBG_LEVEL 0
 
-void DebugPrintV(PDev *pdev, const char *message, va_list ap)
+// queued messages are handed to the device once the oldest of them is this old, or when
+// the drawing call that queued them returns
+#define LOG_FLUSH_MS 100
+// longest message kept by a text record
+#define LOG_TEXT_MAX 512
+// longest string argument kept by a binary record
+#define LOG_STR_MAX 128
+
+#define LOG_RECORD_BASE ((UINT32)OFFSETOF(LogRecord, args))
+#define LOG_RECORD_MAX_SIZE MAX(LOG_RECORD_BASE + LOG_TEXT_MAX, LOG_RECORD_BASE + \
+                                LOG_RECORD_MAX_ARGS * (sizeof(ULONG_PTR) + LOG_STR_MAX))
+
+enum {
+    LOG_ARG_WORD,
+    LOG_ARG_STR,
+};
+
+/* Find the argument slots of message. Returns -1 for the conversions that are not kept in
+ * binary form (wide strings, floating point, '*' widths), such messages are formatted right
+ * away. */
+static int LogParseArgs(const char *message, UINT8 *kinds)
 {
-    if (pdev && pdev->log_buf) {
-        EngAcquireSemaphore(pdev->print_sem);
-        _snprintf(pdev->log_buf, QXL_LOG_BUF_SIZE, QXLDD_DEBUG_PREFIX);
-        _vsnprintf(pdev->log_buf + strlen(QXLDD_DEBUG_PREFIX),
-                   QXL_LOG_BUF_SIZE - strlen(QXLDD_DEBUG_PREFIX), message, ap);
+    const char *now = message;
+    int nargs = 0;
+    int slots;
+
+    for (;;) {
+        while (*now && *now != '%') {
+            now++;
+        }
+        if (!*now++) {
+            break;
+        }
+        if (*now == '%') {
+            now++;
+            continue;
+        }
+        while (*now == '-' || *now == '+' || *now == ' ' || *now == '#' || *now == '.' ||
+               (*now >= '0' && *now <= '9')) {
+            now++;
+        }
+        slots = 1;
+        if (*now == 'l' && now[1] == 'l') {
+            now += 2;
+            slots = sizeof(UINT64) / sizeof(ULONG_PTR);
+        } else if (now[0] == 'I' && now[1] == '6' && now[2] == '4') {
+            now += 3;
+            slots = sizeof(UINT64) / sizeof(ULONG_PTR);
+        } else if (*now == 'l' || *now == 'h') {
+            if (*now++ == 'l' && *now == 's') {
+                return -1;
+            }
+        }
+        switch (*now++) {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        case 'c':
+        case 'p':
+            while (slots--) {
+                if (nargs == LOG_RECORD_MAX_ARGS) {
+                    return -1;
+                }
+                kinds[nargs++] = LOG_ARG_WORD;
+            }
+            break;
+        case 's':
+            if (nargs == LOG_RECORD_MAX_ARGS) {
+                return -1;
+            }
+            kinds[nargs++] = LOG_ARG_STR;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return nargs;
+}
+
+static void LogQueueAppend(LogQueue *queue, const char *message, va_list ap)
+{
+    LogRecord *record = (LogRecord *)((UINT8 *)queue->data + queue->used);
+    UINT8 kinds[LOG_RECORD_MAX_ARGS];
+    UINT8 *payload;
+    int nargs;
+    int len;
+    int i;
+
+    if ((nargs = LogParseArgs(message, kinds)) < 0) {
+        len = _vsnprintf((char *)record->args, LOG_TEXT_MAX, message, ap);
+        if (len < 0 || len >= LOG_TEXT_MAX) {
+            len = LOG_TEXT_MAX - 1;
+            ((char *)record->args)[len] = '\0';
+        }
+        record->nargs = 0;
+        record->str_mask = 0;
+        record->format = NULL;
+        record->size = (UINT16)ALIGN(LOG_RECORD_BASE + len + 1, sizeof(ULONG_PTR));
+        queue->used += record->size;
+        return;
+    }
+
+    record->nargs = (UINT8)nargs;
+    record->str_mask = 0;
+    record->format = message;
+    payload = (UINT8 *)&record->args[nargs];
+    for (i = 0; i < nargs; i++) {
+        if (kinds[i] == LOG_ARG_STR) {
+            const char *str = va_arg(ap, const char *);
+            UINT8 *start = payload;
+
+            if (!str) {
+                str = "(null)";
+            }
+            while (*str && payload - start < LOG_STR_MAX - 1) {
+                *payload++ = *str++;
+            }
+            *payload++ = '\0';
+            record->args[i] = (ULONG_PTR)(start - (UINT8 *)record);
+            record->str_mask |= (UINT8)(1 << i);
+        } else {
+            record->args[i] = va_arg(ap, ULONG_PTR);
+        }
+    }
+    record->size = (UINT16)ALIGN(payload - (UINT8 *)record, sizeof(ULONG_PTR));
+    queue->used += record->size;
+}
+
+/* Format record, prefixed, into buf. Returns the formatted length or -1 if it doesn't fit. */
+static int LogFormat(LogRecord *record, char *buf, int size)
+{
+    ULONG_PTR args[LOG_RECORD_MAX_ARGS];
+    int prefix_len = sizeof(QXLDD_DEBUG_PREFIX) - 1;
+    int len;
+    int i;
+
+    if (size <= prefix_len) {
+        return -1;
+    }
+    RtlCopyMemory(buf, QXLDD_DEBUG_PREFIX, prefix_len);
+    buf += prefix_len;
+    size -= prefix_len;
+    if (!record->format) {
+        len = _snprintf(buf, size, "%s", (char *)record->args);
+    } else {
+        for (i = 0; i < record->nargs; i++) {
+            args[i] = (record->str_mask & (1 << i)) ? (ULONG_PTR)record + record->args[i] :
+                                                      record->args[i];
+        }
+        len = _vsnprintf(buf, size, record->format, (va_list)args);
+    }
+    return (len < 0 || len >= size) ? -1 : prefix_len + len;
+}
+
+/* Hand all queued records to the device, one log port notify per full log_buf. Called with
+ * print_sem held. */
+static void LogFlush(PDev *pdev)
+{
+    LogQueue *queue = &pdev->log_queue;
+    char *buf = (char *)pdev->log_buf;
+    UINT32 offset;
+    int pos = 0;
+    int len;
+
+    queue->flushing = TRUE;
+    for (offset = 0; offset < queue->used; offset += ((LogRecord *)((UINT8 *)queue->data +
+                                                                    offset))->size) {
+        LogRecord *record = (LogRecord *)((UINT8 *)queue->data + offset);
+
+        if ((len = LogFormat(record, buf + pos, QXL_LOG_BUF_SIZE - pos)) < 0 && pos) {
+            buf[pos] = '\0';
+            sync_io(pdev, pdev->log_port, 0);
+            pos = 0;
+            len = LogFormat(record, buf, QXL_LOG_BUF_SIZE);
+        }
+        if (len < 0) {
+            // doesn't fit even an empty log_buf, send it truncated
+            len = QXL_LOG_BUF_SIZE - 1;
+        }
+        pos += len;
+    }
+    if (pos) {
+        buf[pos] = '\0';
         sync_io(pdev, pdev->log_port, 0);
+    }
+    queue->used = 0;
+    queue->flushing = FALSE;
+}
+
+static void DebugLogV(PDev *pdev, int level, const char *message, va_list ap)
+{
+    LogQueue *queue;
+    ENG_TIME_FIELDS now;
+
+    if (!pdev || !pdev->log_buf || !pdev->print_sem) {
+        EngDebugPrint(QXLDD_DEBUG_PREFIX, (PCHAR)message, ap);
+        return;
+    }
+
+    queue = &pdev->log_queue;
+    EngAcquireSemaphore(pdev->print_sem);
+    if (queue->flushing) {
+        // printed by the flush itself (i.e. an io error), don't touch the queue under it
         EngReleaseSemaphore(pdev->print_sem);
-    } else {
         EngDebugPrint(QXLDD_DEBUG_PREFIX, (PCHAR)message, ap);
+        return;
+    }
+    if (LOG_QUEUE_SIZE - queue->used < LOG_RECORD_MAX_SIZE) {
+        LogFlush(pdev);
     }
+    EngQueryLocalTime(&now);
+    if (!queue->used) {
+        queue->first_time = now;
+    }
+    LogQueueAppend(queue, message, ap);
+    // errors go out at once, they often precede a break or a crash
+    if (level == 0 || eng_time_diff_ms(&now, &queue->first_time) >= LOG_FLUSH_MS) {
+        LogFlush(pdev);
+    }
+    EngReleaseSemaphore(pdev->print_sem);
+}
+
+void DebugPrintV(PDev *pdev, const char *message, va_list ap)
+{
+    DebugLogV(pdev, 0, message, ap);
 }
 
 void DebugPrint(PDev *pdev, int level, const char *message, ...)
@@ -127,10 +632,22 @@ void DebugPrint(PDev *pdev, int level, const char *message, ...)
         return;
     }
     va_start(ap, message);
-    DebugPrintV(pdev, message, ap);
+    DebugLogV(pdev, level, message, ap);
     va_end(ap);
 }
 
+void DebugFlush(PDev *pdev)
+{
+    if (!pdev || !pdev->log_buf || !pdev->print_sem) {
+        return;
+    }
+    EngAcquireSemaphore(pdev->print_sem);
+    if (pdev->log_queue.used && !pdev->log_queue.flushing) {
+        LogFlush(pdev);
+    }
+    EngReleaseSemaphore(pdev->print_sem);
+}
+
 #define DRIVER_VERSION 1
 #define OS_VERSION_MAJOR 5
 #define OS_VERSION_MINOR 0
@@ -272,6 +789,28 @@ static void SetMonitorConfig(PDev *pdev,    QXLHead * esc_config)
     async_io(pdev, ASYNCABLE_MONITOR_CONFIG, 0);
 }
 
+static void GetPerfStats(PDev *pdev, QXLPerfStats *stats)
+{
+    int i;
+    int j;
+
+    RtlZeroMemory(stats, sizeof(*stats));
+    stats->version = QXL_PERF_STATS_VERSION;
+    stats->enabled = pdev->perf_enabled;
+    stats->num_calls = NUM_CALL_COUNTERS;
+    stats->num_waits = QXL_PERF_NUM_WAITS;
+    stats->frequency = pdev->perf_frequency;
+    for (i = 0; i < NUM_CALL_COUNTERS; i++) {
+        const char *name = counters_info[i].name;
+
+        for (j = 0; name[j] && j < QXL_PERF_NAME_SIZE - 1; j++) {
+            stats->call_names[i][j] = name[j];
+        }
+        stats->calls[i] = pdev->perf_calls[i];
+    }
+    RtlCopyMemory(stats->waits, pdev->perf_waits, sizeof(stats->waits));
+}
+
 ULONG DrvEscape(SURFOBJ *pso, ULONG iEsc, ULONG cjIn, PVOID pvIn,
                 ULONG cjOut, PVOID pvOut)
 {
@@ -304,11 +843,184 @@ ULONG DrvEscape(SURFOBJ *pso, ULONG iEsc, ULONG cjIn, PVOID pvIn,
         RetVal = 1;
         break;
     }
+    case QXL_ESCAPE_UPDATE_FREQ_PARAMS:
+        DEBUG_PRINT((pdev, 2, "%s: update freq params %p\n", __FUNCTION__, pdev));
+        if (pdev == NULL || cjIn != sizeof(QXLUpdateFreqParams))
+            break;
+
+        if (!SetUpdateFreqParams(pdev, (QXLUpdateFreqParams *)pvIn)) {
+            DEBUG_PRINT((pdev, 0, "%s: bad update freq params\n", __FUNCTION__));
+            goto out;
+        }
+        RetVal = 1;
+        break;
+    case QXL_ESCAPE_UPDATE_FREQ_QUERY:
+        DEBUG_PRINT((pdev, 2, "%s: update freq query %p\n", __FUNCTION__, pdev));
+        if (pdev == NULL || cjOut < sizeof(QXLUpdateFreqQuery))
+            break;
+
+        GetUpdateFreqQuery(pdev, (QXLUpdateFreqQuery *)pvOut);
+        RetVal = 1;
+        break;
+    case QXL_ESCAPE_PERF_CONTROL: {
+        DEBUG_PRINT((pdev, 2, "%s: perf control %p\n", __FUNCTION__, pdev));
+        if (pdev == NULL || cjIn != sizeof(UINT32))
+            break;
+
+        switch (*(UINT32 *)pvIn) {
+        case QXL_PERF_STOP:
+            pdev->perf_enabled = FALSE;
+            break;
+        case QXL_PERF_START:
+            pdev->perf_enabled = TRUE;
+            break;
+        case QXL_PERF_RESET:
+            RtlZeroMemory(pdev->perf_calls, sizeof(pdev->perf_calls));
+            RtlZeroMemory(pdev->perf_waits, sizeof(pdev->perf_waits));
+            break;
+        default:
+            DEBUG_PRINT((pdev, 0, "%s: bad perf command %u\n", __FUNCTION__,
+                         *(UINT32 *)pvIn));
+            goto out;
+        }
+        RetVal = 1;
+        break;
+    }
+    case QXL_ESCAPE_PERF_QUERY:
+        DEBUG_PRINT((pdev, 2, "%s: perf query %p\n", __FUNCTION__, pdev));
+        if (pdev == NULL || cjOut < sizeof(QXLPerfStats))
+            break;
+
+        GetPerfStats(pdev, (QXLPerfStats *)pvOut);
+        RetVal = 1;
+        break;
+    case QXL_ESCAPE_TRACE_CONTROL: {
+        DEBUG_PRINT((pdev, 2, "%s: trace control %p\n", __FUNCTION__, pdev));
+        if (pdev == NULL || cjIn != sizeof(UINT32))
+            break;
+
+        switch (*(UINT32 *)pvIn) {
+        case QXL_TRACE_STOP:
+            TraceStop(pdev);
+            break;
+        case QXL_TRACE_START:
+            if (!TraceStart(pdev)) {
+                goto out;
+            }
+            break;
+        default:
+            DEBUG_PRINT((pdev, 0, "%s: bad trace command %u\n", __FUNCTION__,
+                         *(UINT32 *)pvIn));
+            goto out;
+        }
+        RetVal = 1;
+        break;
+    }
+    case QXL_ESCAPE_TRACE_DRAIN:
+        DEBUG_PRINT((pdev, 2, "%s: trace drain %p\n", __FUNCTION__, pdev));
+        if (pdev == NULL || cjOut < sizeof(QXLTraceHeader))
+            break;
+
+        RetVal = TraceDrain(pdev, (QXLTraceHeader *)pvOut, cjOut);
+        break;
+    case QXL_ESCAPE_SURFACE_RESTORE:
+        DEBUG_PRINT((pdev, 2, "%s: surface restore %p\n", __FUNCTION__, pdev));
+        if (pdev == NULL || cjIn != sizeof(UINT32))
+            break;
+
+        if (*(UINT32 *)pvIn != QXL_RESTORE_EAGER && *(UINT32 *)pvIn != QXL_RESTORE_LAZY) {
+            DEBUG_PRINT((pdev, 0, "%s: bad restore mode %u\n", __FUNCTION__,
+                         *(UINT32 *)pvIn));
+            goto out;
+        }
+        pdev->lazy_restore = *(UINT32 *)pvIn == QXL_RESTORE_LAZY;
+        RetVal = 1;
+        break;
+    case QXL_ESCAPE_CURSOR_MOVES:
+        DEBUG_PRINT((pdev, 2, "%s: cursor moves %p\n", __FUNCTION__, pdev));
+        if (pdev == NULL || cjIn != sizeof(UINT32))
+            break;
+
+        if (*(UINT32 *)pvIn != QXL_CURSOR_MOVES_EACH &&
+            *(UINT32 *)pvIn != QXL_CURSOR_MOVES_COALESCE) {
+            DEBUG_PRINT((pdev, 0, "%s: bad cursor moves mode %u\n", __FUNCTION__,
+                         *(UINT32 *)pvIn));
+            goto out;
+        }
+        pdev->cursor_coalesce = *(UINT32 *)pvIn == QXL_CURSOR_MOVES_COALESCE;
+        RetVal = 1;
+        break;
+    case QXL_ESCAPE_CURSOR_CACHE_QUERY:
+        DEBUG_PRINT((pdev, 2, "%s: cursor cache query %p\n", __FUNCTION__, pdev));
+        if (pdev == NULL || cjOut < sizeof(QXLCursorCacheStats))
+            break;
+
+        GetCursorCacheStats(pdev, (QXLCursorCacheStats *)pvOut);
+        RetVal = 1;
+        break;
+    case QXL_ESCAPE_PALETTE_CACHE_QUERY:
+        DEBUG_PRINT((pdev, 2, "%s: palette cache query %p\n", __FUNCTION__, pdev));
+        if (pdev == NULL || cjOut < sizeof(QXLPaletteCacheStats))
+            break;
+
+        GetPaletteCacheStats(pdev, (QXLPaletteCacheStats *)pvOut);
+        RetVal = 1;
+        break;
+    case QXL_ESCAPE_PALETTE_CACHE_SIZE:
+        DEBUG_PRINT((pdev, 2, "%s: palette cache size %p\n", __FUNCTION__, pdev));
+        if (pdev == NULL || cjIn != sizeof(UINT32))
+            break;
+
+        if (!SetPaletteCacheSize(pdev, *(UINT32 *)pvIn)) {
+            DEBUG_PRINT((pdev, 0, "%s: bad palette cache size %u\n", __FUNCTION__,
+                         *(UINT32 *)pvIn));
+            goto out;
+        }
+        RetVal = 1;
+        break;
+    case QXL_ESCAPE_VRAM_QUERY:
+        DEBUG_PRINT((pdev, 2, "%s: vram query %p\n", __FUNCTION__, pdev));
+        if (pdev == NULL || cjOut < sizeof(QXLVRAMStats))
+            break;
+
+        GetVRAMStats(pdev, (QXLVRAMStats *)pvOut);
+        RetVal = 1;
+        break;
+    case QXL_ESCAPE_CAPTURE_CONTROL: {
+        DEBUG_PRINT((pdev, 2, "%s: capture control %p\n", __FUNCTION__, pdev));
+        if (pdev == NULL || cjIn != sizeof(UINT32))
+            break;
+
+        switch (*(UINT32 *)pvIn) {
+        case QXL_CAPTURE_STOP:
+            CaptureStop(pdev);
+            break;
+        case QXL_CAPTURE_START:
+            if (!CaptureStart(pdev)) {
+                goto out;
+            }
+            break;
+        default:
+            DEBUG_PRINT((pdev, 0, "%s: bad capture command %u\n", __FUNCTION__,
+                         *(UINT32 *)pvIn));
+            goto out;
+        }
+        RetVal = 1;
+        break;
+    }
+    case QXL_ESCAPE_CAPTURE_DRAIN:
+        DEBUG_PRINT((pdev, 2, "%s: capture drain %p\n", __FUNCTION__, pdev));
+        if (pdev == NULL || cjOut < sizeof(QXLCaptureHeader))
+            break;
+
+        RetVal = CaptureDrain(pdev, (QXLCaptureHeader *)pvOut, cjOut);
+        break;
     default:
         DEBUG_PRINT((NULL, 1, "%s: unhandled escape code %d\n", __FUNCTION__, iEsc));
         RetVal = 0;
     }
 
+out:
     DEBUG_PRINT((NULL, 1, "%s: end\n", __FUNCTION__));
     return RetVal;
 }
@@ -590,14 +1302,16 @@ err1:
 #ifdef DBG
 static void DebugCountAliveSurfaces(PDev *pdev)
 {
-    UINT32 i;
+    RingItem *item;
     SurfaceInfo *surface_info;
     int total = 0;
     int of_pdev = 0;
     int no_surf_obj = 0;
 
-    for (i = 0 ; i < pdev->n_surfaces; ++i) {
-        surface_info = GetSurfaceInfo(pdev, i);
+    // surface 0 first, then the live ring
+    surface_info = &pdev->surface0_info;
+    item = RingGetHead(pdev, &pdev->live_surfaces);
+    for (;;) {
         if (surface_info->draw_area.base_mem != NULL) {
             total++;
             // all should belong to the same pdev
@@ -608,6 +1322,11 @@ static void DebugCountAliveSurfaces(PDev *pdev)
                 }
             }
         }
+        if (!item) {
+            break;
+        }
+        surface_info = LIVE_SURFACE(item);
+        item = RingNext(pdev, &pdev->live_surfaces, item);
     }
     DEBUG_PRINT((pdev, 1, "%s: %p: %d / %d / %d (total,pdev,no_surf_obj)\n", __FUNCTION__, pdev,
                 total, of_pdev, no_surf_obj));
@@ -713,6 +1432,8 @@ static VOID UpdateMainSlot(PDev *pdev, MemSlot *slot)
 
 static void RemoveVRamSlot(PDev *pdev)
 {
+    // an update in flight may still read from the slot
+    async_io_wait(pdev);
     sync_io(pdev, pdev->memslot_del_port, pdev->vram_mem_slot);
     pdev->vram_slot_initialized = FALSE;
 }
@@ -1033,12 +1754,16 @@ static void FlushSurfaces(PDev *pdev)
     UINT32 surface_id;
     SurfaceInfo *surface_info;
     SURFOBJ *surf_obj;
+    RingItem *item;
     RECTL area = {0, 0, 0, 0};
 
     if (pdev->pci_revision < QXL_REVISION_STABLE_V10) {
         DEBUG_PRINT((pdev, 1, "%s: revision too old for QXL_IO_FLUSH_SURFACES\n", __FUNCTION__));
-        for (surface_id = pdev->n_surfaces - 1; surface_id >  0 ; --surface_id) {
-            surface_info = GetSurfaceInfo(pdev, surface_id);
+        BeginSurfaceWalk(pdev);
+        for (item = RingGetHead(pdev, &pdev->live_surfaces); item;
+             item = RingNext(pdev, &pdev->live_surfaces, item)) {
+            surface_info = LIVE_SURFACE(item);
+            surface_id = GetLiveSurfaceId(pdev, surface_info);
 
             if (!surface_info->draw_area.base_mem) {
                 continue;
@@ -1049,8 +1774,11 @@ static void FlushSurfaces(PDev *pdev)
             }
             area.right = surf_obj->sizlBitmap.cx;
             area.bottom = surf_obj->sizlBitmap.cy;
-            UpdateArea(pdev,&area, surface_id);
+            UpdateDirtyArea(pdev, &area, surface_id);
         }
+        EndSurfaceWalk(pdev);
+        // don't leave a background update in flight, the caller reads the surfaces next
+        async_io_wait(pdev);
     } else {
         async_io(pdev, ASYNCABLE_FLUSH_SURFACES, 0);
     }
@@ -1072,6 +1800,7 @@ static BOOL FlushRelease(PDev *pdev)
         ReleaseCacheDeviceMemoryResources(pdev);
         EmptyReleaseRing(pdev);
         /* Get the last free list onto the release ring */
+        async_io_wait(pdev);
         sync_io(pdev, pdev->flush_release_port, 0);
         DEBUG_PRINT((pdev, 4, "%s after FLUSH_RELEASE\n", __FUNCTION__));
         /* And release that. mspace allocators should be clean after. */
@@ -1152,6 +1881,7 @@ BOOL DrvAssertMode(DHPDEV in_pdev, BOOL enable)
         }
     }
     DEBUG_PRINT((pdev, 1, "%s: 0x%lx exit %d\n", __FUNCTION__, pdev, enable));
+    DebugFlush(pdev);
     return ret;
 }
 
@@ -1364,14 +2094,13 @@ BOOL APIENTRY DrvStrokePath(SURFOBJ *surf, PATHOBJ *path, CLIPOBJ *clip, XFORMOB
     DEBUG_PRINT((pdev, 3, "%s\n", __FUNCTION__));
     ASSERT(pdev, surf && path && line_attr && clip);
 
-
-    if (line_attr->fl & (LA_STYLED | LA_ALTERNATE | LA_GEOMETRIC)) { //for now
-        // punt back to GDI result in infinite recursion
-        //return EngStrokePath(surf, path, clip, width_transform, brush, brush_pos, line_attr, mix);
+    if (line_attr->fl & LA_GEOMETRIC) {
+        // GCAPS_GEOMETRICWIDE isn't set, as the device ignores the width, joins and
+        // caps of QXLLineAttr. Failing makes GDI break the stroke down into fills.
+        DEBUG_PRINT((pdev, 5, "%s: geometric line\n", __FUNCTION__));
+        return FALSE;
     }
 
-    ASSERT(pdev, (line_attr->fl & LA_GEOMETRIC) == 0); /* We should not get these */
-
     PATHOBJ_vGetBounds(path, &fx_area);
     FXToRect(&area, &fx_area);
 
@@ -1437,6 +2166,224 @@ err:
     return FALSE;
 }
 
+BOOL APIENTRY DrvLineTo(SURFOBJ *surf, CLIPOBJ *clip, BRUSHOBJ *brush, LONG x1, LONG y1,
+                        LONG x2, LONG y2, RECTL *bounds, MIX mix)
+{
+    QXLDrawable *drawable;
+    LINEATTRS line_attr;
+    POINTL brush_pos;
+    POINTFIX from;
+    POINTFIX to;
+    RECTL area;
+    PDev *pdev;
+    ROP3Info *fore_rop;
+    ROP3Info *back_rop;
+    BOOL h_or_v_line;
+
+    if (!(pdev = (PDev *)surf->dhpdev)) {
+        DEBUG_PRINT((NULL, 0, "%s: err no pdev\n", __FUNCTION__));
+        return TRUE;
+    }
+
+    PUNT_IF_DISABLED(pdev);
+
+    CountCall(pdev, CALL_COUNTER_LINE_TO);
+
+    DEBUG_PRINT((pdev, 3, "%s\n", __FUNCTION__));
+
+    area.left = MIN(x1, x2);
+    area.right = MAX(x1, x2) + 1;
+    area.top = MIN(y1, y2);
+    area.bottom = MAX(y1, y2) + 1;
+    h_or_v_line = x1 == x2 || y1 == y2;
+
+    if (clip) {
+        if (clip->iDComplexity == DC_TRIVIAL) {
+            clip = NULL;
+        } else {
+            SectRect(&clip->rclBounds, &area, &area);
+            if (IsEmptyRect(&area)) {
+                DEBUG_PRINT((pdev, 1, "%s: empty rect after clip\n", __FUNCTION__));
+                return TRUE;
+            }
+        }
+    }
+
+    if (!(drawable = Drawable(pdev, QXL_DRAW_STROKE, &area, clip, GetSurfaceId(surf)))) {
+        return FALSE;
+    }
+
+    fore_rop = &rops2[(mix - 1) & 0x0f];
+    back_rop = &rops2[((mix >> 8) - 1) & 0x0f];
+
+    if (!((fore_rop->flags | back_rop->flags) & ROP3_BRUSH)) {
+        drawable->u.stroke.brush.type = SPICE_BRUSH_TYPE_NONE;
+    } else {
+        // LineTo has no brush origin, patterns are aligned to the surface
+        brush_pos.x = brush_pos.y = 0;
+        if (!QXLGetBrush(pdev, drawable, &drawable->u.stroke.brush, brush, &brush_pos,
+                         &drawable->surfaces_dest[0], &drawable->surfaces_rects[0])) {
+            goto err;
+        }
+    }
+
+    from.x = x1 << 4;
+    from.y = y1 << 4;
+    to.x = x2 << 4;
+    to.y = y2 << 4;
+    if (!QXLGetLinePath(pdev, drawable, &drawable->u.stroke.path, &from, &to)) {
+        goto err;
+    }
+    drawable->u.stroke.fore_mode = fore_rop->method_data;
+    drawable->u.stroke.back_mode = back_rop->method_data;
+
+    // a solid cosmetic line
+    RtlZeroMemory(&line_attr, sizeof(line_attr));
+    if (!GetCosmeticAttr(pdev, drawable, &drawable->u.stroke.attr, &line_attr)) {
+        goto err;
+    }
+
+    drawable->effect = fore_rop->effect;
+    if (drawable->effect == QXL_EFFECT_OPAQUE && !h_or_v_line) {
+        drawable->effect = QXL_EFFECT_OPAQUE_BRUSH;
+    }
+
+    PushDrawable(pdev, drawable);
+    DEBUG_PRINT((pdev, 4, "%s: done\n", __FUNCTION__));
+    return TRUE;
+
+err:
+    ReleaseOutput(pdev, drawable->release_info.id);
+    return FALSE;
+}
+
+static QXLRESULT FillPath(PDev *pdev, SURFOBJ *surf, PATHOBJ *path, CLIPOBJ *clip,
+                          BRUSHOBJ *brush, POINTL *brush_pos, MIX mix, FLONG options)
+{
+    QXLDrawable *drawable;
+    RECTFX fx_area;
+    RECTL area;
+    RECTL bounds;
+    ROP3Info *rop_info;
+    QXLRESULT res;
+
+    rop_info = &rops2[(mix - 1) & 0x0f];
+    if (rop_info->effect == QXL_EFFECT_NOP) {
+        return QXL_SUCCESS;
+    }
+    if (!(rop_info->flags & ROP3_BRUSH) || (((mix >> 8) ^ mix) & 0xff)) {
+        // blackness/whiteness/invers and patterns with a different back rop
+        DEBUG_PRINT((pdev, 5, "%s: unsupported mix 0x%x\n", __FUNCTION__, mix));
+        return QXL_UNSUPPORTED;
+    }
+
+    if (!PrepareBrush(brush)) {
+        return QXL_FAILED;
+    }
+
+    PATHOBJ_vGetBounds(path, &fx_area);
+    FXToRect(&area, &fx_area);
+    bounds.left = bounds.top = 0;
+    bounds.right = surf->sizlBitmap.cx;
+    bounds.bottom = surf->sizlBitmap.cy;
+    SectRect(&area, &bounds, &area);
+    if (clip && clip->iDComplexity != DC_TRIVIAL) {
+        SectRect(&clip->rclBounds, &area, &area);
+    }
+    if (IsEmptyRect(&area)) {
+        DEBUG_PRINT((pdev, 1, "%s: empty rect\n", __FUNCTION__));
+        return QXL_SUCCESS;
+    }
+
+    if (!(drawable = Drawable(pdev, QXL_DRAW_FILL, &area, NULL, GetSurfaceId(surf)))) {
+        return QXL_FAILED;
+    }
+
+    if ((res = QXLGetPathClip(pdev, drawable, path, !!(options & FP_WINDINGMODE), clip, &area))) {
+        ReleaseOutput(pdev, drawable->release_info.id);
+        return res;
+    }
+
+    if (!QXLGetBrush(pdev, drawable, &drawable->u.fill.brush, brush, brush_pos,
+                     &drawable->surfaces_dest[0], &drawable->surfaces_rects[0])) {
+        ReleaseOutput(pdev, drawable->release_info.id);
+        return QXL_FAILED;
+    }
+    drawable->u.fill.mask.bitmap = 0;
+    drawable->u.fill.rop_descriptor = rop_info->method_data;
+    drawable->effect = rop_info->effect;
+
+    PushDrawable(pdev, drawable);
+    return QXL_SUCCESS;
+}
+
+BOOL APIENTRY DrvFillPath(SURFOBJ *surf, PATHOBJ *path, CLIPOBJ *clip, BRUSHOBJ *brush,
+                          POINTL *brush_pos, MIX mix, FLONG options)
+{
+    PDev *pdev;
+    QXLRESULT res;
+
+    if (!(pdev = (PDev *)surf->dhpdev)) {
+        DEBUG_PRINT((NULL, 0, "%s: err no pdev\n", __FUNCTION__));
+        return TRUE;
+    }
+
+    PUNT_IF_DISABLED(pdev);
+
+    CountCall(pdev, CALL_COUNTER_FILL_PATH);
+
+    DEBUG_PRINT((pdev, 3, "%s\n", __FUNCTION__));
+
+    if ((res = FillPath(pdev, surf, path, clip, brush, brush_pos, mix, options))) {
+        if (res == QXL_UNSUPPORTED) {
+            DEBUG_PRINT((pdev, 4, "%s: call EngFillPath\n", __FUNCTION__));
+            return EngFillPath(surf, path, clip, brush, brush_pos, mix, options);
+        }
+        return FALSE;
+    }
+    DEBUG_PRINT((pdev, 4, "%s: done\n", __FUNCTION__));
+    return TRUE;
+}
+
+BOOL APIENTRY DrvStrokeAndFillPath(SURFOBJ *surf, PATHOBJ *path, CLIPOBJ *clip,
+                                   XFORMOBJ *width_transform, BRUSHOBJ *stroke_brush,
+                                   LINEATTRS *line_attr, BRUSHOBJ *fill_brush, POINTL *brush_pos,
+                                   MIX mix, FLONG options)
+{
+    PDev *pdev;
+    QXLRESULT res;
+
+    if (!(pdev = (PDev *)surf->dhpdev)) {
+        DEBUG_PRINT((NULL, 0, "%s: err no pdev\n", __FUNCTION__));
+        return TRUE;
+    }
+
+    PUNT_IF_DISABLED(pdev);
+
+    CountCall(pdev, CALL_COUNTER_STROKE_AND_FILL_PATH);
+
+    DEBUG_PRINT((pdev, 3, "%s\n", __FUNCTION__));
+
+    if ((res = FillPath(pdev, surf, path, clip, fill_brush, brush_pos, mix, options))) {
+        if (res == QXL_UNSUPPORTED) {
+            DEBUG_PRINT((pdev, 4, "%s: call EngStrokeAndFillPath\n", __FUNCTION__));
+            return EngStrokeAndFillPath(surf, path, clip, width_transform, stroke_brush,
+                                        line_attr, fill_brush, brush_pos, mix, options);
+        }
+        return FALSE;
+    }
+
+    // the outline is drawn with the same mix, over the fill
+    if (!DrvStrokePath(surf, path, clip, width_transform, stroke_brush, brush_pos, line_attr,
+                       mix)) {
+        DEBUG_PRINT((pdev, 4, "%s: call EngStrokePath\n", __FUNCTION__));
+        return EngStrokePath(surf, path, clip, width_transform, stroke_brush, brush_pos,
+                             line_attr, mix);
+    }
+    DEBUG_PRINT((pdev, 4, "%s: done\n", __FUNCTION__));
+    return TRUE;
+}
+
 HBITMAP APIENTRY DrvCreateDeviceBitmap(DHPDEV dhpdev, SIZEL size, ULONG format)
 {
     PDev *pdev;
@@ -1469,8 +2416,12 @@ HBITMAP APIENTRY DrvCreateDeviceBitmap(DHPDEV dhpdev, SIZEL size, ULONG format)
     }
     DEBUG_PRINT((pdev, 3, "%s: %p: %d\n", __FUNCTION__, pdev, surface_id));
 
-    hbitmap = CreateDeviceBitmap(pdev, size, pdev->bitmap_format, &phys_mem, &base_mem, surface_id,
-                                 DEVICE_BITMAP_ALLOCATION_TYPE_VRAM);
+    if (AdmitDeviceBitmap(pdev, size, pdev->bitmap_format)) {
+        hbitmap = CreateDeviceBitmap(pdev, size, pdev->bitmap_format, &phys_mem, &base_mem,
+                                     surface_id, DEVICE_BITMAP_ALLOCATION_TYPE_VRAM);
+    } else {
+        hbitmap = CreatePendingDeviceBitmap(pdev, size, pdev->bitmap_format, surface_id);
+    }
     if (!hbitmap) {
          DEBUG_PRINT((pdev, 3, "%s:%p CreateDeviceBitmap failed\n", __FUNCTION__, pdev));
         goto out_error2;
@@ -1530,101 +2481,4 @@ void CountCall(PDev *pdev, int counter)
     }
 }
 
-BOOL APIENTRY DrvFillPath(
-    SURFOBJ  *pso,
-    PATHOBJ  *ppo,
-    CLIPOBJ  *pco,
-    BRUSHOBJ *pbo,
-    POINTL   *pptlBrushOrg,
-    MIX       mix,
-    FLONG     flOptions)
-{
-    PDev *pdev;
-
-    pdev = (PDev *)pso->dhpdev;
-    CountCall(pdev, CALL_COUNTER_FILL_PATH);
-
-    return EngFillPath(pso, ppo, pco, pbo, pptlBrushOrg, mix, flOptions);
-}
-
-BOOL APIENTRY DrvGradientFill(
-    SURFOBJ         *psoDest,
-    CLIPOBJ         *pco,
-    XLATEOBJ        *pxlo,
-    TRIVERTEX       *pVertex,
-    ULONG            nVertex,
-    PVOID            pMesh,
-    ULONG            nMesh,
-    RECTL           *prclExtents,
-    POINTL          *pptlDitherOrg,
-    ULONG            ulMode)
-{
-    PDev *pdev;
-
-    pdev = (PDev *)psoDest->dhpdev;
-    CountCall(pdev, CALL_COUNTER_GRADIENT_FILL);
-    return EngGradientFill(psoDest, pco, pxlo, pVertex, nVertex, pMesh, nMesh, prclExtents,
-                           pptlDitherOrg, ulMode);
-}
-
-BOOL APIENTRY DrvLineTo(
-    SURFOBJ   *pso,
-    CLIPOBJ   *pco,
-    BRUSHOBJ  *pbo,
-    LONG       x1,
-    LONG       y1,
-    LONG       x2,
-    LONG       y2,
-    RECTL     *prclBounds,
-    MIX        mix)
-{
-    PDev *pdev;
-
-    pdev = (PDev *)pso->dhpdev;
-    CountCall(pdev, CALL_COUNTER_LINE_TO);
-    return EngLineTo(pso, pco, pbo, x1, y1, x2, y2, prclBounds, mix);
-}
-
-BOOL APIENTRY DrvPlgBlt(
-    SURFOBJ         *psoTrg,
-    SURFOBJ         *psoSrc,
-    SURFOBJ         *psoMsk,
-    CLIPOBJ         *pco,
-    XLATEOBJ        *pxlo,
-    COLORADJUSTMENT *pca,
-    POINTL          *pptlBrushOrg,
-    POINTFIX        *pptfx,
-    RECTL           *prcl,
-    POINTL          *pptl,
-    ULONG            iMode)
-{
-    if (psoSrc->iType == STYPE_BITMAP) {
-        PDev *pdev;
-
-        ASSERT(NULL, psoTrg && psoTrg->iType != STYPE_BITMAP && psoTrg->dhpdev);
-        pdev = (PDev *)psoTrg->dhpdev;
-        CountCall(pdev, CALL_COUNTER_PLG_BLT);
-    }
-    return EngPlgBlt(psoTrg, psoSrc, psoMsk, pco, pxlo, pca, pptlBrushOrg, pptfx, prcl, pptl,
-                     iMode);
-}
-
-BOOL APIENTRY DrvStrokeAndFillPath(
-    SURFOBJ   *pso,
-    PATHOBJ   *ppo,
-    CLIPOBJ   *pco,
-    XFORMOBJ  *pxo,
-    BRUSHOBJ  *pboStroke,
-    LINEATTRS *plineattrs,
-    BRUSHOBJ  *pboFill,
-    POINTL    *pptlBrushOrg,
-    MIX        mixFill,
-    FLONG      flOptions)
-{
-    PDev *pdev = (PDev *)pso->dhpdev;
-    CountCall(pdev, CALL_COUNTER_STROKE_AND_FILL_PATH);
-    return EngStrokeAndFillPath(pso, ppo, pco, pxo, pboStroke, plineattrs, pboFill, pptlBrushOrg,
-                                mixFill, flOptions);
-}
-
 #endif
@@ -137,6 +137,20 @@ VOID APIENTRY DrvMovePointer(SURFOBJ *surf, LONG pos_x, LONG pos_y, RECTL *area)
         return;
     }
 
+    if (pdev->capture_buf) {
+        RECTL pos;
+
+        pos.left = pos.right = pos_x;
+        pos.top = pos.bottom = pos_y;
+        CaptureCall(pdev, QXL_CAPTURE_CALL_MOVE_POINTER, surf, NULL, NULL, NULL, NULL, &pos,
+                    NULL, NULL, 0, 0, NULL, NULL, NULL);
+    }
+
+    if (pos_x >= 0 && pdev->cursor_coalesce && CoalesceCursorMove(pdev, pos_x, pos_y)) {
+        DEBUG_PRINT((pdev, 4, "%s: coalesced\n", __FUNCTION__));
+        return;
+    }
+
     cursor_cmd = CursorCmd(pdev);
     if (pos_x < 0) {
         cursor_cmd->type = QXL_CURSOR_HIDE;
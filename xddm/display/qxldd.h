@@ -87,17 +87,19 @@ typedef struct Ring {
 
 #define IMAGE_POOL_SIZE (1 << 15)
 
-#define CURSOR_CACHE_SIZE (1 << 6)
-#define CURSOR_HASH_SIZE (CURSOR_CACHE_SIZE << 1)
+/* The cursor cache is sized from device memory, between these many entries */
+#define CURSOR_CACHE_MIN (1 << 4)
+#define CURSOR_CACHE_MAX (1 << 8)
+#define CURSOR_HASH_SIZE (CURSOR_CACHE_MAX << 1)
 #define CURSOR_HASH_NASKE (CURSOR_HASH_SIZE - 1)
 
-#define PALETTE_CACHE_SIZE (1 << 6)
-#define PALETTE_HASH_SIZE (PALETTE_CACHE_SIZE << 1)
+#define PALETTE_CACHE_SIZE (1 << 6) /* default, set by QXL_ESCAPE_PALETTE_CACHE_SIZE */
+#define PALETTE_CACHE_MAX (1 << 8)
+#define PALETTE_HASH_SIZE (PALETTE_CACHE_MAX << 1)
 #define PALETTE_HASH_NASKE (PALETTE_HASH_SIZE - 1)
 
 //#define CALL_TEST
 
-#ifdef CALL_TEST
 enum {
     CALL_COUNTER_COPY_BITS,
     CALL_COUNTER_BIT_BLT,
@@ -116,9 +118,9 @@ enum {
 
     NUM_CALL_COUNTERS,
 };
-#endif
 
 typedef struct QuicData QuicData;
+typedef struct PathClipInfo PathClipInfo;
 
 #define IMAGE_KEY_HASH_SIZE (1 << 15)
 #define IMAGE_KEY_HASH_MASK (IMAGE_KEY_HASH_SIZE - 1)
@@ -145,10 +147,44 @@ typedef struct UpdateTrace {
     RingItem link;
     UINT32 last_time;
     RECTL area;
+    RECTL src_area;
     HSURF hsurf;
     UINT8 count;
+    UINT8 streaming;
 } UpdateTrace;
 
+/* The primary surface is covered by a coarse UPDATE_GRID_DIM x UPDATE_GRID_DIM
+ * grid. Each cell tracks how fast it is being updated by copies, so that
+ * video-rate regions skip hashing/caching while static UI keeps using the cache.
+ */
+#define UPDATE_GRID_DIM 32
+typedef struct UpdateCell {
+    UINT32 last_time;
+    UINT8 count;     /* consecutive fast updates (saturating) */
+    UINT8 streaming; /* current decision for the cell */
+} UpdateCell;
+
+#define LOG_QUEUE_SIZE (16 * 1024)
+#define LOG_RECORD_MAX_ARGS 8
+
+/* Debug messages are queued and handed to the device log port in batches. Binary records
+ * keep the format and its raw arguments (copies of strings included) and are formatted at
+ * flush time, text records hold an already formatted message. */
+typedef struct LogRecord {
+    UINT16 size;          /* record size, including args and payload */
+    UINT8 nargs;          /* argument slots of binary records, 0 for text records */
+    UINT8 str_mask;       /* slots holding the record offset of a copied string */
+    const char *format;
+    ULONG_PTR args[1];
+} LogRecord;
+
+typedef struct LogQueue {
+    UINT32 used;
+    UINT8 flushing;
+    ENG_TIME_FIELDS first_time; /* time of the oldest queued record */
+    ULONG_PTR data[LOG_QUEUE_SIZE / sizeof(ULONG_PTR)];
+} LogQueue;
+
 typedef struct PMemSlot {
     MemSlot slot;
     QXLPHYSICAL high_bits;
@@ -160,9 +196,13 @@ typedef struct MspaceInfo {
     UINT8 *mspace_end;
 } MspaceInfo;
 
+/* The VRAM bar is split into one pool per surface size class, MSPACE_TYPE_VRAM
+ * holds the screen sized ones and is the whole bar when it is too small to split. */
 enum {
     MSPACE_TYPE_DEVRAM,
     MSPACE_TYPE_VRAM,
+    MSPACE_TYPE_VRAM_WINDOW,
+    MSPACE_TYPE_VRAM_ICON,
 
     NUM_MSPACES,
 };
@@ -202,12 +242,34 @@ struct SurfaceInfo {
     UINT8      *copy;
     ULONG       bitmap_format;
     INT32       stride;
+    RECTL       dirty; // bounds of device side drawing not yet read back into draw_area
+    RingItem    live_link; // in pdev->live_surfaces from GetFreeSurface to FreeSurfaceInfo
+    UINT8      *shadow; // RAM copy kept from the last save, valid outside save_dirty
+    RECTL       save_dirty; // bounds of drawing since shadow was last in sync
+    UINT32      last_use; // pdev->surface_use_clock of the last drawable using the surface
+    RingItem    restore_link; // in pdev->restore_surfaces while waiting for a lazy restore
+    UINT8       admit_pending; // created in RAM, moved to VRAM once it is reused
+    UINT32      admit_uses; // drawing calls using the surface while admit_pending
+    UINT8       free_pending; // freed during a surface walk, unlinked when the walk ends
     union {
         PDev *pdev;
         SurfaceInfo *next_free;
     } u;
 };
 
+#define ADMIT_HISTORY_SIZE 64
+#define SURFACE_CMD_BATCH_SIZE 32
+
+/* Device bitmaps of one size and format created in RAM, and how many of them
+ * were reused enough to be moved to VRAM. */
+typedef struct AdmitHistory {
+    SIZEL size;
+    ULONG format;
+    UINT32 created;
+    UINT32 promoted;
+    UINT32 admitted; // created directly in VRAM
+} AdmitHistory;
+
 #define SSE_MASK 15
 #define SSE_ALIGN 16
 
@@ -241,6 +303,8 @@ typedef struct PDev {
     QuicData *quic_data;
     HSEMAPHORE quic_data_sem;
 
+    PathClipInfo *path_clip; // QXLGetPathClip scratch, guarded by the GDI device lock
+
     QXLCommandRing *cmd_ring;
     QXLCursorRing *cursor_ring;
     QXLReleaseRing *release_ring;
@@ -255,6 +319,7 @@ typedef struct PDev {
     PUCHAR log_port;
     UINT8 *log_buf;
     UINT32 *log_level;
+    LogQueue log_queue;
 
     PMemSlot *mem_slots;
     UINT8 num_mem_slot;
@@ -290,6 +355,9 @@ typedef struct PDev {
     PUCHAR memslot_del_port;
     PUCHAR flush_release_port;
     UINT32 use_async;
+    UINT8 io_pending; // an async io was issued and its completion is still to be waited for
+    UINT32 update_pending_surface;
+    RECTL update_pending_area;
 
     UINT8* primary_memory_start;
     UINT32 primary_memory_size;
@@ -300,10 +368,14 @@ typedef struct PDev {
 
     Ring update_trace;
     UpdateTrace update_trace_items[NUM_UPDATE_TRACE_ITEMS];
+    UpdateCell update_grid[UPDATE_GRID_DIM * UPDATE_GRID_DIM];
+    QXLUpdateFreqParams update_freq_params;
+    QXLUpdateFreqStats update_freq_stats;
 
     UINT64 free_outputs;
 
     MspaceInfo mspaces[NUM_MSPACES];
+    QXLVRAMClassStats vram_stats[QXL_VRAM_NUM_CLASSES];
 
     /*
      * TODO: reconsider semaphores according to
@@ -325,6 +397,11 @@ typedef struct PDev {
     HSEMAPHORE print_sem;
     HSEMAPHORE cmd_sem;
     HSEMAPHORE cursor_sem; /* Protects cursor_ring */
+    QXLCursorCmd *cursor_move; /* last pushed command if it is a move */
+    UINT32 cursor_move_prod; /* cursor_ring prod it was pushed at */
+    UINT8 cursor_coalesce;
+    QXLSurfaceCmd *surface_cmd_batch[SURFACE_CMD_BATCH_SIZE]; /* protected by cmd_sem */
+    UINT32 surface_cmd_batch_len;
 
     CacheImage cache_image_pool[IMAGE_POOL_SIZE];
     Ring cache_image_lru;
@@ -332,16 +409,32 @@ typedef struct PDev {
     Ring palette_lru;
     ImageKey image_key_lookup[IMAGE_KEY_HASH_SIZE];
     struct CacheImage *image_cache[IMAGE_HASH_SIZE];
-    struct InternalCursor *cursor_cache[CURSOR_HASH_SIZE];
+    struct InternalCursor *cursor_cache[CURSOR_HASH_SIZE]; // by hsurf and iUniq
+    struct InternalCursor *cursor_content_cache[CURSOR_HASH_SIZE]; // by content hash
     UINT32 num_cursors;
+    UINT32 cursor_cache_size;
+    QXLCursorCacheStats cursor_stats;
     UINT32 last_cursor_id;
-    struct InternalPalette *palette_cache[PALETTE_HASH_SIZE];
+    struct InternalPalette *palette_cache[PALETTE_HASH_SIZE]; // by content hash
     UINT32 num_palettes;
+    UINT32 palette_cache_size;
+    UINT32 last_palette_id;
+    QXLPaletteCacheStats palette_stats;
 
     UINT32 n_surfaces;
     SurfaceInfo surface0_info;
     SurfaceInfo *surfaces_info;
     SurfaceInfo *free_surfaces;
+    Ring live_surfaces;
+    UINT32 surface_walks; // nesting of walks of the live and restore rings
+    SurfaceInfo *walk_freed_surfaces; // freed during the walks, linked by u.next_free
+    UINT32 shadow_bytes;
+    Ring restore_surfaces; // saved surfaces not restored yet, most recently used first
+    UINT32 surface_use_clock;
+    UINT8 lazy_restore;
+    UINT32 call_depth; // nesting of drawing entry points
+    AdmitHistory admit_history[ADMIT_HISTORY_SIZE];
+    UINT32 admit_pending_surfaces;
 
     UINT32 update_id;
 
@@ -364,6 +457,23 @@ typedef struct PDev {
     int num_cursor_pages;
 #endif
 
+    HSEMAPHORE trace_sem;
+    QXLTraceRecord *trace_ring; /* allocated while tracing */
+    UINT32 trace_head;
+    UINT32 trace_tail;
+    UINT32 trace_dropped;
+    QXLTraceRecord trace_draw;  /* what the drawable being built references */
+    UINT8 *capture_buf;         /* allocated while capturing, guarded by trace_sem */
+    UINT32 capture_used;
+    UINT32 capture_seq;
+    UINT32 capture_count;
+    UINT32 capture_dropped;
+
+    UINT8 perf_enabled;
+    LONGLONG perf_frequency;
+    QXLPerfHist perf_calls[NUM_CALL_COUNTERS];
+    QXLPerfHist perf_waits[QXL_PERF_NUM_WAITS];
+
 #ifdef CALL_TEST
     BOOL count_calls;
     UINT32 total_calls;
@@ -374,9 +484,11 @@ typedef struct PDev {
 
 void DebugPrintV(PDev *pdev, const char *message, va_list ap);
 void DebugPrint(PDev *pdev, int level, const char *message, ...);
+void DebugFlush(PDev *pdev);
 
 void InitResources(PDev *pdev);
 void ClearResources(PDev *pdev);
+void FlushSurfaceCmds(PDev *pdev);
 
 #ifdef CALL_TEST
 void CountCall(PDev *pdev, int counter);
@@ -384,6 +496,50 @@ void CountCall(PDev *pdev, int counter);
 #define CountCall(a, b)
 #endif
 
+static _inline void PerfHistAdd(QXLPerfHist *hist, LONGLONG ticks)
+{
+    UINT64 value = ticks > 0 ? (UINT64)ticks : 0;
+    int bucket = 0;
+
+    hist->count++;
+    hist->total += value;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+    while ((value >>= 1) && bucket < QXL_PERF_HIST_BUCKETS - 1) {
+        bucket++;
+    }
+    hist->buckets[bucket]++;
+}
+
+static _inline void PerfStart(PDev *pdev, LONGLONG *start)
+{
+    *start = 0;
+    if (pdev->perf_enabled) {
+        EngQueryPerformanceCounter(start);
+    }
+}
+
+static _inline void PerfEnd(PDev *pdev, QXLPerfHist *hist, LONGLONG *start)
+{
+    LONGLONG now;
+
+    if (!pdev->perf_enabled || !*start) {
+        return;
+    }
+    EngQueryPerformanceCounter(&now);
+    PerfHistAdd(hist, now - *start);
+}
+
+static _inline void PerfAcquireSemaphore(PDev *pdev, HSEMAPHORE sem, int wait)
+{
+    LONGLONG start;
+
+    PerfStart(pdev, &start);
+    EngAcquireSemaphore(sem);
+    PerfEnd(pdev, &pdev->perf_waits[wait], &start);
+}
+
 char *BitmapFormatToStr(int format);
 char *BitmapTypeToStr(int type);
 
@@ -428,6 +584,23 @@ static _inline void RingRemove(PDev *pdev, RingItem *item)
     item->prev = item->next = 0;
 }
 
+static _inline RingItem *RingGetHead(PDev *pdev, Ring *ring)
+{
+    ASSERT(pdev, ring->next != NULL && ring->prev != NULL);
+
+    if (RingIsEmpty(pdev, ring)) {
+        return NULL;
+    }
+    return ring->next;
+}
+
+static _inline RingItem *RingNext(PDev *pdev, Ring *ring, RingItem *item)
+{
+    ASSERT(pdev, item->next != NULL && item->prev != NULL);
+
+    return item->next == ring ? NULL : item->next;
+}
+
 static _inline RingItem *RingGetTail(PDev *pdev, Ring *ring)
 {
     RingItem *ret;
@@ -466,16 +639,45 @@ static _inline ULONG64 eng_time_diff_ms(ENG_TIME_FIELDS *b, ENG_TIME_FIELDS *a)
 #define INTERRUPT_NOT_PRESENT_TIMEOUT_MS 60000L
 #define INTERRUPT_NOT_PRESENT_TIMEOUT_100NS (INTERRUPT_NOT_PRESENT_TIMEOUT_MS * 10000L)
 
+/* Wait for the completion of an async io issued by async_io_start. Called with io_sem held,
+ * returns FALSE if the interrupt never came (async io is then disabled).
+ */
+static _inline BOOL async_io_wait_locked(PDev *pdev)
+{
+    ENG_TIME_FIELDS start, finish;
+    LARGE_INTEGER timeout;                      // 1 => 100 nanoseconds
+    ULONG64 millis;
+
+    if (!pdev->io_pending) {
+        return TRUE;
+    }
+    pdev->io_pending = FALSE;
+    /* Our Interrupt may be taken from us unexpectedly, by a surprise removal.
+     * in which case this event will never be set. This happens only during WHQL
+     * tests (pnpdtest /surprise). So instead: Wait on a timer, if we fail, stop waiting, until
+     * we get reset. We use EngQueryLocalTime because there is no way to differentiate a return on
+     * timeout from a return on event set otherwise. */
+    timeout.QuadPart = -INTERRUPT_NOT_PRESENT_TIMEOUT_100NS; // negative  => relative
+    EngQueryLocalTime(&start);
+    WAIT_FOR_EVENT(pdev, pdev->io_cmd_event, &timeout);
+    EngQueryLocalTime(&finish);
+    millis = eng_time_diff_ms(&finish, &start);
+    if (millis >= INTERRUPT_NOT_PRESENT_TIMEOUT_MS) {
+        pdev->use_async = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
 /* Write to an ioport. For some operations we support a new port that returns
  * immediatly, and completion is signaled by an interrupt that sets io_cmd_event.
  * If the pci_revision is >= QXL_REVISION_STABLE_V10, we support it, else do
  * a regular ioport write.
+ * async_io_start returns without waiting for the completion, which is waited for by
+ * async_io_wait or by the next io (the device allows a single outstanding io).
  */
-static _inline void async_io(PDev *pdev, asyncable_t op, UCHAR val)
+static _inline void async_io_start(PDev *pdev, asyncable_t op, UCHAR val)
 {
-    ENG_TIME_FIELDS start, finish;
-    LARGE_INTEGER timeout;                      // 1 => 100 nanoseconds
-    ULONG64 millis;
     BOOL is_async = FALSE;
     /*
      * calling DEBUG_PRINT after locking io_sem can cause deadlock because
@@ -486,24 +688,14 @@ static _inline void async_io(PDev *pdev, asyncable_t op, UCHAR val)
     BOOL error_bad_sync = FALSE;
 
     DEBUG_PRINT((pdev, 3, "%s: start io op %d\n", __FUNCTION__, (int)op));
+    // the io may act on surfaces whose commands are still batched
+    FlushSurfaceCmds(pdev);
     EngAcquireSemaphore(pdev->io_sem);
+    error_timeout = !async_io_wait_locked(pdev);
     if (pdev->use_async) {
         is_async = TRUE;
         WRITE_PORT_UCHAR(pdev->asyncable[op][ASYNC], val);
-        /* Our Interrupt may be taken from us unexpectedly, by a surprise removal.
-         * in which case this event will never be set. This happens only during WHQL
-         * tests (pnpdtest /surprise). So instead: Wait on a timer, if we fail, stop waiting, until
-         * we get reset. We use EngQueryLocalTime because there is no way to differentiate a return on
-         * timeout from a return on event set otherwise. */
-        timeout.QuadPart = -INTERRUPT_NOT_PRESENT_TIMEOUT_100NS; // negative  => relative
-        EngQueryLocalTime(&start);
-        WAIT_FOR_EVENT(pdev, pdev->io_cmd_event, &timeout);
-        EngQueryLocalTime(&finish);
-        millis = eng_time_diff_ms(&finish, &start);
-        if (millis >= INTERRUPT_NOT_PRESENT_TIMEOUT_MS) {
-            error_timeout = TRUE;
-            pdev->use_async = 0;
-        }
+        pdev->io_pending = TRUE;
     } else {
         is_async = FALSE;
         if (pdev->asyncable[op][SYNC] == NULL) {
@@ -518,10 +710,29 @@ static _inline void async_io(PDev *pdev, asyncable_t op, UCHAR val)
     } else if (error_bad_sync) {
         DEBUG_PRINT((pdev, 0, "%s: ERROR: trying calling sync io on NULL port %d\n", __FUNCTION__, op));
     } else {
-        DEBUG_PRINT((pdev, 3, "%s: finished op %d async %d\n", __FUNCTION__, (int)op, is_async));
+        DEBUG_PRINT((pdev, 3, "%s: issued op %d async %d\n", __FUNCTION__, (int)op, is_async));
     }
 }
 
+static _inline void async_io_wait(PDev *pdev)
+{
+    BOOL error_timeout;
+
+    EngAcquireSemaphore(pdev->io_sem);
+    error_timeout = !async_io_wait_locked(pdev);
+    EngReleaseSemaphore(pdev->io_sem);
+    if (error_timeout) {
+        DEBUG_PRINT((pdev, 0, "%s: timeout reached, disabling async io!\n", __FUNCTION__));
+    }
+}
+
+static _inline void async_io(PDev *pdev, asyncable_t op, UCHAR val)
+{
+    async_io_start(pdev, op, val);
+    async_io_wait(pdev);
+    DEBUG_PRINT((pdev, 3, "%s: finished op %d\n", __FUNCTION__, (int)op));
+}
+
 /*
  * Before the introduction of QXL_IO_*_ASYNC all io writes would return
  * only when their function was complete. Since qemu would only allow
@@ -533,6 +744,8 @@ static _inline void async_io(PDev *pdev, asyncable_t op, UCHAR val)
  */
 static _inline void sync_io(PDev *pdev, PUCHAR port, UCHAR val)
 {
+    // doesn't wait for an async io in flight, the device takes notifies and logs while
+    // one is pending. Ios that depend on its completion call async_io_wait first.
     EngAcquireSemaphore(pdev->io_sem);
     WRITE_PORT_UCHAR(port, val);
     EngReleaseSemaphore(pdev->io_sem);
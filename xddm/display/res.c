@@ -258,9 +258,11 @@ static void WaitForCursorRing(PDev* pdev)
 /* Called with cmd_sem held */
 static void WaitForCmdRing(PDev* pdev)
 {
+    LONGLONG start;
     int wait;
 
     DEBUG_PRINT((pdev, 9, "%s: 0x%lx\n", __FUNCTION__, pdev));
+    PerfStart(pdev, &start);
 
     for (;;) {
         SPICE_RING_PROD_WAIT(pdev->cmd_ring, wait);
@@ -283,6 +285,7 @@ static void WaitForCmdRing(PDev* pdev)
         WAIT_FOR_EVENT(pdev, pdev->display_event, NULL);
 #endif //SUPPORT_SURPRISE_REMOVE
     }
+    PerfEnd(pdev, &pdev->perf_waits[QXL_PERF_WAIT_CMD_RING], &start);
 }
 
 static void QXLSleep(PDev* pdev, int msec)
@@ -298,9 +301,11 @@ static void QXLSleep(PDev* pdev, int msec)
 /* Called with malloc_sem held */
 static void WaitForReleaseRing(PDev* pdev)
 {
+    LONGLONG start;
     int wait;
 
     DEBUG_PRINT((pdev, 15, "%s: 0x%lx\n", __FUNCTION__, pdev));
+    PerfStart(pdev, &start);
 
     for (;;) {
         LARGE_INTEGER timeout;
@@ -339,6 +344,7 @@ static void WaitForReleaseRing(PDev* pdev)
             sync_io(pdev, pdev->notify_oom_port, 0);
         }
     }
+    PerfEnd(pdev, &pdev->perf_waits[QXL_PERF_WAIT_RELEASE_RING], &start);
     DEBUG_PRINT((pdev, 16, "%s: 0x%lx, done\n", __FUNCTION__, pdev));
 }
 
@@ -375,7 +381,7 @@ void EmptyReleaseRing(PDev *pdev)
 {
     int count = 0;
 
-    EngAcquireSemaphore(pdev->malloc_sem);
+    PerfAcquireSemaphore(pdev, pdev->malloc_sem, QXL_PERF_WAIT_MALLOC_SEM);
     while (pdev->free_outputs || !SPICE_RING_IS_EMPTY(pdev->release_ring)) {
         FlushReleaseRing(pdev);
         count++;
@@ -400,7 +406,7 @@ static void *__AllocMem(PDev* pdev, UINT32 mspace_type, size_t size, BOOL force)
         mspace_malloc_stats(pdev->mspaces[mspace_type]._mspace);
     }
 #endif
-    EngAcquireSemaphore(pdev->malloc_sem);
+    PerfAcquireSemaphore(pdev, pdev->malloc_sem, QXL_PERF_WAIT_MALLOC_SEM);
 
     while (1) {
         /* Release lots of queued resources, before allocating, as we
@@ -446,7 +452,7 @@ static void FreeMem(PDev* pdev, UINT32 mspace_type, void *ptr)
         EngDebugBreak();
     }
 #endif
-    EngAcquireSemaphore(pdev->malloc_sem);
+    PerfAcquireSemaphore(pdev, pdev->malloc_sem, QXL_PERF_WAIT_MALLOC_SEM);
     mspace_free(pdev->mspaces[mspace_type]._mspace, ptr);
     EngReleaseSemaphore(pdev->malloc_sem);
 }
@@ -458,6 +464,154 @@ static void InitMspace(PDev *pdev, UINT32 mspace_type, UINT8 *start, size_t capa
     pdev->mspaces[mspace_type].mspace_end = start + capacity;
 }
 
+/* Sixteenths of the VRAM bar given to the window and icon pools, the screen
+ * pool gets the rest, but never less than a screen sized surface and a
+ * 1/VRAM_SCREEN_POOL_SLACK of one more. When that leaves less than
+ * VRAM_SPLIT_MIN_REST for the other pools, or for smaller bars, the bar is
+ * kept as a single pool. The split follows the mode, it is redone each time
+ * the device memory is initialized. */
+#define VRAM_WINDOW_POOL_SHARE 6
+#define VRAM_ICON_POOL_SHARE 1
+#define VRAM_SPLIT_MIN_SIZE (16 * 1024 * 1024)
+#define VRAM_SPLIT_MIN_REST (2 * 1024 * 1024)
+#define VRAM_SCREEN_POOL_SLACK 4
+
+static const UINT32 vram_class_mspace[QXL_VRAM_NUM_CLASSES] = {
+    MSPACE_TYPE_VRAM,
+    MSPACE_TYPE_VRAM_WINDOW,
+    MSPACE_TYPE_VRAM_ICON,
+};
+
+static void InitVRAMPools(PDev *pdev)
+{
+    UINT8 *start = pdev->fb;
+    size_t screen_size;
+    size_t window_size;
+    size_t icon_size;
+    size_t rest;
+
+    RtlZeroMemory(&pdev->mspaces[MSPACE_TYPE_VRAM_WINDOW], sizeof(MspaceInfo));
+    RtlZeroMemory(&pdev->mspaces[MSPACE_TYPE_VRAM_ICON], sizeof(MspaceInfo));
+
+    screen_size = (size_t)pdev->stride * pdev->resolution.cy;
+    screen_size += screen_size / VRAM_SCREEN_POOL_SLACK;
+    screen_size = MAX(screen_size, pdev->fb_size / 16 *
+                      (16 - VRAM_WINDOW_POOL_SHARE - VRAM_ICON_POOL_SHARE));
+    screen_size = (screen_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (pdev->fb_size < VRAM_SPLIT_MIN_SIZE ||
+        screen_size + VRAM_SPLIT_MIN_REST > pdev->fb_size) {
+        DEBUG_PRINT((pdev, 1, "%s: single pool of %u bytes for %dx%d\n", __FUNCTION__,
+                     pdev->fb_size, pdev->resolution.cx, pdev->resolution.cy));
+        InitMspace(pdev, MSPACE_TYPE_VRAM, pdev->fb, pdev->fb_size);
+        return;
+    }
+
+    rest = pdev->fb_size - screen_size;
+    icon_size = (rest / (VRAM_WINDOW_POOL_SHARE + VRAM_ICON_POOL_SHARE) *
+                 VRAM_ICON_POOL_SHARE) & ~(PAGE_SIZE - 1);
+    window_size = rest - icon_size;
+    DEBUG_PRINT((pdev, 1, "%s: pools of %u, %u and %u bytes for %dx%d\n", __FUNCTION__,
+                 screen_size, window_size, icon_size, pdev->resolution.cx,
+                 pdev->resolution.cy));
+    InitMspace(pdev, MSPACE_TYPE_VRAM, start, screen_size);
+    start += screen_size;
+    InitMspace(pdev, MSPACE_TYPE_VRAM_WINDOW, start, window_size);
+    start += window_size;
+    InitMspace(pdev, MSPACE_TYPE_VRAM_ICON, start, icon_size);
+}
+
+static UINT32 GetVRAMClass(PDev *pdev, size_t size)
+{
+    if (size <= QXL_VRAM_ICON_MAX_BYTES) {
+        return QXL_VRAM_CLASS_ICON;
+    }
+    if (size * 2 >= (size_t)pdev->stride * pdev->resolution.cy) {
+        return QXL_VRAM_CLASS_SCREEN;
+    }
+    return QXL_VRAM_CLASS_WINDOW;
+}
+
+/* Surfaces are placed in the pool of their size class so that icons and
+ * window bitmaps don't fragment the room left for screen sized back buffers.
+ * When it is full the larger pools are tried first, then the smaller ones,
+ * before giving up and keeping the surface out of VRAM. */
+static UINT8 *AllocSurfaceVRAM(PDev *pdev, size_t size)
+{
+    int surface_class = GetVRAMClass(pdev, size);
+    QXLVRAMClassStats *stats = &pdev->vram_stats[surface_class];
+    UINT8 *ptr;
+    int i;
+
+    stats->requests++;
+    for (i = surface_class; i >= 0; i--) {
+        if (!pdev->mspaces[vram_class_mspace[i]]._mspace) {
+            continue;
+        }
+        if ((ptr = __AllocMem(pdev, vram_class_mspace[i], size, FALSE))) {
+            goto placed;
+        }
+    }
+    for (i = surface_class + 1; i < QXL_VRAM_NUM_CLASSES; i++) {
+        if (!pdev->mspaces[vram_class_mspace[i]]._mspace) {
+            continue;
+        }
+        if ((ptr = __AllocMem(pdev, vram_class_mspace[i], size, FALSE))) {
+            goto placed;
+        }
+    }
+    stats->failed++;
+    // batched destroys only give their memory back once the device releases them
+    FlushSurfaceCmds(pdev);
+    DEBUG_PRINT((pdev, 3, "%s: no room for %u bytes, class %u: %u/%u placed, %u failed\n",
+                 __FUNCTION__, size, surface_class, stats->placed, stats->requests,
+                 stats->failed));
+    return NULL;
+
+placed:
+    if (i == surface_class) {
+        stats->placed++;
+    } else {
+        stats->overflowed++;
+    }
+    return ptr;
+}
+
+static void FreeSurfaceVRAM(PDev *pdev, UINT8 *ptr)
+{
+    int i;
+
+    for (i = 0; i < QXL_VRAM_NUM_CLASSES; i++) {
+        MspaceInfo *info = &pdev->mspaces[vram_class_mspace[i]];
+
+        if (info->_mspace && ptr >= info->mspace_start && ptr < info->mspace_end) {
+            FreeMem(pdev, vram_class_mspace[i], ptr);
+            return;
+        }
+    }
+    PANIC(pdev, "surface memory outside of the VRAM pools");
+}
+
+void GetVRAMStats(PDev *pdev, QXLVRAMStats *stats)
+{
+    int i;
+
+    RtlZeroMemory(stats, sizeof(*stats));
+    stats->version = QXL_VRAM_STATS_VERSION;
+    stats->num_classes = QXL_VRAM_NUM_CLASSES;
+    for (i = 0; i < QXL_VRAM_NUM_CLASSES; i++) {
+        MspaceInfo *info = &pdev->mspaces[vram_class_mspace[i]];
+
+        if (info->_mspace) {
+            stats->pool_size[i] = info->mspace_end - info->mspace_start;
+        }
+    }
+    RtlCopyMemory(stats->classes, pdev->vram_stats, sizeof(stats->classes));
+}
+
+#define CURSOR_ALLOC_SIZE (PAGE_SIZE << 1)
+// cached cursor shapes use up to this fraction of DEVRAM
+#define CURSOR_CACHE_DEVRAM_SHARE 32
+
 static void ResetCache(PDev *pdev)
 {
     int i;
@@ -474,13 +628,18 @@ static void ResetCache(PDev *pdev)
 
     RtlZeroMemory(pdev->image_cache, sizeof(pdev->image_cache));
     RtlZeroMemory(pdev->cursor_cache, sizeof(pdev->cursor_cache));
+    RtlZeroMemory(pdev->cursor_content_cache, sizeof(pdev->cursor_content_cache));
     RingInit(&pdev->cursors_lru);
     pdev->num_cursors = 0;
+    pdev->cursor_cache_size = MIN(MAX(pdev->num_io_pages * PAGE_SIZE /
+                                      (CURSOR_ALLOC_SIZE * CURSOR_CACHE_DEVRAM_SHARE),
+                                      CURSOR_CACHE_MIN), CURSOR_CACHE_MAX);
     pdev->last_cursor_id = 0;
 
     RtlZeroMemory(pdev->palette_cache, sizeof(pdev->palette_cache));
     RingInit(&pdev->palette_lru);
     pdev->num_palettes = 0;
+    pdev->last_palette_id = 0;
 }
 
 /* Init anything that resides on the device memory (pci vram and devram bars).
@@ -498,10 +657,12 @@ void InitDeviceMemoryResources(PDev *pdev)
     for (i = 0; i < NUM_UPDATE_TRACE_ITEMS; i++) {
          RingAdd(pdev, &pdev->update_trace, &pdev->update_trace_items[i].link);
     }
+    RtlZeroMemory(pdev->update_grid, sizeof(pdev->update_grid));
     InitMspace(pdev, MSPACE_TYPE_DEVRAM, pdev->io_pages_virt, pdev->num_io_pages * PAGE_SIZE);
-    InitMspace(pdev, MSPACE_TYPE_VRAM, pdev->fb, pdev->fb_size);
+    InitVRAMPools(pdev);
     ResetCache(pdev);
     pdev->free_outputs = 0;
+    pdev->cursor_move = NULL;
 }
 
 void InitSurfaces(PDev *pdev)
@@ -518,11 +679,25 @@ void InitSurfaces(PDev *pdev)
     for (i = 0; i < pdev->n_surfaces - 1; i++) {
         pdev->surfaces_info[i].u.next_free = &pdev->surfaces_info[i+1];
     }
+    RingInit(&pdev->live_surfaces);
+    pdev->surface_walks = 0;
+    pdev->walk_freed_surfaces = NULL;
+    pdev->shadow_bytes = 0;
+    RingInit(&pdev->restore_surfaces);
+    pdev->surface_use_clock = 0;
+    pdev->call_depth = 0;
+    pdev->admit_pending_surfaces = 0;
 }
 
 void ClearResources(PDev *pdev)
 {
+    RingItem *item;
+
     if (pdev->surfaces_info) {
+        for (item = RingGetHead(pdev, &pdev->live_surfaces); item;
+             item = RingNext(pdev, &pdev->live_surfaces, item)) {
+            SurfaceFreeShadow(pdev, LIVE_SURFACE(item));
+        }
         EngFreeMem(pdev->surfaces_info);
         pdev->surfaces_info = NULL;
     }
@@ -542,7 +717,15 @@ void ClearResources(PDev *pdev)
         pdev->cursor_sem = NULL;
     }
 
+    if (pdev->trace_sem) {
+        TraceStop(pdev);
+        CaptureStop(pdev);
+        EngDeleteSemaphore(pdev->trace_sem);
+        pdev->trace_sem = NULL;
+    }
+
     if (pdev->print_sem) {
+        DebugFlush(pdev);
         EngDeleteSemaphore(pdev->print_sem);
         pdev->print_sem = NULL;
     }
@@ -571,6 +754,25 @@ void InitResources(PDev *pdev)
 
     pdev->update_id = *pdev->dev_update_id;
 
+    pdev->update_freq_params.min_pixels = 128 * 128;
+    pdev->update_freq_params.fast_interval = 1000 / 5;
+    pdev->update_freq_params.enter_count = 20;
+    pdev->update_freq_params.leave_count = 5;
+    pdev->update_freq_params.quiet_time = 1000;
+    RtlZeroMemory(&pdev->update_freq_stats, sizeof(pdev->update_freq_stats));
+
+    pdev->lazy_restore = FALSE;
+    RtlZeroMemory(&pdev->cursor_stats, sizeof(pdev->cursor_stats));
+    RtlZeroMemory(&pdev->palette_stats, sizeof(pdev->palette_stats));
+    pdev->palette_cache_size = PALETTE_CACHE_SIZE;
+    pdev->cursor_coalesce = TRUE;
+    RtlZeroMemory(pdev->admit_history, sizeof(pdev->admit_history));
+
+    pdev->perf_enabled = FALSE;
+    EngQueryPerformanceFrequency(&pdev->perf_frequency);
+    RtlZeroMemory(pdev->perf_calls, sizeof(pdev->perf_calls));
+    RtlZeroMemory(pdev->perf_waits, sizeof(pdev->perf_waits));
+
     pdev->malloc_sem = EngCreateSemaphore();
     if (!pdev->malloc_sem) {
         PANIC(pdev, "malloc sem creation failed\n");
@@ -587,6 +789,13 @@ void InitResources(PDev *pdev)
     if (!pdev->print_sem) {
         PANIC(pdev, "print sem creation failed\n");
     }
+    pdev->trace_sem = EngCreateSemaphore();
+    if (!pdev->trace_sem) {
+        PANIC(pdev, "trace sem creation failed\n");
+    }
+    pdev->trace_ring = NULL;
+    pdev->trace_head = pdev->trace_tail = pdev->trace_dropped = 0;
+    pdev->capture_buf = NULL;
 
     ONDBG(pdev->num_outputs = 0);
     ONDBG(pdev->num_path_pages = 0);
@@ -606,6 +815,466 @@ void InitResources(PDev *pdev)
     DEBUG_PRINT((pdev, 1, "%s: exit\n", __FUNCTION__));
 }
 
+#define TRACE_RING_SIZE 8192
+
+BOOL TraceStart(PDev *pdev)
+{
+    QXLTraceRecord *ring;
+
+    if (pdev->trace_ring) {
+        return TRUE;
+    }
+    if (!(ring = EngAllocMem(FL_ZERO_MEMORY, TRACE_RING_SIZE * sizeof(QXLTraceRecord),
+                             ALLOC_TAG))) {
+        DEBUG_PRINT((pdev, 0, "%s: alloc failed\n", __FUNCTION__));
+        return FALSE;
+    }
+    EngAcquireSemaphore(pdev->trace_sem);
+    pdev->trace_head = pdev->trace_tail = pdev->trace_dropped = 0;
+    RtlZeroMemory(&pdev->trace_draw, sizeof(pdev->trace_draw));
+    pdev->trace_ring = ring;
+    EngReleaseSemaphore(pdev->trace_sem);
+    return TRUE;
+}
+
+void TraceStop(PDev *pdev)
+{
+    QXLTraceRecord *ring;
+
+    EngAcquireSemaphore(pdev->trace_sem);
+    ring = pdev->trace_ring;
+    pdev->trace_ring = NULL;
+    EngReleaseSemaphore(pdev->trace_sem);
+    if (ring) {
+        EngFreeMem(ring);
+    }
+}
+
+/* Moves as many records as fit after the header out of the ring, returns the bytes written. */
+ULONG TraceDrain(PDev *pdev, QXLTraceHeader *header, ULONG size)
+{
+    QXLTraceRecord *out = (QXLTraceRecord *)(header + 1);
+    UINT32 max_count = (size - sizeof(*header)) / sizeof(QXLTraceRecord);
+
+    header->version = QXL_TRACE_VERSION;
+    header->record_size = sizeof(QXLTraceRecord);
+    header->count = 0;
+    header->frequency = pdev->perf_frequency;
+
+    EngAcquireSemaphore(pdev->trace_sem);
+    header->dropped = pdev->trace_dropped;
+    pdev->trace_dropped = 0;
+    if (pdev->trace_ring) {
+        while (header->count < max_count && pdev->trace_tail != pdev->trace_head) {
+            out[header->count++] = pdev->trace_ring[pdev->trace_tail];
+            pdev->trace_tail = (pdev->trace_tail + 1) % TRACE_RING_SIZE;
+        }
+    }
+    EngReleaseSemaphore(pdev->trace_sem);
+    return sizeof(*header) + header->count * sizeof(QXLTraceRecord);
+}
+
+static void TracePush(PDev *pdev, QXLTraceRecord *record)
+{
+    LONGLONG now;
+    UINT32 next;
+
+    EngQueryPerformanceCounter(&now);
+    record->time = now;
+    EngAcquireSemaphore(pdev->trace_sem);
+    if (pdev->trace_ring) {
+        next = (pdev->trace_head + 1) % TRACE_RING_SIZE;
+        if (next == pdev->trace_tail) {
+            pdev->trace_dropped++;
+        } else {
+            pdev->trace_ring[pdev->trace_head] = *record;
+            pdev->trace_head = next;
+        }
+    }
+    EngReleaseSemaphore(pdev->trace_sem);
+}
+
+static _inline void TraceImage(PDev *pdev, UINT8 encode, UINT32 bytes, BOOL hit)
+{
+    if (!pdev->trace_ring) {
+        return;
+    }
+    pdev->trace_draw.encode |= encode;
+    pdev->trace_draw.bytes += bytes;
+    if (hit) {
+        pdev->trace_draw.cache_hits++;
+    } else if (encode != QXL_TRACE_ENCODE_SURFACE) {
+        pdev->trace_draw.cache_misses++;
+    }
+}
+
+static _inline void TraceEncodedImage(PDev *pdev, InternalImage *internal, UINT32 bitmap_size)
+{
+    if (internal->image.descriptor.type == SPICE_IMAGE_TYPE_QUIC) {
+        TraceImage(pdev, QXL_TRACE_ENCODE_QUIC, internal->image.quic.data_size, FALSE);
+    } else {
+        TraceImage(pdev, QXL_TRACE_ENCODE_BITMAP, bitmap_size, FALSE);
+    }
+}
+
+#define CAPTURE_BUF_SIZE (1024 * 1024)
+#define CAPTURE_MAX_SRC_BYTES (256 * 1024)
+#define CAPTURE_MAX_PALETTE 256
+#define CAPTURE_MAX_PATH_BYTES (64 * 1024)
+#define CAPTURE_MAX_GLYPH_BYTES (64 * 1024)
+
+BOOL CaptureStart(PDev *pdev)
+{
+    UINT8 *buf;
+
+    if (pdev->capture_buf) {
+        return TRUE;
+    }
+    if (!(buf = EngAllocMem(0, CAPTURE_BUF_SIZE, ALLOC_TAG))) {
+        DEBUG_PRINT((pdev, 0, "%s: alloc failed\n", __FUNCTION__));
+        return FALSE;
+    }
+    EngAcquireSemaphore(pdev->trace_sem);
+    pdev->capture_used = 0;
+    pdev->capture_seq = pdev->capture_count = pdev->capture_dropped = 0;
+    pdev->capture_buf = buf;
+    EngReleaseSemaphore(pdev->trace_sem);
+    return TRUE;
+}
+
+void CaptureStop(PDev *pdev)
+{
+    UINT8 *buf;
+
+    EngAcquireSemaphore(pdev->trace_sem);
+    buf = pdev->capture_buf;
+    pdev->capture_buf = NULL;
+    EngReleaseSemaphore(pdev->trace_sem);
+    if (buf) {
+        EngFreeMem(buf);
+    }
+}
+
+/* Moves as many whole records as fit after the header out of the buffer, returns the bytes
+ * written. The rest is moved to the start of the buffer so that capturing can go on in the
+ * room that was drained. A record that can't fit even alone is dropped, it would block the
+ * drain forever. */
+ULONG CaptureDrain(PDev *pdev, QXLCaptureHeader *header, ULONG size)
+{
+    QXLCaptureRecord *record;
+    UINT8 *out = (UINT8 *)(header + 1);
+    UINT32 read = 0;
+
+    size -= sizeof(*header);
+    header->version = QXL_CAPTURE_VERSION;
+    header->count = 0;
+    header->bytes = 0;
+    header->frequency = pdev->perf_frequency;
+
+    EngAcquireSemaphore(pdev->trace_sem);
+    header->dropped = pdev->capture_dropped;
+    pdev->capture_dropped = 0;
+    if (pdev->capture_buf) {
+        while (read < pdev->capture_used) {
+            record = (QXLCaptureRecord *)(pdev->capture_buf + read);
+            if (record->size > size) {
+                DEBUG_PRINT((pdev, 1, "%s: dropping record %u of %u bytes\n", __FUNCTION__,
+                             record->seq, record->size));
+                header->dropped++;
+                read += record->size;
+                continue;
+            }
+            if (header->bytes + record->size > size) {
+                break;
+            }
+            RtlCopyMemory(out + header->bytes, record, record->size);
+            header->bytes += record->size;
+            header->count++;
+            read += record->size;
+        }
+        pdev->capture_used -= read;
+        RtlMoveMemory(pdev->capture_buf, pdev->capture_buf + read, pdev->capture_used);
+    }
+    EngReleaseSemaphore(pdev->trace_sem);
+    return sizeof(*header) + header->bytes;
+}
+
+static _inline UINT32 CaptureBitsPerPixel(ULONG format)
+{
+    switch (format) {
+    case BMF_32BPP:
+        return 32;
+    case BMF_24BPP:
+        return 24;
+    case BMF_16BPP:
+        return 16;
+    case BMF_8BPP:
+        return 8;
+    case BMF_4BPP:
+        return 4;
+    case BMF_1BPP:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static UINT32 CaptureClipRects(CLIPOBJ *clip, QXLRect *rects, UINT16 *flags)
+{
+    UINT32 num_rects = 0;
+    BOOL more;
+
+    CLIPOBJ_cEnumStart(clip, TRUE, CT_RECTANGLES, CD_RIGHTDOWN, 0);
+    do {
+        RECTL *now;
+        RECTL *end;
+        struct {
+            ULONG  count;
+            RECTL  rects[20];
+        } buf;
+
+        more = CLIPOBJ_bEnum(clip, sizeof(buf), (ULONG *)&buf);
+        for (now = buf.rects, end = now + buf.count; now < end; now++) {
+            if (num_rects == QXL_CAPTURE_MAX_CLIP_RECTS) {
+                *flags |= QXL_CAPTURE_CLIP_TRUNCATED;
+                return num_rects;
+            }
+            CopyRect(&rects[num_rects], now);
+            num_rects++;
+        }
+    } while (more);
+    return num_rects;
+}
+
+/* Copies the segments of path to now, up to end. Returns the end of the copy. */
+static UINT8 *CapturePath(PATHOBJ *path, QXLCaptureRecord *record, UINT8 *now, UINT8 *end)
+{
+    QXLCapturePathSeg *seg;
+    PATHDATA data;
+    ULONG count;
+    BOOL more;
+
+    PATHOBJ_vEnumStart(path);
+    do {
+        more = PATHOBJ_bEnum(path, &data);
+        if (!data.count) {
+            break;
+        }
+        if (end - now < sizeof(*seg) + sizeof(POINTFIX)) {
+            record->flags |= QXL_CAPTURE_PATH_TRUNCATED;
+            break;
+        }
+        seg = (QXLCapturePathSeg *)now;
+        now += sizeof(*seg);
+        count = MIN(data.count, (ULONG)(end - now) / sizeof(POINTFIX));
+        seg->flags = data.flags;
+        seg->count = count;
+        RtlCopyMemory(now, data.pptfx, count * sizeof(POINTFIX));
+        now += count * sizeof(POINTFIX);
+        record->num_path_segs++;
+        if (count < data.count) {
+            record->flags |= QXL_CAPTURE_PATH_TRUNCATED;
+            break;
+        }
+    } while (more);
+    return now;
+}
+
+/* Copies the glyphs of a string of a GDI rasterized font to now, up to end, with their
+ * positions resolved as QXLGetStr does. Returns the end of the copy. */
+static UINT8 *CaptureGlyphs(FONTOBJ *font, STROBJ *str, QXLCaptureRecord *record, UINT8 *now,
+                            UINT8 *end)
+{
+    QXLCaptureGlyph *glyph;
+    GLYPHPOS *glyps;
+    GLYPHPOS *glyps_end;
+    POINTL pos;
+    POINTL delta;
+    UINT32 stride;
+    UINT32 bits_size;
+    ULONG count;
+    BOOL more;
+
+    if (!(font->flFontType & FO_TYPE_RASTER)) {
+        return now;
+    }
+    record->glyph_bpp = (font->flFontType & FO_GRAY16) ? 4 : 1;
+
+    pos.x = pos.y = 0;
+    delta.x = delta.y = 0;
+    if (str->ulCharInc) {
+        if (str->flAccel & SO_VERTICAL) {
+            delta.y = (str->flAccel & SO_REVERSED) ? -(LONG)str->ulCharInc : str->ulCharInc;
+        } else {
+            delta.x = (str->flAccel & SO_REVERSED) ? -(LONG)str->ulCharInc : str->ulCharInc;
+        }
+    }
+
+    STROBJ_vEnumStart(str);
+    do {
+        if (str->pgp) {
+            count = str->cGlyphs;
+            glyps = str->pgp;
+            more = FALSE;
+        } else {
+            more = STROBJ_bEnum(str, &count, &glyps);
+            if (more == DDI_ERROR) {
+                break;
+            }
+        }
+        for (glyps_end = glyps + count; glyps < glyps_end; glyps++) {
+            if (!str->ulCharInc || !record->num_glyphs) {
+                pos = glyps->ptl;
+            } else {
+                pos.x += delta.x;
+                pos.y += delta.y;
+            }
+            stride = ALIGN(glyps->pgdf->pgb->sizlBitmap.cx * record->glyph_bpp, 8) >> 3;
+            bits_size = ALIGN(stride * glyps->pgdf->pgb->sizlBitmap.cy, 4);
+            if ((UINT32)(end - now) < sizeof(*glyph) + bits_size) {
+                record->flags |= QXL_CAPTURE_GLYPHS_TRUNCATED;
+                return now;
+            }
+            glyph = (QXLCaptureGlyph *)now;
+            glyph->x = pos.x;
+            glyph->y = pos.y;
+            glyph->origin_x = glyps->pgdf->pgb->ptlOrigin.x;
+            glyph->origin_y = glyps->pgdf->pgb->ptlOrigin.y;
+            glyph->width = glyps->pgdf->pgb->sizlBitmap.cx;
+            glyph->height = glyps->pgdf->pgb->sizlBitmap.cy;
+            now += sizeof(*glyph);
+            RtlCopyMemory(now, glyps->pgdf->pgb->aj, stride * glyph->height);
+            now += bits_size;
+            record->num_glyphs++;
+        }
+    } while (more);
+    return now;
+}
+
+/* Appends a record of a drawing call with what is needed to replay it: its clip rects,
+ * color translation, the source rows it reads and the path or glyphs it draws. */
+void CaptureCall(PDev *pdev, UINT16 call, SURFOBJ *dest, SURFOBJ *src, SURFOBJ *mask,
+                 CLIPOBJ *clip, XLATEOBJ *color_trans, RECTL *dest_rect, RECTL *src_rect,
+                 BRUSHOBJ *brush, UINT32 rop, UINT32 mode, PATHOBJ *path, FONTOBJ *font,
+                 STROBJ *str)
+{
+    QXLCaptureRecord *record;
+    LONGLONG time;
+    UINT8 *buf_end;
+    UINT8 *now;
+    RECTL area;
+    UINT32 bpp;
+    UINT32 max_size;
+    UINT32 src_bytes = 0;
+    LONG y;
+
+    EngAcquireSemaphore(pdev->trace_sem);
+    if (!pdev->capture_buf) {
+        goto out;
+    }
+
+    if (src && src->iType == STYPE_BITMAP && src_rect &&
+        (bpp = CaptureBitsPerPixel(src->iBitmapFormat))) {
+        area.left = MAX(src_rect->left, 0);
+        area.top = MAX(src_rect->top, 0);
+        area.right = MIN(src_rect->right, src->sizlBitmap.cx);
+        area.bottom = MIN(src_rect->bottom, src->sizlBitmap.cy);
+        if (!IsEmptyRect(&area)) {
+            src_bytes = (((area.right * bpp + 7) >> 3) - ((area.left * bpp) >> 3)) *
+                        (area.bottom - area.top);
+        }
+    }
+
+    max_size = sizeof(QXLCaptureRecord) + QXL_CAPTURE_MAX_CLIP_RECTS * sizeof(QXLRect) +
+               CAPTURE_MAX_PALETTE * sizeof(UINT32) +
+               (src_bytes <= CAPTURE_MAX_SRC_BYTES ? src_bytes : 0) + 7;
+    if (pdev->capture_used + max_size > CAPTURE_BUF_SIZE) {
+        pdev->capture_dropped++;
+        goto out;
+    }
+
+    record = (QXLCaptureRecord *)(pdev->capture_buf + pdev->capture_used);
+    RtlZeroMemory(record, sizeof(*record));
+    record->seq = pdev->capture_seq++;
+    EngQueryPerformanceCounter(&time);
+    record->time = time;
+    record->call = call;
+    record->rop = rop;
+    record->mode = mode;
+    record->brush_color = brush ? brush->iSolidColor : ~0;
+    record->dest_surface_id = (UINT32)-1;
+    record->src_surface_id = (UINT32)-1;
+    if (dest && dest->iType != STYPE_BITMAP) {
+        record->flags |= QXL_CAPTURE_DEST_DEVICE;
+        record->dest_surface_id = GetSurfaceId(dest);
+    }
+    if (src && src->iType != STYPE_BITMAP) {
+        record->flags |= QXL_CAPTURE_SRC_DEVICE;
+        record->src_surface_id = GetSurfaceId(src);
+    }
+    if (mask) {
+        record->flags |= QXL_CAPTURE_MASK;
+    }
+    if (dest_rect) {
+        CopyRect(&record->dest_rect, dest_rect);
+    }
+    if (src_rect) {
+        CopyRect(&record->src_rect, src_rect);
+    }
+    now = (UINT8 *)(record + 1);
+
+    if (clip) {
+        record->clip_complexity = clip->iDComplexity;
+        CopyRect(&record->clip_bounds, &clip->rclBounds);
+        if (clip->iDComplexity == DC_COMPLEX) {
+            record->num_clip_rects = CaptureClipRects(clip, (QXLRect *)now, &record->flags);
+            now += record->num_clip_rects * sizeof(QXLRect);
+        }
+    } else {
+        record->clip_complexity = DC_TRIVIAL;
+    }
+
+    if (color_trans && (color_trans->flXlate & XO_TABLE) && color_trans->pulXlate) {
+        record->num_palette = MIN(color_trans->cEntries, CAPTURE_MAX_PALETTE);
+        RtlCopyMemory(now, color_trans->pulXlate, record->num_palette * sizeof(UINT32));
+        now += record->num_palette * sizeof(UINT32);
+    }
+
+    if (src_bytes > CAPTURE_MAX_SRC_BYTES) {
+        record->flags |= QXL_CAPTURE_SRC_TRUNCATED;
+    } else if (src_bytes) {
+        UINT8 *src_line = (UINT8 *)src->pvScan0 + ((area.left * bpp) >> 3);
+
+        record->flags |= QXL_CAPTURE_SRC_PIXELS;
+        record->src_format = src->iBitmapFormat;
+        record->src_stride = ((area.right * bpp + 7) >> 3) - ((area.left * bpp) >> 3);
+        record->src_height = area.bottom - area.top;
+        CopyRect(&record->src_rect, &area);
+        for (y = area.top; y < area.bottom; y++) {
+            RtlCopyMemory(now, src_line + y * src->lDelta, record->src_stride);
+            now += record->src_stride;
+        }
+    }
+
+    // paths and strings take what is left of the buffer, up to their own limit
+    now = (UINT8 *)record + ALIGN((UINT32)(now - (UINT8 *)record), 4);
+    buf_end = pdev->capture_buf + CAPTURE_BUF_SIZE;
+    if (path) {
+        now = CapturePath(path, record, now, now + MIN(buf_end - now, CAPTURE_MAX_PATH_BYTES));
+    }
+    if (font && str) {
+        now = CaptureGlyphs(font, str, record, now,
+                            now + MIN(buf_end - now, CAPTURE_MAX_GLYPH_BYTES));
+    }
+
+    record->size = ALIGN((UINT32)(now - (UINT8 *)record), 8);
+    pdev->capture_used += record->size;
+    pdev->capture_count++;
+
+out:
+    EngReleaseSemaphore(pdev->trace_sem);
+}
+
 static QXLDrawable *GetDrawable(PDev *pdev)
 {
     QXLOutput *output;
@@ -636,6 +1305,14 @@ QXLDrawable *Drawable(PDev *pdev, UINT8 type, RECTL *area, CLIPOBJ *clip, UINT32
     drawable->surfaces_dest[2] = -1;
     CopyRect(&drawable->bbox, area);
 
+    if (pdev->trace_ring) {
+        LONGLONG start;
+
+        RtlZeroMemory(&pdev->trace_draw, sizeof(pdev->trace_draw));
+        EngQueryPerformanceCounter(&start);
+        pdev->trace_draw.start = start;
+    }
+
     if (!SetClip(pdev, clip, drawable)) {
         DEBUG_PRINT((pdev, 0, "%s: set clip failed\n", __FUNCTION__));
         ReleaseOutput(pdev, drawable->release_info.id);
@@ -644,9 +1321,56 @@ QXLDrawable *Drawable(PDev *pdev, UINT8 type, RECTL *area, CLIPOBJ *clip, UINT32
     return drawable;
 }
 
+static _inline void SurfaceAddDirty(PDev *pdev, UINT32 surface_id, QXLRect *rect)
+{
+    SurfaceInfo *surface_info = GetSurfaceInfo(pdev, surface_id);
+    RECTL area;
+
+    CopyRect(&area, rect);
+    if (IsEmptyRect(&area)) {
+        return;
+    }
+    if (IsEmptyRect(&surface_info->dirty)) {
+        CopyRect(&surface_info->dirty, &area);
+    } else {
+        UnionRect(&surface_info->dirty, &area, &surface_info->dirty);
+    }
+    if (surface_info->shadow) {
+        if (IsEmptyRect(&surface_info->save_dirty)) {
+            CopyRect(&surface_info->save_dirty, &area);
+        } else {
+            UnionRect(&surface_info->save_dirty, &area, &surface_info->save_dirty);
+        }
+    }
+}
+
 void PushDrawable(PDev *pdev, QXLDrawable *drawable)
 {
     QXLCommand *cmd;
+    int i;
+
+    SurfaceAddDirty(pdev, drawable->surface_id, &drawable->bbox);
+
+    // recency of use orders lazy restores of the surfaces after a mode switch
+    pdev->surface_use_clock++;
+    GetSurfaceInfo(pdev, drawable->surface_id)->last_use = pdev->surface_use_clock;
+    for (i = 0; i < 3; i++) {
+        if (drawable->surfaces_dest[i] > 0) {
+            GetSurfaceInfo(pdev, drawable->surfaces_dest[i])->last_use = pdev->surface_use_clock;
+        }
+    }
+
+    // the surfaces the drawable uses must be created on the device first
+    FlushSurfaceCmds(pdev);
+
+    /* the device may release the drawable once it is pushed, record it before */
+    if (pdev->trace_ring) {
+        pdev->trace_draw.ring = QXL_TRACE_RING_CMD;
+        pdev->trace_draw.type = drawable->type;
+        pdev->trace_draw.surface_id = drawable->surface_id;
+        pdev->trace_draw.num_res = (UINT8)((QXLOutput *)drawable->release_info.id)->num_res;
+        pdev->trace_draw.bbox = drawable->bbox;
+    }
 
     EngAcquireSemaphore(pdev->cmd_sem);
     WaitForCmdRing(pdev);
@@ -655,6 +1379,10 @@ void PushDrawable(PDev *pdev, QXLDrawable *drawable)
     cmd->data = PA(pdev, drawable, pdev->main_mem_slot);
     PUSH_CMD(pdev);
     EngReleaseSemaphore(pdev->cmd_sem);
+
+    if (pdev->trace_ring) {
+        TracePush(pdev, &pdev->trace_draw);
+    }
 }
 
 static QXLSurfaceCmd *GetSurfaceCmd(PDev *pdev)
@@ -684,17 +1412,96 @@ QXLSurfaceCmd *SurfaceCmd(PDev *pdev, UINT8 type, UINT32 surface_id)
     return surface_cmd;
 }
 
-void PushSurfaceCmd(PDev *pdev, QXLSurfaceCmd *surface_cmd)
+/* Push the batched surface commands with a single notify of the device. */
+void FlushSurfaceCmds(PDev *pdev)
 {
+    QXLSurfaceCmd *surface_cmd;
+    QXLTraceRecord record;
     QXLCommand *cmd;
+    int notify = FALSE;
+    int push_notify;
+    UINT32 i;
+
+    if (!pdev->surface_cmd_batch_len) {
+        return;
+    }
 
     EngAcquireSemaphore(pdev->cmd_sem);
-    WaitForCmdRing(pdev);
-    cmd = SPICE_RING_PROD_ITEM(pdev->cmd_ring);
-    cmd->type = QXL_CMD_SURFACE;
-    cmd->data = PA(pdev, surface_cmd, pdev->main_mem_slot);
-    PUSH_CMD(pdev);
+    for (i = 0; i < pdev->surface_cmd_batch_len; i++) {
+        surface_cmd = pdev->surface_cmd_batch[i];
+        if (pdev->trace_ring) {
+            RtlZeroMemory(&record, sizeof(record));
+            record.ring = QXL_TRACE_RING_SURFACE;
+            record.type = surface_cmd->type;
+            record.surface_id = surface_cmd->surface_id;
+            if (surface_cmd->type == QXL_SURFACE_CMD_CREATE) {
+                record.bbox.right = surface_cmd->u.surface_create.width;
+                record.bbox.bottom = surface_cmd->u.surface_create.height;
+            }
+        }
+
+        if (notify && SPICE_RING_IS_FULL(pdev->cmd_ring)) {
+            // the device may be idle, waiting for the notify of what was pushed so far
+            sync_io(pdev, pdev->notify_cmd_port, 0);
+            notify = FALSE;
+        }
+        WaitForCmdRing(pdev);
+        cmd = SPICE_RING_PROD_ITEM(pdev->cmd_ring);
+        cmd->type = QXL_CMD_SURFACE;
+        cmd->data = PA(pdev, surface_cmd, pdev->main_mem_slot);
+        SPICE_RING_PUSH(pdev->cmd_ring, push_notify);
+        notify |= push_notify;
+
+        if (pdev->trace_ring) {
+            TracePush(pdev, &record);
+        }
+    }
+    if (notify) {
+        sync_io(pdev, pdev->notify_cmd_port, 0);
+    }
+    DEBUG_PRINT((pdev, 9, "%s: pushed %u\n", __FUNCTION__, pdev->surface_cmd_batch_len));
+    pdev->surface_cmd_batch_len = 0;
+    EngReleaseSemaphore(pdev->cmd_sem);
+}
+
+/* Surface commands are batched until a drawable or an io needs them on the device. A
+ * destroy of a surface whose create is still batched drops both, as if the device had
+ * released them, so short lived surfaces never reach the device. */
+void PushSurfaceCmd(PDev *pdev, QXLSurfaceCmd *surface_cmd)
+{
+    QXLSurfaceCmd *create = NULL;
+    UINT32 i;
+
+    EngAcquireSemaphore(pdev->cmd_sem);
+    if (surface_cmd->type == QXL_SURFACE_CMD_DESTROY) {
+        for (i = pdev->surface_cmd_batch_len; i-- > 0;) {
+            if (pdev->surface_cmd_batch[i]->surface_id != surface_cmd->surface_id) {
+                continue;
+            }
+            if (pdev->surface_cmd_batch[i]->type == QXL_SURFACE_CMD_CREATE) {
+                create = pdev->surface_cmd_batch[i];
+                pdev->surface_cmd_batch_len--;
+                RtlMoveMemory(&pdev->surface_cmd_batch[i], &pdev->surface_cmd_batch[i + 1],
+                              (pdev->surface_cmd_batch_len - i) * sizeof(QXLSurfaceCmd *));
+            }
+            break;
+        }
+    }
+    if (!create) {
+        if (pdev->surface_cmd_batch_len == SURFACE_CMD_BATCH_SIZE) {
+            FlushSurfaceCmds(pdev);
+        }
+        pdev->surface_cmd_batch[pdev->surface_cmd_batch_len++] = surface_cmd;
+    }
     EngReleaseSemaphore(pdev->cmd_sem);
+
+    if (create) {
+        DEBUG_PRINT((pdev, 9, "%s: %u: destroyed before its create was pushed\n",
+                     __FUNCTION__, surface_cmd->surface_id));
+        ReleaseOutput(pdev, create->release_info.id);
+        // frees the surface memory and info
+        ReleaseOutput(pdev, surface_cmd->release_info.id);
+    }
 }
 
 QXLPHYSICAL SurfaceToPhysical(PDev *pdev, UINT8 *base_mem)
@@ -723,7 +1530,7 @@ _inline void GetSurfaceMemory(PDev *pdev, UINT32 x, UINT32 y, UINT32 depth, INT3
     case DEVICE_BITMAP_ALLOCATION_TYPE_VRAM:
         *stride = x * depth / 8;
         *stride = ALIGN(*stride, 4);
-        *base_mem = __AllocMem(pdev, MSPACE_TYPE_VRAM, (*stride) * y, FALSE);
+        *base_mem = AllocSurfaceVRAM(pdev, (*stride) * y);
         *phys_mem = SurfaceToPhysical(pdev, *base_mem);
         break;
     case DEVICE_BITMAP_ALLOCATION_TYPE_RAM:
@@ -753,7 +1560,7 @@ void QXLDelSurface(PDev *pdev, UINT8 *base_mem, UINT8 allocation_type)
         FreeMem(pdev, MSPACE_TYPE_DEVRAM, base_mem);
         break;
     case DEVICE_BITMAP_ALLOCATION_TYPE_VRAM:
-        FreeMem(pdev, MSPACE_TYPE_VRAM, base_mem);
+        FreeSurfaceVRAM(pdev, base_mem);
         break;
     case DEVICE_BITMAP_ALLOCATION_TYPE_RAM:
         EngFreeMem(base_mem);
@@ -947,6 +1754,44 @@ static Resource *__GetPath(PDev *pdev, PATHOBJ *path)
     return res;
 }
 
+/* A single segment path, without going through PATHOBJ enumeration */
+BOOL QXLGetLinePath(PDev *pdev, QXLDrawable *drawable, QXLPHYSICAL *path_phys, POINTFIX *from,
+                    POINTFIX *to)
+{
+    Resource *path_res;
+    QXLPath *qxl_path;
+    QXLPathSeg *seg;
+
+    ASSERT(pdev, pdev && drawable && path_phys && from && to);
+
+    DEBUG_PRINT((pdev, 9, "%s\n", __FUNCTION__));
+
+    path_res = AllocMem(pdev, MSPACE_TYPE_DEVRAM, PATH_ALLOC_SIZE);
+    ONDBG(pdev->num_path_pages++);
+    path_res->refs = 1;
+    path_res->free = FreePath;
+    RESOURCE_TYPE(path_res, RESOURCE_TYPE_PATH);
+
+    qxl_path = (QXLPath *)path_res->res;
+    qxl_path->data_size = sizeof(QXLPathSeg) + 2 * sizeof(POINTFIX);
+    qxl_path->chunk.data_size = qxl_path->data_size;
+    qxl_path->chunk.prev_chunk = 0;
+    qxl_path->chunk.next_chunk = 0;
+
+    seg = (QXLPathSeg *)qxl_path->chunk.data;
+    seg->flags = QXL_PATH_BEGIN | QXL_PATH_END;
+    seg->count = 2;
+    seg->points[0].x = from->x;
+    seg->points[0].y = from->y;
+    seg->points[1].x = to->x;
+    seg->points[1].y = to->y;
+
+    *path_phys = PA(pdev, path_res->res, pdev->main_mem_slot);
+    DrawableAddRes(pdev, drawable, path_res);
+    RELEASE_RES(pdev, path_res);
+    return TRUE;
+}
+
 BOOL QXLGetPath(PDev *pdev, QXLDrawable *drawable, QXLPHYSICAL *path_phys, PATHOBJ *path)
 {
     Resource *path_res;
@@ -988,31 +1833,62 @@ static void FreeClipRects(PDev *pdev, Resource *res)
 #define RECTS_NUM_ALLOC 20
 #define RECTS_CHUNK_ALLOC_SIZE (sizeof(QXLDataChunk) + sizeof(QXLRect) * RECTS_NUM_ALLOC)
 
-static Resource *GetClipRects(PDev *pdev, CLIPOBJ *clip)
-{
+typedef struct ClipRectsInfo {
     Resource *res;
     QXLClipRects *rects;
     QXLDataChunk *chunk;
     QXLRect *dest;
     QXLRect *dest_end;
+} ClipRectsInfo;
+
+static void ClipRectsInit(PDev *pdev, ClipRectsInfo *info)
+{
+    Resource *res;
+
+    res = (Resource *)AllocMem(pdev, MSPACE_TYPE_DEVRAM, RECTS_ALLOC_SIZE);
+    ONDBG(pdev->num_rects_pages++);
+    res->refs = 1;
+    res->free = FreeClipRects;
+    RESOURCE_TYPE(res, RESOURCE_TYPE_CLIP_RECTS);
+    info->res = res;
+    info->rects = (QXLClipRects *)res->res;
+    info->rects->num_rects = 0;
+
+    info->chunk = &info->rects->chunk;
+    info->chunk->data_size = 0;
+    info->chunk->prev_chunk = 0;
+    info->chunk->next_chunk = 0;
+
+    info->dest = (QXLRect *)info->chunk->data;
+    info->dest_end = info->dest + ((RECTS_ALLOC_SIZE - sizeof(Resource) - sizeof(QXLClipRects)) >> 4);
+}
+
+static _inline void ClipRectsAdd(PDev *pdev, ClipRectsInfo *info, RECTL *rect)
+{
+    if (info->dest == info->dest_end) {
+        void *page = AllocMem(pdev, MSPACE_TYPE_DEVRAM, RECTS_CHUNK_ALLOC_SIZE);
+        ONDBG(pdev->num_rects_pages++);
+        info->chunk->next_chunk = PA(pdev, page, pdev->main_mem_slot);
+        ((QXLDataChunk *)page)->prev_chunk = PA(pdev, info->chunk, pdev->main_mem_slot);
+        info->chunk = (QXLDataChunk *)page;
+        info->chunk->data_size = 0;
+        info->chunk->next_chunk = 0;
+        info->dest = (QXLRect *)info->chunk->data;
+        info->dest_end = info->dest + RECTS_NUM_ALLOC;
+    }
+    CopyRect(info->dest, rect);
+    info->dest++;
+    info->chunk->data_size += sizeof(QXLRect);
+    info->rects->num_rects++;
+}
+
+static Resource *GetClipRects(PDev *pdev, CLIPOBJ *clip)
+{
+    ClipRectsInfo info;
     int more;
 
     DEBUG_PRINT((pdev, 12, "%s\n", __FUNCTION__));
-    res = (Resource *)AllocMem(pdev, MSPACE_TYPE_DEVRAM, RECTS_ALLOC_SIZE);
-    ONDBG(pdev->num_rects_pages++);
-    res->refs = 1;
-    res->free = FreeClipRects;
-    RESOURCE_TYPE(res, RESOURCE_TYPE_CLIP_RECTS);
-    rects = (QXLClipRects *)res->res;
-    rects->num_rects = 0;
-
-    chunk = &rects->chunk;
-    chunk->data_size = 0;
-    chunk->prev_chunk = 0;
-    chunk->next_chunk = 0;
-
-    dest = (QXLRect *)chunk->data;
-    dest_end = dest + ((RECTS_ALLOC_SIZE - sizeof(Resource) - sizeof(QXLClipRects)) >> 4);
+    ClipRectsInit(pdev, &info);
 
     CLIPOBJ_cEnumStart(clip, TRUE, CT_RECTANGLES, CD_RIGHTDOWN, 0);
     do {
@@ -1024,25 +1900,12 @@ static Resource *GetClipRects(PDev *pdev, CLIPOBJ *clip)
         } buf;
 
         more = CLIPOBJ_bEnum(clip, sizeof(buf), (ULONG *)&buf);
-        rects->num_rects += buf.count;
-        for (now = buf.rects, end = now + buf.count; now < end; now++, dest++) {
-            if (dest == dest_end) {
-                void *page = AllocMem(pdev, MSPACE_TYPE_DEVRAM, RECTS_CHUNK_ALLOC_SIZE);
-                ONDBG(pdev->num_rects_pages++);
-                chunk->next_chunk = PA(pdev, page, pdev->main_mem_slot);
-                ((QXLDataChunk *)page)->prev_chunk = PA(pdev, chunk, pdev->main_mem_slot);
-                chunk = (QXLDataChunk *)page;
-                chunk->data_size = 0;
-                chunk->next_chunk = 0;
-                dest = (QXLRect *)chunk->data;
-                dest_end = dest + RECTS_NUM_ALLOC;
-            }
-            CopyRect(dest, now);
-            chunk->data_size += sizeof(QXLRect);
+        for (now = buf.rects, end = now + buf.count; now < end; now++) {
+            ClipRectsAdd(pdev, &info, now);
         }
     } while (more);
-    DEBUG_PRINT((pdev, 13, "%s: done, num_rects %d\n", __FUNCTION__, rects->num_rects));
-    return res;
+    DEBUG_PRINT((pdev, 13, "%s: done, num_rects %d\n", __FUNCTION__, info.rects->num_rects));
+    return info.res;
 }
 
 static BOOL SetClip(PDev *pdev, CLIPOBJ *clip, QXLDrawable *drawable)
@@ -1082,6 +1945,283 @@ static BOOL SetClip(PDev *pdev, CLIPOBJ *clip, QXLDrawable *drawable)
     return TRUE;
 }
 
+#define PATH_CLIP_MAX_EDGES 512
+#define PATH_CLIP_MAX_CLIP_RECTS 32
+#define PATH_CLIP_MAX_RECTS 4096
+
+typedef struct PathEdge {
+    FIX x0;
+    FIX y0;
+    FIX x1;
+    FIX y1;
+    INT32 dir;
+} PathEdge;
+
+typedef struct PathCrossing {
+    FIX x;
+    INT32 dir;
+} PathCrossing;
+
+typedef struct PathSpan {
+    LONG left;
+    LONG right;
+} PathSpan;
+
+struct PathClipInfo {
+    PathEdge edges[PATH_CLIP_MAX_EDGES];
+    PathCrossing crossings[PATH_CLIP_MAX_EDGES];
+    PathSpan spans[2][PATH_CLIP_MAX_EDGES];
+    RECTL clip_rects[PATH_CLIP_MAX_CLIP_RECTS];
+    UINT32 num_edges;
+    UINT32 num_clip_rects;
+};
+
+static _inline BOOL PathClipAddEdge(PathClipInfo *info, POINTFIX *from, POINTFIX *to)
+{
+    PathEdge *edge;
+
+    if (from->y == to->y) {
+        return TRUE;
+    }
+    if (info->num_edges == PATH_CLIP_MAX_EDGES) {
+        return FALSE;
+    }
+    edge = &info->edges[info->num_edges++];
+    if (from->y < to->y) {
+        edge->x0 = from->x;
+        edge->y0 = from->y;
+        edge->x1 = to->x;
+        edge->y1 = to->y;
+        edge->dir = 1;
+    } else {
+        edge->x0 = to->x;
+        edge->y0 = to->y;
+        edge->x1 = from->x;
+        edge->y1 = from->y;
+        edge->dir = -1;
+    }
+    return TRUE;
+}
+
+static BOOL PathClipGetEdges(PDev *pdev, PathClipInfo *info, PATHOBJ *path)
+{
+    POINTFIX start;
+    POINTFIX last;
+    BOOL in_subpath = FALSE;
+    BOOL more;
+
+    info->num_edges = 0;
+    PATHOBJ_vEnumStart(path);
+    do {
+        PATHDATA data;
+        POINTFIX *now;
+        POINTFIX *end;
+
+        more = PATHOBJ_bEnum(path, &data);
+        if (data.flags & PD_BEZIERS) {
+            DEBUG_PRINT((pdev, 5, "%s: beziers\n", __FUNCTION__));
+            return FALSE;
+        }
+        now = data.pptfx;
+        end = now + data.count;
+        if (data.flags & PD_BEGINSUBPATH) {
+            if (in_subpath && !PathClipAddEdge(info, &last, &start)) {
+                return FALSE;
+            }
+            if (now == end) {
+                continue;
+            }
+            start = last = *now++;
+            in_subpath = TRUE;
+        }
+        for (; now < end; now++) {
+            if (!PathClipAddEdge(info, &last, now)) {
+                return FALSE;
+            }
+            last = *now;
+        }
+        // filled figures are always closed
+        if ((data.flags & PD_ENDSUBPATH) && in_subpath) {
+            if (!PathClipAddEdge(info, &last, &start)) {
+                return FALSE;
+            }
+            in_subpath = FALSE;
+        }
+    } while (more);
+
+    if (in_subpath && !PathClipAddEdge(info, &last, &start)) {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Spans of the pixels whose centers are inside the path on row y */
+static UINT32 PathClipGetSpans(PathClipInfo *info, LONG y, BOOL winding, RECTL *area,
+                               PathSpan *spans)
+{
+    FIX sample_y = (y << 4) + 8;
+    UINT32 num_crossings = 0;
+    UINT32 num_spans = 0;
+    INT32 inside = 0;
+    UINT32 i;
+
+    for (i = 0; i < info->num_edges; i++) {
+        PathEdge *edge = &info->edges[i];
+        PathCrossing crossing;
+        UINT32 j;
+
+        if (sample_y < edge->y0 || sample_y >= edge->y1) {
+            continue;
+        }
+        crossing.x = edge->x0 + (FIX)((INT64)(sample_y - edge->y0) * (edge->x1 - edge->x0) /
+                                      (edge->y1 - edge->y0));
+        crossing.dir = edge->dir;
+        for (j = num_crossings; j > 0 && info->crossings[j - 1].x > crossing.x; j--) {
+            info->crossings[j] = info->crossings[j - 1];
+        }
+        info->crossings[j] = crossing;
+        num_crossings++;
+    }
+
+    for (i = 0; i < num_crossings; i++) {
+        BOOL was_inside = winding ? inside != 0 : (inside & 1);
+        BOOL is_inside;
+
+        inside += info->crossings[i].dir;
+        is_inside = winding ? inside != 0 : (inside & 1);
+        if (!was_inside && is_inside) {
+            spans[num_spans].left = (info->crossings[i].x + 7) >> 4;
+        } else if (was_inside && !is_inside) {
+            spans[num_spans].right = (info->crossings[i].x + 7) >> 4;
+            num_spans++;
+        }
+    }
+
+    for (i = 0; i < num_spans; i++) {
+        spans[i].left = MAX(spans[i].left, area->left);
+        spans[i].right = MIN(spans[i].right, area->right);
+    }
+    return num_spans;
+}
+
+static BOOL PathClipEmit(PDev *pdev, PathClipInfo *info, ClipRectsInfo *rects, PathSpan *spans,
+                         UINT32 num_spans, LONG top, LONG bottom)
+{
+    UINT32 i;
+
+    for (i = 0; i < num_spans; i++) {
+        RECTL rect;
+
+        if (spans[i].left >= spans[i].right) {
+            continue;
+        }
+        rect.left = spans[i].left;
+        rect.right = spans[i].right;
+        rect.top = top;
+        rect.bottom = bottom;
+        if (info->num_clip_rects) {
+            UINT32 j;
+
+            for (j = 0; j < info->num_clip_rects; j++) {
+                RECTL clipped;
+
+                SectRect(&rect, &info->clip_rects[j], &clipped);
+                if (!IsEmptyRect(&clipped)) {
+                    ClipRectsAdd(pdev, rects, &clipped);
+                }
+            }
+        } else {
+            ClipRectsAdd(pdev, rects, &rect);
+        }
+        if (rects->rects->num_rects > PATH_CLIP_MAX_RECTS) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Set the clip of a drawable to the pixels of a filled path (intersected with clip).
+ * SPICE has no path fill, so the path is scan converted into rects, rows with the same
+ * spans are merged. Beziers and paths that would take too many rects are unsupported. */
+QXLRESULT QXLGetPathClip(PDev *pdev, QXLDrawable *drawable, PATHOBJ *path, BOOL winding,
+                         CLIPOBJ *clip, RECTL *area)
+{
+    PathClipInfo *info = pdev->path_clip;
+    ClipRectsInfo rects;
+    PathSpan *prev_spans;
+    PathSpan *spans;
+    UINT32 num_prev_spans = 0;
+    LONG prev_top;
+    LONG y;
+
+    DEBUG_PRINT((pdev, 9, "%s\n", __FUNCTION__));
+
+    info->num_clip_rects = 0;
+    if (clip && clip->iDComplexity == DC_COMPLEX) {
+        BOOL more;
+
+        CLIPOBJ_cEnumStart(clip, TRUE, CT_RECTANGLES, CD_RIGHTDOWN, 0);
+        do {
+            struct {
+                ULONG  count;
+                RECTL  rects[PATH_CLIP_MAX_CLIP_RECTS];
+            } buf;
+
+            more = CLIPOBJ_bEnum(clip, sizeof(buf), (ULONG *)&buf);
+            if (info->num_clip_rects + buf.count > PATH_CLIP_MAX_CLIP_RECTS) {
+                DEBUG_PRINT((pdev, 5, "%s: too many clip rects\n", __FUNCTION__));
+                return QXL_UNSUPPORTED;
+            }
+            RtlCopyMemory(&info->clip_rects[info->num_clip_rects], buf.rects,
+                          buf.count * sizeof(RECTL));
+            info->num_clip_rects += buf.count;
+        } while (more);
+    }
+
+    if (!PathClipGetEdges(pdev, info, path)) {
+        DEBUG_PRINT((pdev, 5, "%s: unsupported path\n", __FUNCTION__));
+        return QXL_UNSUPPORTED;
+    }
+
+    ClipRectsInit(pdev, &rects);
+    prev_spans = info->spans[0];
+    spans = info->spans[1];
+    prev_top = area->top;
+    for (y = area->top; y < area->bottom; y++) {
+        UINT32 num_spans = PathClipGetSpans(info, y, winding, area, spans);
+        PathSpan *tmp;
+
+        if (num_spans == num_prev_spans &&
+            RtlEqualMemory(spans, prev_spans, num_spans * sizeof(PathSpan))) {
+            continue;
+        }
+        if (!PathClipEmit(pdev, info, &rects, prev_spans, num_prev_spans, prev_top, y)) {
+            goto too_complex;
+        }
+        tmp = prev_spans;
+        prev_spans = spans;
+        spans = tmp;
+        num_prev_spans = num_spans;
+        prev_top = y;
+    }
+    if (!PathClipEmit(pdev, info, &rects, prev_spans, num_prev_spans, prev_top, area->bottom)) {
+        goto too_complex;
+    }
+
+    DrawableAddRes(pdev, drawable, rects.res);
+    RELEASE_RES(pdev, rects.res);
+    drawable->clip.type = SPICE_CLIP_TYPE_RECTS;
+    drawable->clip.data = PA(pdev, rects.rects, pdev->main_mem_slot);
+    DEBUG_PRINT((pdev, 10, "%s: done, edges %u rects %u\n", __FUNCTION__, info->num_edges,
+                 rects.rects->num_rects));
+    return QXL_SUCCESS;
+
+too_complex:
+    DEBUG_PRINT((pdev, 5, "%s: too many rects\n", __FUNCTION__));
+    RELEASE_RES(pdev, rects.res);
+    return QXL_UNSUPPORTED;
+}
+
 #ifndef _WIN64
 
 static _inline void fast_memcpy_aligment(void *dest, const void *src, size_t len)
@@ -1454,7 +2594,7 @@ static CacheImage *AllocCacheImage(PDev* pdev)
     RingItem *item;
     while (!(item = RingGetTail(pdev, &pdev->cache_image_lru))) {
         /* malloc_sem protects release_ring too */
-        EngAcquireSemaphore(pdev->malloc_sem);
+        PerfAcquireSemaphore(pdev, pdev->malloc_sem, QXL_PERF_WAIT_MALLOC_SEM);
         if (pdev->free_outputs == 0 &&
             SPICE_RING_IS_EMPTY(pdev->release_ring)) {
             WaitForReleaseRing(pdev);
@@ -1490,10 +2630,11 @@ typedef struct InternalPalette {
     UINT32 refs;
     struct InternalPalette *next;
     RingItem lru_link;
+    UINT32 hash;
     QXLPalette palette;
 } InternalPalette;
 
-#define PALETTE_HASH_VAL(unique) ((int)(unique) & PALETTE_HASH_NASKE)
+#define PALETTE_HASH_VAL(hash) ((int)(hash) & PALETTE_HASH_NASKE)
 
 static _inline void ReleasePalette(PDev *pdev, InternalPalette *palette)
 {
@@ -1511,11 +2652,10 @@ static _inline void PaletteCacheRemove(PDev *pdev, InternalPalette *palette)
 
     DEBUG_PRINT((pdev, 15, "%s\n", __FUNCTION__));
 
-    ASSERT(pdev, palette->palette.unique);
-    internal = &pdev->palette_cache[PALETTE_HASH_VAL(palette->palette.unique)];
+    internal = &pdev->palette_cache[PALETTE_HASH_VAL(palette->hash)];
 
     while (*internal) {
-        if ((*internal)->palette.unique == palette->palette.unique) {
+        if (*internal == palette) {
             *internal = palette->next;
             found = TRUE;
             break;
@@ -1535,18 +2675,17 @@ static _inline void PaletteCacheRemove(PDev *pdev, InternalPalette *palette)
     }
 }
 
-static _inline InternalPalette *PaletteCacheGet(PDev *pdev, UINT32 unique)
+static _inline InternalPalette *PaletteCacheGet(PDev *pdev, UINT32 hash, XLATEOBJ *color_trans)
 {
     InternalPalette *now;
 
     DEBUG_PRINT((pdev, 12, "%s\n", __FUNCTION__));
-    if (!unique) {
-        return NULL;
-    }
 
-    now = pdev->palette_cache[PALETTE_HASH_VAL(unique)];
+    now = pdev->palette_cache[PALETTE_HASH_VAL(hash)];
     while (now) {
-        if (now->palette.unique == unique) {
+        if (now->hash == hash && now->palette.num_ents == color_trans->cEntries &&
+            RtlEqualMemory(now->palette.ents, color_trans->pulXlate,
+                           color_trans->cEntries << 2)) {
             RingRemove(pdev, &now->lru_link);
             RingAdd(pdev, &pdev->palette_lru, &now->lru_link);
             now->refs++;
@@ -1569,24 +2708,25 @@ static void PaletteCacheClear(PDev *pdev)
     }
 }
 
+static void PaletteCacheTrim(PDev *pdev, UINT32 size)
+{
+    while (pdev->num_palettes > size) {
+        ASSERT(pdev, RingGetTail(pdev, &pdev->palette_lru));
+        PaletteCacheRemove(pdev, CONTAINEROF(RingGetTail(pdev, &pdev->palette_lru),
+                                             InternalPalette, lru_link));
+        pdev->palette_stats.evictions++;
+    }
+}
+
 static _inline void PaletteCacheAdd(PDev *pdev, InternalPalette *palette)
 {
     int key;
 
     DEBUG_PRINT((pdev, 12, "%s\n", __FUNCTION__));
 
-    if (!palette->palette.unique) {
-        DEBUG_PRINT((pdev, 13, "%s: not unique\n", __FUNCTION__));
-        return;
-    }
-
-    if (pdev->num_palettes == PALETTE_CACHE_SIZE) {
-        ASSERT(pdev, RingGetTail(pdev, &pdev->palette_lru));
-        PaletteCacheRemove(pdev, CONTAINEROF(RingGetTail(pdev, &pdev->palette_lru),
-                                             InternalPalette, lru_link));
-    }
+    PaletteCacheTrim(pdev, pdev->palette_cache_size - 1);
 
-    key = PALETTE_HASH_VAL(palette->palette.unique);
+    key = PALETTE_HASH_VAL(palette->hash);
     palette->next = pdev->palette_cache[key];
     pdev->palette_cache[key] = palette;
 
@@ -1596,10 +2736,48 @@ static _inline void PaletteCacheAdd(PDev *pdev, InternalPalette *palette)
     DEBUG_PRINT((pdev, 13, "%s: done\n", __FUNCTION__));
 }
 
+BOOL SetPaletteCacheSize(PDev *pdev, UINT32 size)
+{
+    if (size == 0 || size > PALETTE_CACHE_MAX) {
+        return FALSE;
+    }
+    pdev->palette_cache_size = size;
+    PaletteCacheTrim(pdev, size);
+    return TRUE;
+}
+
+void GetPaletteCacheStats(PDev *pdev, QXLPaletteCacheStats *stats)
+{
+    *stats = pdev->palette_stats;
+    stats->size = pdev->palette_cache_size;
+    stats->count = pdev->num_palettes;
+}
+
+BOOL SetUpdateFreqParams(PDev *pdev, QXLUpdateFreqParams *params)
+{
+    // counts saturate at 0xff and a region must be able to leave the stream state
+    if (!params->fast_interval || params->quiet_time <= params->fast_interval ||
+        !params->enter_count || params->enter_count > 0xff ||
+        !params->leave_count || params->leave_count > params->enter_count) {
+        return FALSE;
+    }
+    pdev->update_freq_params = *params;
+    RtlZeroMemory(pdev->update_grid, sizeof(pdev->update_grid));
+    return TRUE;
+}
+
+void GetUpdateFreqQuery(PDev *pdev, QXLUpdateFreqQuery *query)
+{
+    query->params = pdev->update_freq_params;
+    query->stats = pdev->update_freq_stats;
+}
 
+/* Palettes are looked up by content, GDI hands out a new iUniq for the same table on every
+ * call in some 8bpp cases. The device gets a unique per cached content. */
 static _inline void GetPallette(PDev *pdev, QXLBitmap *bitmap, XLATEOBJ *color_trans)
 {
     InternalPalette *internal;
+    UINT32 hash;
 
     DEBUG_PRINT((pdev, 12, "%s\n", __FUNCTION__));
     if (!color_trans || !(color_trans->flXlate & XO_TABLE)) {
@@ -1607,18 +2785,23 @@ static _inline void GetPallette(PDev *pdev, QXLBitmap *bitmap, XLATEOBJ *color_t
         return;
     }
 
-    if ((internal = PaletteCacheGet(pdev, color_trans->iUniq))) {
+    hash = murmurhash2a(color_trans->pulXlate, color_trans->cEntries << 2,
+                        color_trans->cEntries);
+    if ((internal = PaletteCacheGet(pdev, hash, color_trans))) {
         DEBUG_PRINT((pdev, 12, "%s: from cache\n", __FUNCTION__));
         bitmap->palette = PA(pdev, &internal->palette, pdev->main_mem_slot);
+        pdev->palette_stats.hits++;
         return;
     }
+    pdev->palette_stats.misses++;
 
     internal = (InternalPalette *)AllocMem(pdev, MSPACE_TYPE_DEVRAM, sizeof(InternalPalette) +
                                            (color_trans->cEntries << 2));
     internal->refs = 1;
+    internal->hash = hash;
     RingItemInit(&internal->lru_link);
     bitmap->palette = PA(pdev, &internal->palette, pdev->main_mem_slot);
-    internal->palette.unique = color_trans->iUniq;
+    internal->palette.unique = ++pdev->last_palette_id;
     internal->palette.num_ents = (UINT16)color_trans->cEntries;
 
     RtlCopyMemory(internal->palette.ents, color_trans->pulXlate, color_trans->cEntries << 2);
@@ -1669,7 +2852,8 @@ static _inline QuicImageType GetQuicImageType(UINT8 format)
 }
 
 #define QUIC_ALLOC_BASE (sizeof(Resource) + sizeof(InternalImage) + sizeof(QXLDataChunk))
-#define QUIC_BUF_MAX (64 * 1024)
+// let a single chunk hold a worst case (uncompressed) row of very wide bitmaps
+#define QUIC_BUF_MAX(row_size) MAX(64 * 1024, ALIGN((row_size) + 16, 4))
 #define QUIC_BUF_MIN 1024
 
 struct QuicData {
@@ -1692,9 +2876,9 @@ static int quic_usr_more_space(QuicUsrContext *usr, uint32_t **io_ptr, int rows_
     int more;
 
     ASSERT(pdev, usr_data->rows >= rows_completed);
-    more =  (rows_completed - usr_data->rows) * usr_data->raw_row_size;
+    more =  (usr_data->rows - rows_completed) * usr_data->raw_row_size;
 
-    alloc_size = MIN(MAX(more >> 4, QUIC_BUF_MIN), QUIC_BUF_MAX);
+    alloc_size = MIN(MAX(more >> 4, QUIC_BUF_MIN), QUIC_BUF_MAX(usr_data->raw_row_size));
     new_chank = AllocMem(pdev, MSPACE_TYPE_DEVRAM, sizeof(QXLDataChunk) + alloc_size);
     new_chank->data_size = 0;
     new_chank->prev_chunk = PA(pdev, usr_data->chunk, pdev->main_mem_slot);
@@ -1741,11 +2925,12 @@ static _inline Resource *GetQuicImage(PDev *pdev, SURFOBJ *surf, XLATEOBJ *color
         return NULL;
     }
 
-    EngAcquireSemaphore(pdev->quic_data_sem);
+    PerfAcquireSemaphore(pdev, pdev->quic_data_sem, QXL_PERF_WAIT_QUIC_SEM);
 
     quic_data = pdev->quic_data;
 
-    alloc_size = MIN(QUIC_ALLOC_BASE + (height * line_size >> 4), QUIC_ALLOC_BASE + QUIC_BUF_MAX);
+    alloc_size = MIN(QUIC_ALLOC_BASE + ((size_t)height * line_size >> 4),
+                     QUIC_ALLOC_BASE + QUIC_BUF_MAX(line_size));
     alloc_size = MAX(alloc_size, QUIC_ALLOC_BASE + QUIC_BUF_MIN);
 
     image_res = AllocMem(pdev, MSPACE_TYPE_DEVRAM, alloc_size);
@@ -1857,6 +3042,40 @@ static _inline void SaveFPU(PDev *pdev, UINT8 FPUSave[])
 
 #endif
 
+// below this, saving the SSE registers costs more than streaming saves
+#define BULK_COPY_MIN_SSE (16 * 1024)
+
+/* Copy of whole surfaces between VRAM and RAM on mode switches. Streaming stores keep the
+ * megabytes going through from evicting the cache, and are what write combined VRAM wants. */
+void CopyBulk(PDev *pdev, UINT8 *dest, UINT8 *src, size_t size)
+{
+#ifndef _WIN64
+    UINT8 FPUSave[16 * 4 + 15];
+    size_t offset;
+
+    if (!have_sse2 || size < BULK_COPY_MIN_SSE) {
+        RtlCopyMemory(dest, src, size);
+        return;
+    }
+    SaveFPU(pdev, FPUSave);
+    if ((offset = (size_t)dest & SSE_MASK)) {
+        offset = SSE_ALIGN - offset;
+        RtlCopyMemory(dest, src, offset);
+        dest += offset;
+        src += offset;
+        size -= offset;
+    }
+    if (((size_t)src & SSE_MASK) == 0) {
+        fast_memcpy_aligment(dest, src, size);
+    } else {
+        fast_memcpy_unaligment(dest, src, size);
+    }
+    RestoreFPU(pdev, FPUSave);
+#else
+    RtlCopyMemory(dest, src, size);
+#endif
+}
+
 static void FreeSurfaceImage(PDev *pdev, Resource *res)
 {
     DEBUG_PRINT((pdev, 12, "%s\n", __FUNCTION__));
@@ -1881,17 +3100,16 @@ static _inline Resource *GetBitmapImage(PDev *pdev, SURFOBJ *surf, XLATEOBJ *col
     UINT8 *dest_end;
     UINT8 FPUSave[16 * 4 + 15];
     BOOL use_sse = FALSE;
+    UINT32 row_alignment;
 
     DEBUG_PRINT((pdev, 12, "%s\n", __FUNCTION__));
     ASSERT(pdev, width > 0 && height > 0);
 
-    if (line_size >= BITS_BUF_MAX) {
-        DEBUG_PRINT((pdev, 0, "%s: line size (%u) exceeds max (%u)\n", __FUNCTION__,
-                     line_size, BITS_BUF_MAX));
-        return NULL;
-    }
-    alloc_size = BITMAP_ALLOC_BASE + BITS_BUF_MAX - BITS_BUF_MAX % line_size;
-    alloc_size = MIN(BITMAP_ALLOC_BASE + height * line_size, alloc_size);
+    // rows wider than BITS_BUF_MAX are split across chunks, so chunks are
+    // only kept row aligned when a whole row fits in one of them
+    row_alignment = line_size < BITS_BUF_MAX ? line_size : 1;
+    alloc_size = BITMAP_ALLOC_BASE + BITS_BUF_MAX - BITS_BUF_MAX % row_alignment;
+    alloc_size = MIN(BITMAP_ALLOC_BASE + (size_t)height * line_size, alloc_size);
     image_res = AllocMem(pdev, MSPACE_TYPE_DEVRAM, alloc_size);
     ONDBG(pdev->num_bits_pages++);
 
@@ -1916,7 +3134,7 @@ static _inline Resource *GetBitmapImage(PDev *pdev, SURFOBJ *surf, XLATEOBJ *col
     src += surf->lDelta * (height - 1);
     dest = chunk->data;
     dest_end = (UINT8 *)image_res + alloc_size;
-    alloc_size = height * line_size;
+    alloc_size = (size_t)height * line_size;
 
 #ifndef _WIN64
     if (have_sse2 && alloc_size >= 1024) {
@@ -1926,7 +3144,7 @@ static _inline Resource *GetBitmapImage(PDev *pdev, SURFOBJ *surf, XLATEOBJ *col
 #endif
     for (; src != src_end; src -= surf->lDelta, alloc_size -= line_size) {
         PutBytesAlign(pdev, &chunk, &dest, &dest_end, src, line_size,
-                      &pdev->num_bits_pages, alloc_size, line_size, use_sse);
+                      &pdev->num_bits_pages, alloc_size, row_alignment, use_sse);
     }
 #ifndef _WIN64
     if (use_sse) {
@@ -2084,6 +3302,33 @@ BOOL QXLCheckIfCacheImage(PDev *pdev, SURFOBJ *surf, XLATEOBJ *color_trans)
     return FALSE;
 }
 
+static CacheImage *CacheImageGetOrAdd(PDev *pdev, UINT32 key, UINT8 format, UINT32 width,
+                                      UINT32 height, BOOL admit)
+{
+    CacheImage *cache_image;
+
+    if ((cache_image = ImageCacheGetByKey(pdev, key, TRUE, format, width, height))) {
+        cache_image->hits++;
+        DEBUG_PRINT((pdev, 11, "%s: ImageCacheGetByKey %u hits %u\n", __FUNCTION__,
+                     key, cache_image->hits));
+        return cache_image;
+    }
+
+    if (admit) {
+        cache_image = AllocCacheImage(pdev);
+        ImageCacheRemove(pdev, cache_image);
+        cache_image->key = key;
+        cache_image->image = NULL;
+        cache_image->format = format;
+        cache_image->width = width;
+        cache_image->height = height;
+        ImageCacheAdd(pdev, cache_image);
+        RingAdd(pdev, &pdev->cache_image_lru, &cache_image->lru_link);
+        DEBUG_PRINT((pdev, 11, "%s: ImageCacheAdd %u\n", __FUNCTION__, key));
+    }
+    return NULL;
+}
+
 static CacheImage *GetCacheImage(PDev *pdev, SURFOBJ *surf, XLATEOBJ *color_trans,
                                  BOOL has_alpha, BOOL high_bits_set, UINT32 *hash_key)
 {
@@ -2117,29 +3362,8 @@ static CacheImage *GetCacheImage(PDev *pdev, SURFOBJ *surf, XLATEOBJ *color_tran
         *hash_key = key;
     }
 
-    if ((cache_image = ImageCacheGetByKey(pdev, key, TRUE, format,
-                                          surf->sizlBitmap.cx,
-                                          surf->sizlBitmap.cy))) {
-        cache_image->hits++;
-        DEBUG_PRINT((pdev, 11, "%s: ImageCacheGetByKey %u hits %u\n", __FUNCTION__,
-                     key, cache_image->hits));
-        return cache_image;
-    }
-
-    if (CacheSizeTest(pdev, surf)) {
-        CacheImage *cache_image;
-        cache_image = AllocCacheImage(pdev);
-        ImageCacheRemove(pdev, cache_image);
-        cache_image->key = key;
-        cache_image->image = NULL;
-        cache_image->format = format;
-        cache_image->width = surf->sizlBitmap.cx;
-        cache_image->height = surf->sizlBitmap.cy;
-        ImageCacheAdd(pdev, cache_image);
-        RingAdd(pdev, &pdev->cache_image_lru, &cache_image->lru_link);
-        DEBUG_PRINT((pdev, 11, "%s: ImageCacheAdd %u\n", __FUNCTION__, key));
-    }
-    return NULL;
+    return CacheImageGetOrAdd(pdev, key, format, surf->sizlBitmap.cx, surf->sizlBitmap.cy,
+                              CacheSizeTest(pdev, surf));
 }
 
 // TODO: reconsider
@@ -2179,9 +3403,126 @@ static int rgb32_data_has_alpha(int width, int height, int stride,
             line++;
         }
     }
-
-    *all_set_out = has_alpha;
-    return has_alpha;
+
+    *all_set_out = has_alpha;
+    return has_alpha;
+}
+
+static int rgb32_data_is_opaque(int width, int height, int stride, UINT8 *data)
+{
+    UINT32 *line, *end;
+
+    while (height-- > 0) {
+        line = (UINT32 *)data;
+        end = line + width;
+        data += stride;
+        while (line != end) {
+            if ((*line & 0xff000000U) != 0xff000000U) {
+                return FALSE;
+            }
+            line++;
+        }
+    }
+    return TRUE;
+}
+
+// QUIC codes the alpha plane as a separate channel, small translucent images don't pay it back
+#define QUIC_RGBA_MIN_PIXELS (32 * 32)
+// cache a sub-rect on its own when it covers less than 1/SUB_IMAGE_RATIO of its surface
+#define SUB_IMAGE_RATIO 2
+
+static BOOL GetAlphaImage(PDev *pdev, QXLDrawable *drawable, QXLPHYSICAL *image_phys,
+                          SURFOBJ *surf, QXLRect *area, XLATEOBJ *color_trans,
+                          UINT32 *hash_key, BOOL use_cache)
+{
+    Resource *image_res;
+    InternalImage *internal;
+    CacheImage *cache_image;
+    BOOL sub_image;
+    UINT32 key;
+    UINT8 *src;
+    INT32 width = area->right - area->left;
+    INT32 height = area->bottom - area->top;
+
+    ASSERT(pdev, surf->iBitmapFormat == BMF_32BPP && surf->iType == STYPE_BITMAP);
+    src = (UINT8 *)surf->pvScan0 + area->top * surf->lDelta + (area->left << 2);
+    cache_image = NULL;
+    sub_image = FALSE;
+
+    if (use_cache) {
+        // a cached parent is referenced as is (the drawable's src area picks the sub-rect),
+        // small areas of uncached surfaces are hashed and cached on their own
+        if ((UINT32)width * height * SUB_IMAGE_RATIO <
+                                       (UINT32)surf->sizlBitmap.cx * surf->sizlBitmap.cy &&
+            !ImageKeyGet(pdev, surf->hsurf, get_unique(surf, color_trans), &key)) {
+            sub_image = TRUE;
+            key = GetHash(src, width, height, SPICE_BITMAP_FMT_RGBA, FALSE, width << 2,
+                          surf->lDelta, NULL);
+            cache_image = CacheImageGetOrAdd(pdev, key, SPICE_BITMAP_FMT_RGBA, width, height,
+                                             (UINT32)width * height <= pdev->max_bitmap_size);
+        } else {
+            cache_image = GetCacheImage(pdev, surf, color_trans, TRUE, FALSE, &key);
+        }
+        if (hash_key) {
+            *hash_key = key;
+        }
+
+        if (cache_image && (internal = cache_image->image)) {
+            DEBUG_PRINT((pdev, 11, "%s: cached image found %u%s\n", __FUNCTION__, key,
+                         sub_image ? " (sub image)" : ""));
+            TraceImage(pdev, 0, 0, TRUE);
+            *image_phys = PA(pdev, &internal->image, pdev->main_mem_slot);
+            image_res = (Resource *)((UINT8 *)internal - sizeof(Resource));
+            DrawableAddRes(pdev, drawable, image_res);
+            if (sub_image) {
+                area->left = 0;
+                area->right = width;
+                area->top = 0;
+                area->bottom = height;
+            }
+            return TRUE;
+        }
+    }
+
+    if (cache_image && !sub_image) {
+        width = surf->sizlBitmap.cx;
+        height = surf->sizlBitmap.cy;
+        src = surf->pvScan0;
+    } else {
+        if (!cache_image) {
+            key = get_image_serial();
+        }
+        area->left = 0;
+        area->right = width;
+        area->top = 0;
+        area->bottom = height;
+    }
+
+    image_res = NULL;
+    if (width * height >= QUIC_RGBA_MIN_PIXELS) {
+        image_res = GetQuicImage(pdev, surf, NULL, !!cache_image, width, height,
+                                 SPICE_BITMAP_FMT_RGBA, src, width << 2, key);
+    }
+    if (!image_res) {
+        image_res = GetBitmapImage(pdev, surf, NULL, !!cache_image, width, height,
+                                   SPICE_BITMAP_FMT_RGBA, src, width << 2, key);
+        if (!image_res) {
+            return FALSE;
+        }
+    }
+    internal = (InternalImage *)image_res->res;
+    TraceEncodedImage(pdev, internal, height * (width << 2));
+    if ((internal->cache = cache_image)) {
+        DEBUG_PRINT((pdev, 11, "%s: cache_me %u\n", __FUNCTION__, key));
+        cache_image->image = internal;
+        if (RingItemIsLinked(&cache_image->lru_link)) {
+            RingRemove(pdev, &cache_image->lru_link);
+        }
+    }
+    *image_phys = PA(pdev, &internal->image, pdev->main_mem_slot);
+    DrawableAddRes(pdev, drawable, image_res);
+    RELEASE_RES(pdev, image_res);
+    return TRUE;
 }
 
 BOOL QXLGetBitmap(PDev *pdev, QXLDrawable *drawable, QXLPHYSICAL *image_phys, SURFOBJ *surf,
@@ -2221,6 +3562,7 @@ BOOL QXLGetBitmap(PDev *pdev, QXLDrawable *drawable, QXLPHYSICAL *image_phys, SU
         internal->image.descriptor.width = 0;
         internal->image.descriptor.height = 0;
         *surface_dest = internal->image.surface_image.surface_id = GetSurfaceId(surf);
+        TraceImage(pdev, QXL_TRACE_ENCODE_SURFACE, 0, FALSE);
 
         *image_phys = PA(pdev, &internal->image, pdev->main_mem_slot);
 
@@ -2240,11 +3582,11 @@ BOOL QXLGetBitmap(PDev *pdev, QXLDrawable *drawable, QXLPHYSICAL *image_phys, SU
     high_bits_set = FALSE;
     if (surf->iBitmapFormat == BMF_32BPP) {
         if (rgb32_data_has_alpha(width, height, surf->lDelta,
-                                 (UINT8 *)surf->pvScan0 + area->left * 4,
-                                 &high_bits_set) &&
+                                 (UINT8 *)surf->pvScan0 + area->top * surf->lDelta +
+                                 area->left * 4, &high_bits_set) &&
             !high_bits_set) {
-            return QXLGetAlphaBitmap(pdev, drawable, image_phys,
-                                     surf, area, surface_dest, color_trans);
+            return GetAlphaImage(pdev, drawable, image_phys, surf, area, color_trans,
+                                 hash_key, use_cache);
         }
     }
 
@@ -2260,6 +3602,7 @@ BOOL QXLGetBitmap(PDev *pdev, QXLDrawable *drawable, QXLPHYSICAL *image_phys, SU
         cache_image = GetCacheImage(pdev, surf, color_trans, FALSE, high_bits_set, hash_key);
         if (cache_image && cache_image->image) {
             DEBUG_PRINT((pdev, 11, "%s: cached image found %u\n", __FUNCTION__, cache_image->key));
+            TraceImage(pdev, 0, 0, TRUE);
             internal = cache_image->image;
             *image_phys = PA(pdev, &internal->image, pdev->main_mem_slot);
             image_res = (Resource *)((UINT8 *)internal - sizeof(Resource));
@@ -2333,6 +3676,7 @@ BOOL QXLGetBitmap(PDev *pdev, QXLDrawable *drawable, QXLPHYSICAL *image_phys, SU
         }
     }
     internal = (InternalImage *)image_res->res;
+    TraceEncodedImage(pdev, internal, height * line_size);
     if (high_bits_set) {
         internal->image.descriptor.flags |= QXL_IMAGE_HIGH_BITS_SET;
     }
@@ -2354,10 +3698,6 @@ BOOL QXLGetAlphaBitmap(PDev *pdev, QXLDrawable *drawable, QXLPHYSICAL *image_phy
 {
     Resource *image_res;
     InternalImage *internal;
-    CacheImage *cache_image;
-    UINT64 gdi_unique;
-    UINT32 key;
-    UINT8 *src;
     INT32 width = area->right - area->left;
     INT32 height = area->bottom - area->top;
 
@@ -2392,6 +3732,7 @@ BOOL QXLGetAlphaBitmap(PDev *pdev, QXLDrawable *drawable, QXLPHYSICAL *image_phy
         internal->image.descriptor.width = 0;
         internal->image.descriptor.height = 0;
         *surface_dest = internal->image.surface_image.surface_id = GetSurfaceId(surf);
+        TraceImage(pdev, QXL_TRACE_ENCODE_SURFACE, 0, FALSE);
 
         *image_phys = PA(pdev, &internal->image, pdev->main_mem_slot);
         DrawableAddRes(pdev, drawable, image_res);
@@ -2400,51 +3741,16 @@ BOOL QXLGetAlphaBitmap(PDev *pdev, QXLDrawable *drawable, QXLPHYSICAL *image_phy
         return TRUE;
     }
 
-    ASSERT(pdev, surf->iBitmapFormat == BMF_32BPP && surf->iType == STYPE_BITMAP);
-    cache_image = GetCacheImage(pdev, surf, color_trans, TRUE, FALSE, &key);
-
-    if (cache_image) {
-        if (internal = cache_image->image) {
-            DEBUG_PRINT((pdev, 11, "%s: cached image found %u\n", __FUNCTION__, key));
-            *image_phys = PA(pdev, &internal->image, pdev->main_mem_slot);
-            image_res = (Resource *)((UINT8 *)internal - sizeof(Resource));
-            DrawableAddRes(pdev, drawable, image_res);
-            return TRUE;
-        }
-    }
-
-    if (cache_image) {
-        width = surf->sizlBitmap.cx;
-        height = surf->sizlBitmap.cy;
-        src = surf->pvScan0;
-    } else {
-        src = (UINT8 *)surf->pvScan0 + area->top * surf->lDelta + (area->left << 2);
-        area->left = 0;
-        area->right = width;
-        area->top = 0;
-        area->bottom = height;
-    }
-
-    if (!(image_res = GetQuicImage(pdev, surf, NULL, !!cache_image, width, height,
-                                   SPICE_BITMAP_FMT_RGBA, src, width << 2, key))) {
-        image_res = GetBitmapImage(pdev, surf, NULL, !!cache_image, width, height,
-                                   SPICE_BITMAP_FMT_RGBA, src, width << 2, key);
-        if (!image_res) {
-            return FALSE;
-        }
-    }
-    internal = (InternalImage *)image_res->res;
-    if ((internal->cache = cache_image)) {
-        DEBUG_PRINT((pdev, 11, "%s: cache_me %u\n", __FUNCTION__, key));
-        cache_image->image = internal;
-        if (RingItemIsLinked(&cache_image->lru_link)) {
-            RingRemove(pdev, &cache_image->lru_link);
-        }
+    // an opaque area gains nothing from its alpha channel, so it is sent (and cached) like
+    // any 32bpp bitmap
+    if (rgb32_data_is_opaque(width, height, surf->lDelta,
+                             (UINT8 *)surf->pvScan0 + area->top * surf->lDelta +
+                             (area->left << 2))) {
+        DEBUG_PRINT((pdev, 11, "%s: opaque\n", __FUNCTION__));
+        return QXLGetBitmap(pdev, drawable, image_phys, surf, area, color_trans, NULL, TRUE,
+                            surface_dest);
     }
-    *image_phys = PA(pdev, &internal->image, pdev->main_mem_slot);
-    DrawableAddRes(pdev, drawable, image_res);
-    RELEASE_RES(pdev, image_res);
-    return TRUE;
+    return GetAlphaImage(pdev, drawable, image_phys, surf, area, color_trans, NULL, TRUE);
 }
 
 BOOL QXLGetBitsFromCache(PDev *pdev, QXLDrawable *drawable, UINT32 hash_key, QXLPHYSICAL *image_phys)
@@ -2456,6 +3762,7 @@ BOOL QXLGetBitsFromCache(PDev *pdev, QXLDrawable *drawable, UINT32 hash_key, QXL
     if ((cache_image = ImageCacheGetByKey(pdev, hash_key, FALSE, 0, 0, 0)) &&
         (internal = cache_image->image)) {
         cache_image->hits++;
+        TraceImage(pdev, 0, 0, TRUE);
         *image_phys = PA(pdev, &internal->image, pdev->main_mem_slot);
         image_res = (Resource *)((UINT8 *)internal - sizeof(Resource));
         DrawableAddRes(pdev, drawable, image_res);
@@ -2524,6 +3831,26 @@ UINT8 *QXLGetBuf(PDev *pdev, QXLDrawable *drawable, QXLPHYSICAL *buf_phys, UINT3
     return buf_res->res;
 }
 
+/* Once area was read back, shrink the dirty rect by any band of it that area covers. */
+static void SurfaceClearDirty(PDev *pdev, RECTL *area, UINT32 surface_id)
+{
+    RECTL *dirty = &GetSurfaceInfo(pdev, surface_id)->dirty;
+
+    if (area->left <= dirty->left && area->right >= dirty->right) {
+        if (area->top <= dirty->top && area->bottom > dirty->top) {
+            dirty->top = MIN(area->bottom, dirty->bottom);
+        } else if (area->bottom >= dirty->bottom && area->top < dirty->bottom) {
+            dirty->bottom = MAX(area->top, dirty->top);
+        }
+    } else if (area->top <= dirty->top && area->bottom >= dirty->bottom) {
+        if (area->left <= dirty->left && area->right > dirty->left) {
+            dirty->left = MIN(area->right, dirty->right);
+        } else if (area->right >= dirty->right && area->left < dirty->right) {
+            dirty->right = MAX(area->left, dirty->left);
+        }
+    }
+}
+
 #ifdef UPDATE_CMD
 void UpdateArea(PDev *pdev, RECTL *area, UINT32 surface_id)
 {
@@ -2566,19 +3893,89 @@ void UpdateArea(PDev *pdev, RECTL *area, UINT32 surface_id)
 #endif // DEBUG
         mb();
     } while (*pdev->dev_update_id != pdev->update_id);
+    SurfaceClearDirty(pdev, area, surface_id);
 }
 
 #else
 
-void UpdateArea(PDev *pdev, RECTL *area, UINT32 surface_id)
+/* Issue an update of area without waiting for the device to complete it. */
+static void UpdateAreaStart(PDev *pdev, RECTL *area, UINT32 surface_id)
 {
-    DEBUG_PRINT((pdev, 12, "%s IO\n", __FUNCTION__));
+    // update_area and update_surface may still be in use by an update in flight
+    async_io_wait(pdev);
     CopyRect(pdev->update_area, area);
     *pdev->update_surface = surface_id;
-    async_io(pdev, ASYNCABLE_UPDATE_AREA, 0);
+    EngAcquireSemaphore(pdev->io_sem);
+    pdev->update_pending_surface = surface_id;
+    CopyRect(&pdev->update_pending_area, area);
+    EngReleaseSemaphore(pdev->io_sem);
+    async_io_start(pdev, ASYNCABLE_UPDATE_AREA, 0);
+    SurfaceClearDirty(pdev, area, surface_id);
+}
+
+void UpdateArea(PDev *pdev, RECTL *area, UINT32 surface_id)
+{
+    DEBUG_PRINT((pdev, 12, "%s IO\n", __FUNCTION__));
+    UpdateAreaStart(pdev, area, surface_id);
+    async_io_wait(pdev);
+}
+
+#endif
+
+// below this size the whole dirty rect is read back at once, saving the round trips of
+// later reads of its other parts
+#define UPDATE_DIRTY_MERGE_PIXELS (256 * 256)
+// up to this size the rest of the dirty rect is rendered in the background after a read
+#define UPDATE_PREFETCH_PIXELS (1024 * 1024)
+
+/* Whether an async io is in flight that updates part of area of the surface. io_pending and
+ * the pending update are changed under io_sem by other threads doing io. */
+static BOOL async_io_pending_overlaps(PDev *pdev, RECTL *area, UINT32 surface_id)
+{
+    RECTL pending;
+    BOOL overlaps = FALSE;
+
+    EngAcquireSemaphore(pdev->io_sem);
+    if (pdev->io_pending && pdev->update_pending_surface == surface_id) {
+        SectRect(area, &pdev->update_pending_area, &pending);
+        overlaps = !IsEmptyRect(&pending);
+    }
+    EngReleaseSemaphore(pdev->io_sem);
+    return overlaps;
 }
 
+/* Bring area of the guest side draw area up to date. The dirty rect of each surface acts as
+ * its queue of merged update requests: only what was drawn since the last update is asked
+ * for, and the rest of it is issued without waiting so that it is likely done by the next
+ * read. */
+void UpdateDirtyArea(PDev *pdev, RECTL *area, UINT32 surface_id)
+{
+    RECTL *dirty = &GetSurfaceInfo(pdev, surface_id)->dirty;
+    RECTL update;
+
+    // a read must not overtake an update of its area that is still in flight
+    if (async_io_pending_overlaps(pdev, area, surface_id)) {
+        async_io_wait(pdev);
+    }
+
+    SectRect(area, dirty, &update);
+    if (IsEmptyRect(&update)) {
+        DEBUG_PRINT((pdev, 12, "%s: %u: up to date\n", __FUNCTION__, surface_id));
+        return;
+    }
+
+    if (RectSize(dirty) <= MAX(RectSize(&update) * 4, UPDATE_DIRTY_MERGE_PIXELS)) {
+        CopyRect(&update, dirty);
+    }
+    UpdateArea(pdev, &update, surface_id);
+
+#ifndef UPDATE_CMD
+    if (!IsEmptyRect(dirty) && RectSize(dirty) <= UPDATE_PREFETCH_PIXELS) {
+        CopyRect(&update, dirty);
+        UpdateAreaStart(pdev, &update, surface_id);
+    }
 #endif
+}
 
 static _inline void add_rast_glyphs(PDev *pdev, QXLString *str, ULONG count, GLYPHPOS *glyps,
                                     QXLDataChunk **chunk_ptr, UINT8 **now_ptr,
@@ -2793,30 +4190,112 @@ QXLCursorCmd *CursorCmd(PDev *pdev)
 
 void PushCursorCmd(PDev *pdev, QXLCursorCmd *cursor_cmd)
 {
+    QXLTraceRecord record;
+    BOOL trace = pdev->trace_ring != NULL;
     QXLCommand *cmd;
 
     DEBUG_PRINT((pdev, 6, "%s\n", __FUNCTION__));
+    if (trace) {
+        RtlZeroMemory(&record, sizeof(record));
+        record.ring = QXL_TRACE_RING_CURSOR;
+        record.type = cursor_cmd->type;
+        if (cursor_cmd->type == QXL_CURSOR_SET) {
+            record.bbox.left = record.bbox.right = cursor_cmd->u.set.position.x;
+            record.bbox.top = record.bbox.bottom = cursor_cmd->u.set.position.y;
+        } else if (cursor_cmd->type == QXL_CURSOR_MOVE) {
+            record.bbox.left = record.bbox.right = cursor_cmd->u.position.x;
+            record.bbox.top = record.bbox.bottom = cursor_cmd->u.position.y;
+        }
+    }
     EngAcquireSemaphore(pdev->cursor_sem);
     WaitForCursorRing(pdev);
+    pdev->cursor_move = cursor_cmd->type == QXL_CURSOR_MOVE ? cursor_cmd : NULL;
+    pdev->cursor_move_prod = pdev->cursor_ring->prod;
     cmd = SPICE_RING_PROD_ITEM(pdev->cursor_ring);
     cmd->type = QXL_CMD_CURSOR;
     cmd->data = PA(pdev, cursor_cmd, pdev->main_mem_slot);
     PUSH_CURSOR_CMD(pdev);
     EngReleaseSemaphore(pdev->cursor_sem);
+
+    if (trace) {
+        TracePush(pdev, &record);
+    }
     DEBUG_PRINT((pdev, 8, "%s: done\n", __FUNCTION__));
 }
 
+/* Move the cursor by overwriting the position of the last pushed command, when it is a move
+ * the device hasn't taken off the ring yet. Returns FALSE if a move has to be pushed. */
+BOOL CoalesceCursorMove(PDev *pdev, LONG x, LONG y)
+{
+    BOOL ret = FALSE;
+
+    if (!pdev->cursor_move) {
+        return FALSE;
+    }
+    // released commands are freed with malloc_sem held, the move can't be freed meanwhile
+    PerfAcquireSemaphore(pdev, pdev->malloc_sem, QXL_PERF_WAIT_MALLOC_SEM);
+    EngAcquireSemaphore(pdev->cursor_sem);
+    if (pdev->cursor_move &&
+        (INT32)(pdev->cursor_ring->cons - pdev->cursor_move_prod) <= 0) {
+        // a single store, the device may take the command while it is written
+        *(UINT32 *)&pdev->cursor_move->u.position = (UINT16)x | ((UINT32)(UINT16)y << 16);
+        mb();
+        // the device may have read the old position just before the store, in which case
+        // the new one must be pushed
+        ret = (INT32)(pdev->cursor_ring->cons - pdev->cursor_move_prod) <= 0;
+    }
+    EngReleaseSemaphore(pdev->cursor_sem);
+    EngReleaseSemaphore(pdev->malloc_sem);
+    return ret;
+}
+
 typedef struct InternalCursor {
-    struct InternalCursor *next;
+    struct InternalCursor *next; // in cursor_cache while unique is set
+    struct InternalCursor *content_next;
     RingItem lru_link;
     HSURF   hsurf;
     ULONG   unique;
+    UINT32  hash;
     QXLCursor cursor;
 } InternalCursor;
 
 
 #define CURSOR_HASH_VAL(hsurf) (HSURF_HASH_VAL(hsurf) & CURSOR_HASH_NASKE)
 
+/* Drop the surface key of a cursor, it stays cached by content. */
+static void CursorCacheUnkey(PDev *pdev, InternalCursor *cursor)
+{
+    InternalCursor **internal;
+
+    if (!cursor->unique) {
+        return;
+    }
+    internal = &pdev->cursor_cache[CURSOR_HASH_VAL(cursor->hsurf)];
+    while (*internal) {
+        if (*internal == cursor) {
+            *internal = cursor->next;
+            break;
+        }
+        internal = &(*internal)->next;
+    }
+    cursor->unique = 0;
+}
+
+static void CursorCacheKey(PDev *pdev, InternalCursor *cursor, HSURF hsurf, ULONG unique)
+{
+    int key;
+
+    CursorCacheUnkey(pdev, cursor);
+    if (!unique) {
+        return;
+    }
+    cursor->hsurf = hsurf;
+    cursor->unique = unique;
+    key = CURSOR_HASH_VAL(hsurf);
+    cursor->next = pdev->cursor_cache[key];
+    pdev->cursor_cache[key] = cursor;
+}
+
 static void CursorCacheRemove(PDev *pdev, InternalCursor *cursor)
 {
     InternalCursor **internal;
@@ -2824,19 +4303,15 @@ static void CursorCacheRemove(PDev *pdev, InternalCursor *cursor)
 
     DEBUG_PRINT((pdev, 12, "%s\n", __FUNCTION__));
 
-    ASSERT(pdev, cursor->unique);
-    internal = &pdev->cursor_cache[CURSOR_HASH_VAL(cursor->hsurf)];
-
+    CursorCacheUnkey(pdev, cursor);
+    internal = &pdev->cursor_content_cache[cursor->hash & CURSOR_HASH_NASKE];
     while (*internal) {
-        if ((*internal)->hsurf == cursor->hsurf) {
-            if ((*internal) == cursor) {
-                *internal = cursor->next;
-                found = TRUE;
-                break;
-            }
-            DEBUG_PRINT((pdev, 0, "%s: unexpected\n", __FUNCTION__));
+        if ((*internal) == cursor) {
+            *internal = cursor->content_next;
+            found = TRUE;
+            break;
         }
-        internal = &(*internal)->next;
+        internal = &(*internal)->content_next;
     }
 
     RingRemove(pdev, &cursor->lru_link);
@@ -2862,25 +4337,23 @@ static void CursorCacheClear(PDev *pdev)
     }
 }
 
-static void CursorCacheAdd(PDev *pdev, InternalCursor *cursor)
+static void CursorCacheAdd(PDev *pdev, InternalCursor *cursor, HSURF hsurf, ULONG unique)
 {
     int key;
 
     DEBUG_PRINT((pdev, 12, "%s\n", __FUNCTION__));
 
-    if (!cursor->unique) {
-        return;
-    }
-
-    if (pdev->num_cursors == CURSOR_CACHE_SIZE) {
+    if (pdev->num_cursors >= pdev->cursor_cache_size) {
         ASSERT(pdev, RingGetTail(pdev, &pdev->cursors_lru));
         CursorCacheRemove(pdev, CONTAINEROF(RingGetTail(pdev, &pdev->cursors_lru),
                                             InternalCursor, lru_link));
+        pdev->cursor_stats.evictions++;
     }
 
-    key = CURSOR_HASH_VAL(cursor->hsurf);
-    cursor->next = pdev->cursor_cache[key];
-    pdev->cursor_cache[key] = cursor;
+    key = cursor->hash & CURSOR_HASH_NASKE;
+    cursor->content_next = pdev->cursor_content_cache[key];
+    pdev->cursor_content_cache[key] = cursor;
+    CursorCacheKey(pdev, cursor, hsurf, unique);
 
     RingAdd(pdev, &pdev->cursors_lru, &cursor->lru_link);
     GET_RES((Resource *)((UINT8 *)cursor - sizeof(Resource)));
@@ -2905,7 +4378,8 @@ static InternalCursor *CursorCacheGet(PDev *pdev, HSURF hsurf, UINT32 unique)
                 RingAdd(pdev, &pdev->cursors_lru, &now->lru_link);
                 return now;
             }
-            CursorCacheRemove(pdev, now);
+            // the surface changed, its old shape may still be used by others
+            CursorCacheUnkey(pdev, now);
             break;
         }
         internal = &now->next;
@@ -2913,6 +4387,149 @@ static InternalCursor *CursorCacheGet(PDev *pdev, HSURF hsurf, UINT32 unique)
     return NULL;
 }
 
+/* Compare size bytes at src with the cursor data at *chunk + *pos, and move past them. */
+static BOOL CursorDataEqual(PDev *pdev, QXLDataChunk **chunk, UINT32 *pos, UINT8 *src,
+                            UINT32 size)
+{
+    UINT32 cmp_size;
+
+    while (size) {
+        if (*pos == (*chunk)->data_size) {
+            if (!(*chunk)->next_chunk) {
+                return FALSE;
+            }
+            *chunk = (QXLDataChunk *)VA(pdev, (*chunk)->next_chunk, pdev->main_mem_slot);
+            *pos = 0;
+            continue;
+        }
+        cmp_size = MIN(size, (*chunk)->data_size - *pos);
+        if (!RtlEqualMemory((*chunk)->data + *pos, src, cmp_size)) {
+            return FALSE;
+        }
+        *pos += cmp_size;
+        src += cmp_size;
+        size -= cmp_size;
+    }
+    return TRUE;
+}
+
+/* Compare a cached cursor with what GetCursorCommon and GetColorCursor would copy of the
+ * new one, a hash match alone isn't proof of the same shape. */
+static BOOL CursorContentEqual(PDev *pdev, QXLCursor *cursor, SURFOBJ *surf, int line_size,
+                               SURFOBJ *mask, XLATEOBJ *color_trans)
+{
+    QXLDataChunk *chunk = &cursor->chunk;
+    UINT32 num_entries = 0;
+    UINT32 data_size;
+    UINT32 pos = 0;
+    UINT32 i;
+    UINT8 *src;
+    UINT8 *src_end;
+
+    if (cursor->header.type == SPICE_CURSOR_TYPE_COLOR8) {
+        num_entries = 256;
+    } else if (cursor->header.type == SPICE_CURSOR_TYPE_COLOR4) {
+        num_entries = 16;
+    }
+    data_size = line_size * surf->sizlBitmap.cy + (num_entries << 2);
+    if (mask) {
+        data_size += (ALIGN(mask->sizlBitmap.cx, 8) >> 3) * surf->sizlBitmap.cy;
+    }
+    if (cursor->data_size != data_size) {
+        return FALSE;
+    }
+
+    src = surf->pvScan0;
+    src_end = src + (surf->lDelta * surf->sizlBitmap.cy);
+    for (; src != src_end; src += surf->lDelta) {
+        if (!CursorDataEqual(pdev, &chunk, &pos, src, line_size)) {
+            return FALSE;
+        }
+    }
+    if (num_entries) {
+        if (!color_trans || color_trans->cEntries != num_entries) {
+            return FALSE;
+        }
+        if (pdev->bitmap_format == BMF_32BPP) {
+            if (!CursorDataEqual(pdev, &chunk, &pos, (UINT8 *)color_trans->pulXlate,
+                                 num_entries << 2)) {
+                return FALSE;
+            }
+        } else {
+            for (i = 0; i < num_entries; i++) {
+                UINT32 ent = _16bppTo32bpp(color_trans->pulXlate[i]);
+
+                if (!CursorDataEqual(pdev, &chunk, &pos, (UINT8 *)&ent, 4)) {
+                    return FALSE;
+                }
+            }
+        }
+    }
+    if (mask) {
+        line_size = ALIGN(mask->sizlBitmap.cx, 8) >> 3;
+        src = mask->pvScan0;
+        src_end = src + (mask->lDelta * surf->sizlBitmap.cy);
+        for (; src != src_end; src += mask->lDelta) {
+            if (!CursorDataEqual(pdev, &chunk, &pos, src, line_size)) {
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+static InternalCursor *CursorCacheGetByContent(PDev *pdev, UINT32 hash, QXLCursorHeader *header,
+                                               SURFOBJ *surf, int line_size, SURFOBJ *mask,
+                                               XLATEOBJ *color_trans)
+{
+    InternalCursor *now;
+
+    DEBUG_PRINT((pdev, 12, "%s\n", __FUNCTION__));
+    for (now = pdev->cursor_content_cache[hash & CURSOR_HASH_NASKE]; now;
+         now = now->content_next) {
+        if (now->hash == hash && now->cursor.header.type == header->type &&
+            now->cursor.header.width == header->width &&
+            now->cursor.header.height == header->height &&
+            now->cursor.header.hot_spot_x == header->hot_spot_x &&
+            now->cursor.header.hot_spot_y == header->hot_spot_y &&
+            CursorContentEqual(pdev, &now->cursor, surf, line_size, mask, color_trans)) {
+            RingRemove(pdev, &now->lru_link);
+            RingAdd(pdev, &pdev->cursors_lru, &now->lru_link);
+            return now;
+        }
+    }
+    return NULL;
+}
+
+/* Hash what GetCursorCommon and GetColorCursor copy of a cursor: the shape, the palette of
+ * indexed color ones and the mask of color ones. */
+static UINT32 GetCursorHash(PDev *pdev, QXLCursorHeader *header, SURFOBJ *surf, int line_size,
+                            SURFOBJ *mask, XLATEOBJ *color_trans)
+{
+    UINT32 hash = murmurhash2a(header, sizeof(*header), 0);
+    UINT8 *src;
+    UINT8 *src_end;
+
+    src = surf->pvScan0;
+    src_end = src + (surf->lDelta * surf->sizlBitmap.cy);
+    for (; src != src_end; src += surf->lDelta) {
+        hash = murmurhash2a(src, line_size, hash);
+    }
+    if (color_trans && (header->type == SPICE_CURSOR_TYPE_COLOR8 ||
+                        header->type == SPICE_CURSOR_TYPE_COLOR4)) {
+        hash = murmurhash2a(color_trans->pulXlate, color_trans->cEntries << 2, hash);
+    }
+    if (mask) {
+        line_size = ALIGN(mask->sizlBitmap.cx, 8) >> 3;
+        src = mask->pvScan0;
+        src_end = src + (mask->lDelta * surf->sizlBitmap.cy);
+        for (; src != src_end; src += mask->lDelta) {
+            hash = murmurhash2a(src, line_size, hash);
+        }
+    }
+    return hash;
+}
+
 static void FreeCursor(PDev *pdev, Resource *res)
 {
     QXLPHYSICAL chunk_phys;
@@ -2940,15 +4557,16 @@ typedef struct NewCursorInfo {
     UINT8 *end;
 } NewCursorInfo;
 
-#define CURSOR_ALLOC_SIZE (PAGE_SIZE << 1)
-
 static BOOL GetCursorCommon(PDev *pdev, QXLCursorCmd *cmd, LONG hot_x, LONG hot_y, SURFOBJ *surf,
-                            UINT16 type, NewCursorInfo *info, BOOL *in_cach)
+                            SURFOBJ *mask, XLATEOBJ *color_trans, UINT16 type,
+                            NewCursorInfo *info, BOOL *in_cach)
 {
     InternalCursor *internal;
+    QXLCursorHeader header;
     QXLCursor *cursor;
     Resource *res;
     ULONG unique;
+    UINT32 hash;
     UINT8 *src;
     UINT8 *src_end;
     int line_size;
@@ -2964,6 +4582,7 @@ static BOOL GetCursorCommon(PDev *pdev, QXLCursorCmd *cmd, LONG hot_x, LONG hot_
         CursorCmdAddRes(pdev, cmd, res);
         cmd->u.set.shape = PA(pdev, &internal->cursor, pdev->main_mem_slot);
         *in_cach = TRUE;
+        pdev->cursor_stats.surface_hits++;
         return TRUE;
     }
 
@@ -3005,6 +4624,51 @@ static BOOL GetCursorCommon(PDev *pdev, QXLCursorCmd *cmd, LONG hot_x, LONG hot_
         }
     }
 
+    RtlZeroMemory(&header, sizeof(header));
+    header.type = type;
+    header.width = (UINT16)local_surf->sizlBitmap.cx;
+    header.height = (type == SPICE_CURSOR_TYPE_MONO) ? (UINT16)local_surf->sizlBitmap.cy >> 1 :
+                    (UINT16)local_surf->sizlBitmap.cy;
+    header.hot_spot_x = (UINT16)hot_x;
+    header.hot_spot_y = (UINT16)hot_y;
+
+    switch (type) {
+    case SPICE_CURSOR_TYPE_ALPHA:
+    case SPICE_CURSOR_TYPE_COLOR32:
+        line_size = header.width << 2;
+        break;
+    case SPICE_CURSOR_TYPE_MONO:
+        line_size = ALIGN(header.width, 8) >> 3;
+        break;
+    case SPICE_CURSOR_TYPE_COLOR4:
+        line_size = ALIGN(header.width, 2) >> 1;
+        break;
+    case SPICE_CURSOR_TYPE_COLOR8:
+        line_size = header.width;
+        break;
+    case SPICE_CURSOR_TYPE_COLOR16:
+        line_size = header.width << 1;
+        break;
+    case SPICE_CURSOR_TYPE_COLOR24:
+        line_size = header.width * 3;
+        break;
+    }
+
+    // the same shape set through another surface, or again after its surface changed
+    hash = GetCursorHash(pdev, &header, local_surf, line_size, mask, color_trans);
+    if ((internal = CursorCacheGetByContent(pdev, hash, &header, local_surf, line_size, mask,
+                                            color_trans))) {
+        CursorCacheKey(pdev, internal, surf->hsurf, unique);
+        res = (Resource *)((UINT8 *)internal - sizeof(Resource));
+        CursorCmdAddRes(pdev, cmd, res);
+        cmd->u.set.shape = PA(pdev, &internal->cursor, pdev->main_mem_slot);
+        *in_cach = TRUE;
+        pdev->cursor_stats.content_hits++;
+        DEBUG_PRINT((pdev, 11, "%s: content hit 0x%x\n", __FUNCTION__, hash));
+        goto done;
+    }
+    pdev->cursor_stats.misses++;
+
     ASSERT(pdev, sizeof(Resource) + sizeof(InternalCursor) < CURSOR_ALLOC_SIZE);
     res = (Resource *)AllocMem(pdev, MSPACE_TYPE_DEVRAM, CURSOR_ALLOC_SIZE);
     ONDBG(pdev->num_cursor_pages++);
@@ -3013,18 +4677,14 @@ static BOOL GetCursorCommon(PDev *pdev, QXLCursorCmd *cmd, LONG hot_x, LONG hot_
     RESOURCE_TYPE(res, RESOURCE_TYPE_CURSOR);
 
     internal = (InternalCursor *)res->res;
-    internal->hsurf = surf->hsurf;
-    internal->unique = unique;
+    internal->hsurf = NULL;
+    internal->unique = 0;
+    internal->hash = hash;
     RingItemInit(&internal->lru_link);
 
     cursor = info->cursor = &internal->cursor;
-    cursor->header.type = type;
-    cursor->header.unique = unique ? ++pdev->last_cursor_id : 0;
-    cursor->header.width = (UINT16)local_surf->sizlBitmap.cx;
-    cursor->header.height = (type == SPICE_CURSOR_TYPE_MONO) ? (UINT16)local_surf->sizlBitmap.cy >> 1 :
-                            (UINT16)local_surf->sizlBitmap.cy;
-    cursor->header.hot_spot_x = (UINT16)hot_x;
-    cursor->header.hot_spot_y = (UINT16)hot_y;
+    cursor->header = header;
+    cursor->header.unique = ++pdev->last_cursor_id;
 
     cursor->data_size = 0;
 
@@ -3036,28 +4696,6 @@ static BOOL GetCursorCommon(PDev *pdev, QXLCursorCmd *cmd, LONG hot_x, LONG hot_
     info->now = info->chunk->data;
     info->end = (UINT8 *)res + CURSOR_ALLOC_SIZE;
 
-    switch (type) {
-    case SPICE_CURSOR_TYPE_ALPHA:
-    case SPICE_CURSOR_TYPE_COLOR32:
-        line_size = cursor->header.width << 2;
-        break;
-    case SPICE_CURSOR_TYPE_MONO:
-        line_size = ALIGN(cursor->header.width, 8) >> 3;
-        break;
-    case SPICE_CURSOR_TYPE_COLOR4:
-        line_size = ALIGN(cursor->header.width, 2) >> 1;
-        break;
-    case SPICE_CURSOR_TYPE_COLOR8:
-        line_size = cursor->header.width;
-        break;
-    case SPICE_CURSOR_TYPE_COLOR16:
-        line_size = cursor->header.width << 1;
-        break;
-    case SPICE_CURSOR_TYPE_COLOR24:
-        line_size = cursor->header.width * 3;
-        break;
-    }
-
     cursor->data_size = line_size * local_surf->sizlBitmap.cy;
     src = local_surf->pvScan0;
     src_end = src + (local_surf->lDelta * local_surf->sizlBitmap.cy);
@@ -3066,12 +4704,13 @@ static BOOL GetCursorCommon(PDev *pdev, QXLCursorCmd *cmd, LONG hot_x, LONG hot_
                  &pdev->num_cursor_pages, PAGE_SIZE, FALSE);
     }
 
-    CursorCacheAdd(pdev, internal);
+    CursorCacheAdd(pdev, internal, surf->hsurf, unique);
     CursorCmdAddRes(pdev, cmd, res);
     RELEASE_RES(pdev, res);
     cmd->u.set.shape = PA(pdev, &internal->cursor, pdev->main_mem_slot);
     DEBUG_PRINT((pdev, 11, "%s: done, data_size %u\n", __FUNCTION__, cursor->data_size));
 
+done:
     if (local_surf != surf) {
         EngUnlockSurface(local_surf);
         EngDeleteSurface(bitmap);
@@ -3087,6 +4726,13 @@ error:
     return FALSE;
 }
 
+void GetCursorCacheStats(PDev *pdev, QXLCursorCacheStats *stats)
+{
+    *stats = pdev->cursor_stats;
+    stats->size = pdev->cursor_cache_size;
+    stats->count = pdev->num_cursors;
+}
+
 BOOL GetAlphaCursor(PDev *pdev, QXLCursorCmd *cmd, LONG hot_x, LONG hot_y, SURFOBJ *surf)
 {
     NewCursorInfo info;
@@ -3097,7 +4743,8 @@ BOOL GetAlphaCursor(PDev *pdev, QXLCursorCmd *cmd, LONG hot_x, LONG hot_y, SURFO
     ASSERT(pdev, surf->sizlBitmap.cx > 0 && surf->sizlBitmap.cy > 0);
 
     DEBUG_PRINT((pdev, 6, "%s\n", __FUNCTION__));
-    ret = GetCursorCommon(pdev, cmd, hot_x, hot_y, surf, SPICE_CURSOR_TYPE_ALPHA, &info, &in_cache);
+    ret = GetCursorCommon(pdev, cmd, hot_x, hot_y, surf, NULL, NULL, SPICE_CURSOR_TYPE_ALPHA,
+                          &info, &in_cache);
     DEBUG_PRINT((pdev, 8, "%s: done\n", __FUNCTION__));
     return ret;
 }
@@ -3114,7 +4761,8 @@ BOOL GetMonoCursor(PDev *pdev, QXLCursorCmd *cmd, LONG hot_x, LONG hot_y, SURFOB
 
     DEBUG_PRINT((pdev, 6, "%s\n", __FUNCTION__));
 
-    ret = GetCursorCommon(pdev, cmd, hot_x, hot_y, surf, SPICE_CURSOR_TYPE_MONO, &info, &in_cache);
+    ret = GetCursorCommon(pdev, cmd, hot_x, hot_y, surf, NULL, NULL, SPICE_CURSOR_TYPE_MONO,
+                          &info, &in_cache);
     DEBUG_PRINT((pdev, 8, "%s: done\n", __FUNCTION__));
     return ret;
 }
@@ -3163,7 +4811,8 @@ BOOL GetColorCursor(PDev *pdev, QXLCursorCmd *cmd, LONG hot_x, LONG hot_y, SURFO
         return FALSE;
     }
 
-    if (!GetCursorCommon(pdev, cmd, hot_x, hot_y, surf, type, &info, &in_cache)) {
+    if (!GetCursorCommon(pdev, cmd, hot_x, hot_y, surf, mask, color_trans, type, &info,
+                         &in_cache)) {
         return FALSE;
     }
 
@@ -3313,7 +4962,11 @@ BOOL ResInit(PDev *pdev)
 {
     QuicData *usr_data;
 
+    if (!(pdev->path_clip = EngAllocMem(0, sizeof(PathClipInfo), ALLOC_TAG))) {
+        return FALSE;
+    }
     if (!(usr_data = EngAllocMem(FL_ZERO_MEMORY, sizeof(QuicData), ALLOC_TAG))) {
+        EngFreeMem(pdev->path_clip);
         return FALSE;
     }
     usr_data->user.error = quic_usr_error;
@@ -3326,6 +4979,7 @@ BOOL ResInit(PDev *pdev)
     usr_data->pdev = pdev;
     if (!(usr_data->quic = quic_create(&usr_data->user))) {
         EngFreeMem(usr_data);
+        EngFreeMem(pdev->path_clip);
         return FALSE;
     }
     pdev->quic_data = usr_data;
@@ -3347,6 +5001,7 @@ void ResDestroy(PDev *pdev)
     quic_destroy(usr_data->quic);
     EngDeleteSemaphore(pdev->quic_data_sem);
     EngFreeMem(usr_data);
+    EngFreeMem(pdev->path_clip);
 }
 
 void ResInitGlobals()
@@ -37,6 +37,10 @@ void QXLGetSurface(PDev *pdev, QXLPHYSICAL *surface_phys, UINT32 x, UINT32 y, UI
 void QXLGetDelSurface(PDev *pdev, QXLSurfaceCmd *surface, UINT32 surface_id, UINT8 allocation_type);
 void QXLDelSurface(PDev *pdev, UINT8 *base_mem, UINT8 allocation_type);
 BOOL QXLGetPath(PDev *pdev, QXLDrawable *drawable, QXLPHYSICAL *path_phys, PATHOBJ *path);
+BOOL QXLGetLinePath(PDev *pdev, QXLDrawable *drawable, QXLPHYSICAL *path_phys, POINTFIX *from,
+                    POINTFIX *to);
+QXLRESULT QXLGetPathClip(PDev *pdev, QXLDrawable *drawable, PATHOBJ *path, BOOL winding,
+                         CLIPOBJ *clip, RECTL *area);
 BOOL QXLGetMask(PDev *pdev, QXLDrawable *drawable, QXLQMask *qxl_mask, SURFOBJ *mask, POINTL *pos,
                 BOOL invers, LONG width, LONG height, INT32 *surface_dest);
 BOOL QXLGetBrush(PDev *pdev, QXLDrawable *drawable, QXLBrush *qxl_brush,
@@ -53,15 +57,22 @@ UINT8 *QXLGetBuf(PDev *pdev, QXLDrawable *drawable, QXLPHYSICAL *buf_phys, UINT3
 BOOL QXLGetStr(PDev *pdev, QXLDrawable *drawable, QXLPHYSICAL *str_phys, FONTOBJ *font, STROBJ *str);
 
 void UpdateArea(PDev *pdev, RECTL *area, UINT32 surface_id);
+void UpdateDirtyArea(PDev *pdev, RECTL *area, UINT32 surface_id);
 
 QXLCursorCmd *CursorCmd(PDev *pdev);
 void PushCursorCmd(PDev *pdev, QXLCursorCmd *cursor_cmd);
+BOOL CoalesceCursorMove(PDev *pdev, LONG x, LONG y);
 
 BOOL GetAlphaCursor(PDev *pdev, QXLCursorCmd *cmd, LONG hot_x, LONG hot_y, SURFOBJ *surf);
 BOOL GetColorCursor(PDev *pdev, QXLCursorCmd *cmd, LONG hot_x, LONG hot_y, SURFOBJ *surf,
                     SURFOBJ *mask, XLATEOBJ *color_trans);
 BOOL GetMonoCursor(PDev *pdev, QXLCursorCmd *cmd, LONG hot_x, LONG hot_y, SURFOBJ *surf);
 BOOL GetTransparentCursor(PDev *pdev, QXLCursorCmd *cmd);
+void GetCursorCacheStats(PDev *pdev, QXLCursorCacheStats *stats);
+BOOL SetPaletteCacheSize(PDev *pdev, UINT32 size);
+void GetPaletteCacheStats(PDev *pdev, QXLPaletteCacheStats *stats);
+BOOL SetUpdateFreqParams(PDev *pdev, QXLUpdateFreqParams *params);
+void GetUpdateFreqQuery(PDev *pdev, QXLUpdateFreqQuery *query);
 
 BOOL ResInit(PDev *pdev);
 void ResDestroy(PDev *pdev);
@@ -71,6 +82,18 @@ void ResDestroyGlobals();
 void CheckAndSetSSE2();
 #endif
 void EmptyReleaseRing(PDev *pdev);
+void GetVRAMStats(PDev *pdev, QXLVRAMStats *stats);
+void CopyBulk(PDev *pdev, UINT8 *dest, UINT8 *src, size_t size);
+BOOL TraceStart(PDev *pdev);
+void TraceStop(PDev *pdev);
+ULONG TraceDrain(PDev *pdev, QXLTraceHeader *header, ULONG size);
+BOOL CaptureStart(PDev *pdev);
+void CaptureStop(PDev *pdev);
+ULONG CaptureDrain(PDev *pdev, QXLCaptureHeader *header, ULONG size);
+void CaptureCall(PDev *pdev, UINT16 call, SURFOBJ *dest, SURFOBJ *src, SURFOBJ *mask,
+                 CLIPOBJ *clip, XLATEOBJ *color_trans, RECTL *dest_rect, RECTL *src_rect,
+                 BRUSHOBJ *brush, UINT32 rop, UINT32 mode, PATHOBJ *path, FONTOBJ *font,
+                 STROBJ *str);
 void InitDeviceMemoryResources(PDev *pdev);
 void ReleaseCacheDeviceMemoryResources(PDev *pdev);
 
@@ -500,42 +500,57 @@ static BOOL DoOpaque(PDev *pdev, UINT32 surface_id, RECTL *area, CLIPOBJ *clip,
     return TRUE;
 }
 
-static BOOL StreamTest(PDev *pdev, UINT32 surface_id, SURFOBJ *src_surf, 
-		       XLATEOBJ *color_trans, RECTL *src_rect, RECTL *dest)
+/* Feed one update at time 'now' into a fast-update counter and apply the
+ * enter/leave hysteresis to its streaming state. */
+static _inline void UpdateFreqStep(PDev *pdev, UINT32 now, UINT32 *last_time, UINT8 *count,
+                                   UINT8 *streaming)
 {
-    Ring *ring = &pdev->update_trace;
-    UpdateTrace *trace = (UpdateTrace *)ring->next;
-    LONG src_pixmap_pixels = src_surf->sizlBitmap.cx * src_surf->sizlBitmap.cy;
+    QXLUpdateFreqParams *params = &pdev->update_freq_params;
+    UINT32 delta = now - *last_time;
 
-    if (src_pixmap_pixels <= 128 * 128 || 
-	/* Only handle streams on primary surface */
-	surface_id != 0) {
-        return TRUE;
+    if (!delta) {
+        // same mm clock tick, i.e. another piece of the same frame
+        return;
+    }
+
+    if (!*last_time || delta >= params->quiet_time) {
+        *count = 0;
+    } else if (delta < params->fast_interval) {
+        if (*count < 0xff) {
+            (*count)++;
+        }
+    } else {
+        // a single slow update halves the history instead of dropping it, so a
+        // stream survives a hiccup and a short burst of static UI decays fast
+        *count >>= 1;
     }
+    *last_time = now;
+
+    if (!*streaming && *count >= params->enter_count) {
+        *streaming = TRUE;
+    } else if (*streaming && *count < params->leave_count) {
+        *streaming = FALSE;
+    }
+}
+
+/* Per source trace, matched on the exact dest area or on the same area of the
+ * (unique) source surface, so that a stream that moves keeps its history. Copies
+ * of different parts of one surface, e.g. a sprite sheet, get traces of their own. */
+static UpdateTrace *GetUpdateTrace(PDev *pdev, SURFOBJ *src_surf, XLATEOBJ *color_trans,
+                                   RECTL *src_rect, RECTL *dest, UINT32 now)
+{
+    Ring *ring = &pdev->update_trace;
+    UpdateTrace *trace = (UpdateTrace *)ring->next;
 
     for (;;) {
-        if (SameRect(dest, &trace->area) || (trace->hsurf == src_surf->hsurf &&
-                                              src_pixmap_pixels / RectSize(src_rect) > 100)) {
-            UINT32 now = *pdev->mm_clock;
-            BOOL ret;
-
-            if (now != trace->last_time && now - trace->last_time < 1000 / 5) {
-                trace->last_time = now - 1; // asumong mm clock is active so delta t == 0 is
-                                            // imposibole. frocing delata t to be at least 1.
-                if (trace->count < 20) {
-                    trace->count++;
-                    ret = TRUE;
-                } else {
-                    ret = FALSE;
-                }
-            } else {
-                trace->last_time = now;
-                trace->count = 0;
-                ret = TRUE;
-            }
+        if (SameRect(dest, &trace->area) || (trace->hsurf && trace->hsurf == src_surf->hsurf &&
+                                              SameRect(src_rect, &trace->src_area))) {
+            UpdateFreqStep(pdev, now, &trace->last_time, &trace->count, &trace->streaming);
+            trace->area = *dest;
+            trace->src_area = *src_rect;
             RingRemove(pdev, (RingItem *)trace);
             RingAdd(pdev, ring, (RingItem *)trace);
-            return ret;
+            return trace;
         }
         if (trace->link.next == ring) {
             break;
@@ -544,7 +559,8 @@ static BOOL StreamTest(PDev *pdev, UINT32 surface_id, SURFOBJ *src_surf,
     }
     RingRemove(pdev, (RingItem *)trace);
     trace->area = *dest;
-    trace->last_time = *pdev->mm_clock;
+    trace->src_area = *src_rect;
+    trace->last_time = now;
 
     if (IsUniqueSurf(src_surf, color_trans)) {
         trace->hsurf = src_surf->hsurf;
@@ -552,43 +568,201 @@ static BOOL StreamTest(PDev *pdev, UINT32 surface_id, SURFOBJ *src_surf,
         trace->hsurf = NULL;
     }
     trace->count = 0;
+    trace->streaming = FALSE;
     RingAdd(pdev, ring, (RingItem *)trace);
 
-    return TRUE;
+    return trace;
 }
 
-static BOOL TestSplitClips(PDev *pdev, SURFOBJ *src, RECTL *src_rect, CLIPOBJ *clip, SURFOBJ *mask)
+/* Returns FALSE if dest is being updated at stream rate, in which case the source
+ * should not be hashed and cached. */
+static BOOL UpdateFreqTest(PDev *pdev, UINT32 surface_id, SURFOBJ *src_surf,
+                           XLATEOBJ *color_trans, RECTL *src_rect, RECTL *dest)
 {
-    UINT32 width;
-    UINT32 height;
-    UINT32 src_space;
-    UINT32 clip_space = 0;
-    int more;
+    QXLUpdateFreqStats *stats = &pdev->update_freq_stats;
+    LONG src_pixmap_pixels = src_surf->sizlBitmap.cx * src_surf->sizlBitmap.cy;
+    UpdateTrace *trace;
+    UINT32 now;
+    LONG cell_width;
+    LONG cell_height;
+    LONG x_start, x_end;
+    LONG y_start, y_end;
+    LONG x, y;
+    UINT32 cells;
+    UINT32 streaming_cells = 0;
+    UINT32 was_streaming_cells = 0;
+    BOOL was_streaming;
+    BOOL streaming;
+
+    if (src_pixmap_pixels <= (LONG)pdev->update_freq_params.min_pixels ||
+        /* Only handle streams on primary surface */
+        surface_id != 0 || IsEmptyRect(dest)) {
+        return TRUE;
+    }
 
-    if (!clip || mask) {
-        return FALSE;
+    stats->tests++;
+    now = *pdev->mm_clock;
+    trace = GetUpdateTrace(pdev, src_surf, color_trans, src_rect, dest, now);
+
+    cell_width = MAX((pdev->resolution.cx + UPDATE_GRID_DIM - 1) / UPDATE_GRID_DIM, 1);
+    cell_height = MAX((pdev->resolution.cy + UPDATE_GRID_DIM - 1) / UPDATE_GRID_DIM, 1);
+    x_start = MIN(MAX(dest->left, 0) / cell_width, UPDATE_GRID_DIM - 1);
+    x_end = MIN(MAX(dest->right - 1, 0) / cell_width, UPDATE_GRID_DIM - 1);
+    y_start = MIN(MAX(dest->top, 0) / cell_height, UPDATE_GRID_DIM - 1);
+    y_end = MIN(MAX(dest->bottom - 1, 0) / cell_height, UPDATE_GRID_DIM - 1);
+    cells = (x_end - x_start + 1) * (y_end - y_start + 1);
+
+    for (y = y_start; y <= y_end; y++) {
+        UpdateCell *cell = &pdev->update_grid[y * UPDATE_GRID_DIM + x_start];
+
+        for (x = x_start; x <= x_end; x++, cell++) {
+            was_streaming_cells += cell->streaming;
+            if (trace->streaming) {
+                // the source moved here, carry its history along
+                cell->count = MAX(cell->count, trace->count);
+            }
+            UpdateFreqStep(pdev, now, &cell->last_time, &cell->count, &cell->streaming);
+            streaming_cells += cell->streaming;
+        }
     }
 
-    if (src->iType != STYPE_BITMAP) {
+    // partial overlaps: the region follows the majority of the cells it covers
+    was_streaming = was_streaming_cells * 2 > cells;
+    streaming = streaming_cells * 2 > cells;
+    if (!streaming && trace->streaming) {
+        streaming = TRUE;
+    }
+    if (trace->streaming && !was_streaming) {
+        stats->trace_hits++;
+    }
+
+    if (streaming != was_streaming) {
+        if (streaming) {
+            stats->stream_start++;
+        } else {
+            stats->stream_end++;
+        }
+        DEBUG_PRINT((pdev, 3, "%s: (%d, %d)-(%d, %d) %s, streamed %u/%u\n", __FUNCTION__,
+                     dest->left, dest->top, dest->right, dest->bottom,
+                     streaming ? "stream" : "static", stats->streamed, stats->tests));
+    }
+
+    if (streaming) {
+        stats->streamed++;
         return FALSE;
     }
+    return TRUE;
+}
 
-    width = src_rect->right - src_rect->left;
-    height = src_rect->bottom - src_rect->top;
-    src_space = width * height;
+#define SPLIT_MAX_REGIONS 8
+// the cost of a drawable (command, release, host side rendering) in image bytes
+#define SPLIT_DRAWABLE_COST 2048
+#define SPLIT_CLIP_RECT_COST sizeof(RECTL)
 
-    if (clip->iDComplexity == DC_RECT) {
-        width = clip->rclBounds.right - clip->rclBounds.left;
-        height = clip->rclBounds.bottom - clip->rclBounds.top;
-        clip_space = width * height;
+typedef enum {
+    SPLIT_NONE,    // one copy of the whole source, clipped
+    SPLIT_REGIONS, // one clipped copy per merged bounding region
+    SPLIT_RECTS,   // one unclipped copy per clip rect
+} SplitType;
 
-        if ((src_space / clip_space) > 1) {
-            return TRUE;
+typedef struct SplitRegions {
+    UINT32 count;
+    RECTL rects[SPLIT_MAX_REGIONS];
+} SplitRegions;
+
+static _inline UINT32 GetBytesPerPixel(ULONG format)
+{
+    switch (format) {
+    case BMF_32BPP:
+        return 4;
+    case BMF_24BPP:
+        return 3;
+    case BMF_16BPP:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+/* Add a clip rect to the closest of at most SPLIT_MAX_REGIONS bounding regions,
+ * opening a new region when every merge would send more extra bytes than the
+ * cost of another drawable. */
+static void SplitRegionsAdd(SplitRegions *regions, RECTL *rect, UINT32 bpp)
+{
+    LONG rect_size = RectSize(rect);
+    UINT64 best_waste = ~(UINT64)0;
+    UINT32 best = 0;
+    UINT32 i;
+
+    for (i = 0; i < regions->count; i++) {
+        RECTL merged;
+        UINT64 waste;
+
+        UnionRect(&regions->rects[i], rect, &merged);
+        waste = (UINT64)RectSize(&merged) - RectSize(&regions->rects[i]) - rect_size;
+        if ((INT64)waste < 0) {
+            waste = 0; // overlap
         }
-        return FALSE;
+        if (waste < best_waste) {
+            best_waste = waste;
+            best = i;
+        }
+    }
+
+    if (regions->count < SPLIT_MAX_REGIONS &&
+        (!regions->count || best_waste * bpp > SPLIT_DRAWABLE_COST)) {
+        CopyRect(&regions->rects[regions->count], rect);
+        regions->count++;
+        return;
+    }
+    UnionRect(&regions->rects[best], rect, &regions->rects[best]);
+}
+
+/* Pick the cheapest way to send a clipped copy, in image bytes: the whole source
+ * once, the merged bounding regions of the clip, or every clip rect on its own. */
+static SplitType TestSplitClips(PDev *pdev, SURFOBJ *src, RECTL *src_rect, RECTL *area,
+                                CLIPOBJ *clip, SURFOBJ *mask, XLATEOBJ *color_trans,
+                                SplitRegions *regions)
+{
+    UINT32 bpp;
+    UINT64 src_space;
+    UINT64 clip_space = 0;
+    UINT64 regions_space = 0;
+    UINT64 clip_rects_cost;
+    UINT64 none_cost;
+    UINT64 regions_cost;
+    UINT64 rects_cost;
+    UINT32 num_rects = 0;
+    UINT32 i;
+    int more;
+
+    regions->count = 0;
+    if (!clip || mask) {
+        return SPLIT_NONE;
+    }
+
+    if (src->iType != STYPE_BITMAP) {
+        return SPLIT_NONE;
+    }
+
+    if (src_rect->right - src_rect->left != area->right - area->left ||
+        src_rect->bottom - src_rect->top != area->bottom - area->top) {
+        // partial copies don't scale
+        return SPLIT_NONE;
     }
 
-    if (clip->iMode == TC_RECTANGLES) {
+    bpp = GetBytesPerPixel(src->iBitmapFormat);
+    src_space = RectSize(area);
+
+    if (clip->iDComplexity == DC_RECT) {
+        RECTL clip_area;
+
+        SectRect(area, &clip->rclBounds, &clip_area);
+        CopyRect(&regions->rects[0], &clip_area);
+        regions->count = 1;
+        clip_space = regions_space = RectSize(&clip_area);
+        num_rects = 1;
+    } else if (clip->iMode == TC_RECTANGLES) {
         CLIPOBJ_cEnumStart(clip, TRUE, CT_RECTANGLES, CD_RIGHTDOWN, 0);
         do {
             RECTL *now;
@@ -601,22 +775,55 @@ static BOOL TestSplitClips(PDev *pdev, SURFOBJ *src, RECTL *src_rect, CLIPOBJ *c
 
             more = CLIPOBJ_bEnum(clip, sizeof(buf), (ULONG *)&buf);
             for(now = buf.rects, end = now + buf.count; now < end; now++) {
-                width = now->right - now->left;
-                height = now->bottom - now->top;
-                clip_space += width * height;
+                RECTL clip_area;
+
+                SectRect(area, now, &clip_area);
+                if (IsEmptyRect(&clip_area)) {
+                    continue;
+                }
+                clip_space += RectSize(&clip_area);
+                num_rects++;
+                SplitRegionsAdd(regions, &clip_area, bpp);
             }
         } while (more);
 
-        if ((src_space / clip_space) > 1) {
-            return TRUE;
+        for (i = 0; i < regions->count; i++) {
+            regions_space += RectSize(&regions->rects[i]);
         }
+    } else {
+        return SPLIT_NONE;
     }
-    return FALSE;
+
+    if (!num_rects) {
+        return SPLIT_NONE;
+    }
+
+    // a clipped drawable carries all the clip rects
+    clip_rects_cost = num_rects * SPLIT_CLIP_RECT_COST;
+    none_cost = src_space * bpp + SPLIT_DRAWABLE_COST + clip_rects_cost;
+    if (IsCacheableSurf(src, color_trans)) {
+        // the whole source gets cached and may be reused, partial copies never are
+        none_cost -= (src_space * bpp) >> 2;
+    }
+    regions_cost = regions_space * bpp + regions->count * (SPLIT_DRAWABLE_COST + clip_rects_cost);
+    rects_cost = clip_space * bpp + num_rects * SPLIT_DRAWABLE_COST;
+
+    DEBUG_PRINT((pdev, 8, "%s: rects %u regions %u cost none %u regions %u rects %u\n",
+                 __FUNCTION__, num_rects, regions->count, (UINT32)none_cost,
+                 (UINT32)regions_cost, (UINT32)rects_cost));
+
+    if (none_cost <= regions_cost && none_cost <= rects_cost) {
+        return SPLIT_NONE;
+    }
+    if (regions_cost < rects_cost && regions->count < num_rects) {
+        return SPLIT_REGIONS;
+    }
+    return SPLIT_RECTS;
 }
 
 static _inline BOOL DoPartialCopy(PDev *pdev, UINT32 surface_id, SURFOBJ *src, RECTL *src_rect,
-                                  RECTL *area_rect, RECTL *clip_rect, XLATEOBJ *color_trans,
-                                  ULONG scale_mode, UINT16 rop_descriptor)
+                                  RECTL *area_rect, RECTL *clip_rect, CLIPOBJ *clip,
+                                  XLATEOBJ *color_trans, ULONG scale_mode, UINT16 rop_descriptor)
 {
     QXLDrawable *drawable;
     RECTL clip_area;
@@ -631,7 +838,7 @@ static _inline BOOL DoPartialCopy(PDev *pdev, UINT32 surface_id, SURFOBJ *src, R
     width = clip_area.right - clip_area.left;
     height = clip_area.bottom - clip_area.top;
 
-    if (!(drawable = Drawable(pdev, QXL_DRAW_COPY, &clip_area, NULL, surface_id))) {
+    if (!(drawable = Drawable(pdev, QXL_DRAW_COPY, &clip_area, clip, surface_id))) {
         return FALSE;
     }
 
@@ -663,6 +870,8 @@ static BOOL DoCopy(PDev *pdev, UINT32 surface_id, RECTL *area, CLIPOBJ *clip, SU
 {
     QXLDrawable *drawable;
     BOOL use_cache;
+    SplitType split;
+    SplitRegions regions;
     UINT32 width;
     UINT32 height;
 
@@ -675,15 +884,21 @@ static BOOL DoCopy(PDev *pdev, UINT32 surface_id, RECTL *area, CLIPOBJ *clip, SU
     if (mask) {
         use_cache = TRUE;
     } else {
-        use_cache = StreamTest(pdev, surface_id, src, color_trans, src_rect, area);
+        use_cache = UpdateFreqTest(pdev, surface_id, src, color_trans, src_rect, area);
     }
 
-    if (use_cache && TestSplitClips(pdev, src, src_rect, clip, mask) &&
-        !QXLCheckIfCacheImage(pdev, src, color_trans)) {
-        if (clip->iDComplexity == DC_RECT) {
-            if (!DoPartialCopy(pdev, surface_id, src, src_rect, area, &clip->rclBounds, color_trans,
-                               scale_mode, rop_descriptor)) {
-                return FALSE;
+    if (use_cache && !QXLCheckIfCacheImage(pdev, src, color_trans) &&
+        (split = TestSplitClips(pdev, src, src_rect, area, clip, mask, color_trans,
+                                &regions)) != SPLIT_NONE) {
+        if (split == SPLIT_REGIONS || clip->iDComplexity == DC_RECT) {
+            UINT32 i;
+
+            for (i = 0; i < regions.count; i++) {
+                if (!DoPartialCopy(pdev, surface_id, src, src_rect, area, &regions.rects[i],
+                                   clip->iDComplexity == DC_RECT ? NULL : clip, color_trans,
+                                   scale_mode, rop_descriptor)) {
+                    return FALSE;
+                }
             }
         } else {
             int more;
@@ -699,8 +914,8 @@ static BOOL DoCopy(PDev *pdev, UINT32 surface_id, RECTL *area, CLIPOBJ *clip, SU
                 } buf;
                 more = CLIPOBJ_bEnum(clip, sizeof(buf), (ULONG *)&buf);
                 for(now = buf.rects, end = now + buf.count; now < end; now++) {
-                    if (!DoPartialCopy(pdev, surface_id, src, src_rect, area, now, color_trans,
-                                       scale_mode, rop_descriptor)) {
+                    if (!DoPartialCopy(pdev, surface_id, src, src_rect, area, now, NULL,
+                                       color_trans, scale_mode, rop_descriptor)) {
                         return FALSE;
                     }
                 }
@@ -968,7 +1183,7 @@ BOOL BitBltFromDev(PDev *pdev, SURFOBJ *src, SURFOBJ *dest, SURFOBJ *mask, CLIPO
     area.right = MIN(src_pos.x + dest_rect->right - dest_rect->left,
                      surface->draw_area.surf_obj->sizlBitmap.cx);
 
-    UpdateArea(pdev, &area, surface_id);
+    UpdateDirtyArea(pdev, &area, surface_id);
 
     surf_obj = surface->draw_area.surf_obj;
 
@@ -1776,3 +1991,320 @@ punt:
                              reserved);
 }
 
+static _inline UINT32 GradientColor(TRIVERTEX *v0, TRIVERTEX *v1, LONG pos, LONG length)
+{
+    UINT32 r = v0->Red + (INT32)((v1->Red - v0->Red) * (INT64)pos / length);
+    UINT32 g = v0->Green + (INT32)((v1->Green - v0->Green) * (INT64)pos / length);
+    UINT32 b = v0->Blue + (INT32)((v1->Blue - v0->Blue) * (INT64)pos / length);
+
+    return ((r & 0xff00) << 8) | (g & 0xff00) | (b >> 8);
+}
+
+/* A rect gradient only changes along one axis, so it is sent as a one pixel high (or
+ * wide) image of the visible part of the ramp, stretched over the rect by the device. */
+static BOOL DoGradientRect(PDev *pdev, UINT32 surface_id, RECTL *bounds, CLIPOBJ *clip,
+                           TRIVERTEX *v0, TRIVERTEX *v1, BOOL vertical)
+{
+    QXLDrawable *drawable;
+    HSURF hsurf;
+    SURFOBJ *surf_obj;
+    RECTL rect;
+    RECTL area;
+    SIZEL size;
+    UINT32 *pixel;
+    LONG length;
+    LONG offset;
+    LONG i;
+
+    if (vertical ? v0->y > v1->y : v0->x > v1->x) {
+        TRIVERTEX *tmp = v0;
+        v0 = v1;
+        v1 = tmp;
+    }
+    rect.left = MIN(v0->x, v1->x);
+    rect.right = MAX(v0->x, v1->x);
+    rect.top = MIN(v0->y, v1->y);
+    rect.bottom = MAX(v0->y, v1->y);
+    SectRect(&rect, bounds, &area);
+    if (IsEmptyRect(&area)) {
+        return TRUE;
+    }
+
+    if (vertical) {
+        length = rect.bottom - rect.top;
+        offset = area.top - rect.top;
+        size.cx = 1;
+        size.cy = area.bottom - area.top;
+    } else {
+        length = rect.right - rect.left;
+        offset = area.left - rect.left;
+        size.cx = area.right - area.left;
+        size.cy = 1;
+    }
+
+    if (!(hsurf = (HSURF)EngCreateBitmap(size, size.cx << 2, BMF_32BPP, BMF_TOPDOWN, NULL))) {
+        DEBUG_PRINT((pdev, 0, "%s: create bitmap failed\n", __FUNCTION__));
+        return FALSE;
+    }
+
+    if (!(surf_obj = EngLockSurface(hsurf))) {
+        DEBUG_PRINT((pdev, 0, "%s: lock surf failed\n", __FUNCTION__));
+        goto error_1;
+    }
+
+    pixel = (UINT32 *)surf_obj->pvScan0;
+    for (i = 0; i < size.cx * size.cy; i++) {
+        *pixel = GradientColor(v0, v1, offset + i, length);
+        pixel = (UINT32 *)((UINT8 *)pixel + (vertical ? surf_obj->lDelta : sizeof(UINT32)));
+    }
+
+    if (!(drawable = Drawable(pdev, QXL_DRAW_COPY, &area, clip, surface_id))) {
+        goto error_2;
+    }
+
+    drawable->effect = QXL_EFFECT_OPAQUE;
+    drawable->u.copy.scale_mode = SPICE_IMAGE_SCALE_MODE_NEAREST;
+    drawable->u.copy.mask.bitmap = 0;
+    drawable->u.copy.rop_descriptor = SPICE_ROPD_OP_PUT;
+    drawable->u.copy.src_area.left = drawable->u.copy.src_area.top = 0;
+    drawable->u.copy.src_area.right = size.cx;
+    drawable->u.copy.src_area.bottom = size.cy;
+    if (!GetBitmap(pdev, drawable, &drawable->u.copy.src_bitmap, surf_obj,
+                   &drawable->u.copy.src_area, NULL, FALSE, &drawable->surfaces_dest[0])) {
+        ReleaseOutput(pdev, drawable->release_info.id);
+        goto error_2;
+    }
+    PushDrawable(pdev, drawable);
+
+    EngUnlockSurface(surf_obj);
+    EngDeleteSurface(hsurf);
+    return TRUE;
+
+error_2:
+    EngUnlockSurface(surf_obj);
+error_1:
+    EngDeleteSurface(hsurf);
+    return FALSE;
+}
+
+BOOL APIENTRY DrvGradientFill(SURFOBJ *dest, CLIPOBJ *clip, XLATEOBJ *color_trans,
+                              TRIVERTEX *vertices, ULONG num_vertices, PVOID mesh, ULONG num_mesh,
+                              RECTL *extents, POINTL *dither_org, ULONG mode)
+{
+    PDev *pdev;
+    GRADIENT_RECT *rect;
+    GRADIENT_RECT *end;
+    RECTL area;
+    UINT32 surface_id;
+
+    ASSERT(NULL, dest && dest->dhpdev);
+    pdev = (PDev *)dest->dhpdev;
+
+    PUNT_IF_DISABLED(pdev);
+
+    CountCall(pdev, CALL_COUNTER_GRADIENT_FILL);
+
+    DEBUG_PRINT((pdev, 3, "%s\n", __FUNCTION__));
+
+    if (mode != GRADIENT_FILL_RECT_H && mode != GRADIENT_FILL_RECT_V) {
+        DEBUG_PRINT((pdev, 5, "%s: triangle mesh\n", __FUNCTION__));
+        goto punt;
+    }
+
+    for (rect = (GRADIENT_RECT *)mesh, end = rect + num_mesh; rect < end; rect++) {
+        if (rect->UpperLeft >= num_vertices || rect->LowerRight >= num_vertices) {
+            DEBUG_PRINT((pdev, 0, "%s: bad vertex index\n", __FUNCTION__));
+            goto punt;
+        }
+    }
+
+    FixDestParams(pdev, dest, &clip, extents, &area, NULL, NULL);
+    if (IsEmptyRect(&area)) {
+        DEBUG_PRINT((pdev, 1, "%s: empty dest\n", __FUNCTION__));
+        return TRUE;
+    }
+
+    surface_id = GetSurfaceId(dest);
+    for (rect = (GRADIENT_RECT *)mesh; rect < end; rect++) {
+        if (!DoGradientRect(pdev, surface_id, &area, clip, &vertices[rect->UpperLeft],
+                            &vertices[rect->LowerRight], mode == GRADIENT_FILL_RECT_V)) {
+            return FALSE;
+        }
+    }
+    DEBUG_PRINT((pdev, 4, "%s: done\n", __FUNCTION__));
+    return TRUE;
+
+punt:
+    return EngGradientFill(dest, clip, color_trans, vertices, num_vertices, mesh, num_mesh,
+                           extents, dither_org, mode);
+}
+
+static _inline UINT32 PlgBltBytesPerPixel(ULONG format)
+{
+    switch (format) {
+    case BMF_32BPP:
+        return 4;
+    case BMF_24BPP:
+        return 3;
+    case BMF_16BPP:
+        return 2;
+    case BMF_8BPP:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Copy src_rect of src into a new bitmap, mirrored and/or transposed (i.e. rotated by
+ * a multiple of 90 degrees), so that it can be sent as a plain stretch. */
+static SURFOBJ *PlgBltTransformSrc(PDev *pdev, SURFOBJ *src, RECTL *src_rect, BOOL transpose,
+                                   BOOL mirror_x, BOOL mirror_y, HSURF *hsurf)
+{
+    SURFOBJ *surf_obj;
+    SIZEL size;
+    UINT32 bpp;
+    LONG width;
+    LONG height;
+    LONG x;
+    LONG y;
+
+    if (!(bpp = PlgBltBytesPerPixel(src->iBitmapFormat))) {
+        return NULL;
+    }
+
+    width = src_rect->right - src_rect->left;
+    height = src_rect->bottom - src_rect->top;
+    size.cx = transpose ? height : width;
+    size.cy = transpose ? width : height;
+    if (!(*hsurf = (HSURF)EngCreateBitmap(size, ALIGN(size.cx * bpp, 4), src->iBitmapFormat,
+                                          BMF_TOPDOWN, NULL))) {
+        DEBUG_PRINT((pdev, 0, "%s: create bitmap failed\n", __FUNCTION__));
+        return NULL;
+    }
+
+    if (!(surf_obj = EngLockSurface(*hsurf))) {
+        DEBUG_PRINT((pdev, 0, "%s: lock surf failed\n", __FUNCTION__));
+        EngDeleteSurface(*hsurf);
+        return NULL;
+    }
+
+    for (y = 0; y < height; y++) {
+        UINT8 *src_line = (UINT8 *)src->pvScan0 + (src_rect->top + y) * src->lDelta +
+                          src_rect->left * bpp;
+        LONG dest_y = mirror_y ? height - 1 - y : y;
+
+        for (x = 0; x < width; x++, src_line += bpp) {
+            LONG dest_x = mirror_x ? width - 1 - x : x;
+            UINT8 *dest;
+
+            if (transpose) {
+                dest = (UINT8 *)surf_obj->pvScan0 + dest_x * surf_obj->lDelta + dest_y * bpp;
+            } else {
+                dest = (UINT8 *)surf_obj->pvScan0 + dest_y * surf_obj->lDelta + dest_x * bpp;
+            }
+            RtlCopyMemory(dest, src_line, bpp);
+        }
+    }
+    return surf_obj;
+}
+
+BOOL APIENTRY DrvPlgBlt(SURFOBJ *dest, SURFOBJ *src, SURFOBJ *mask, CLIPOBJ *clip,
+                        XLATEOBJ *color_trans, COLORADJUSTMENT *color_adjust,
+                        POINTL *brush_pos, POINTFIX *points, RECTL *src_rect,
+                        POINTL *mask_pos, ULONG mode)
+{
+    PDev *pdev;
+    POINTFIX ab;
+    POINTFIX ac;
+    RECTL dest_rect;
+    LONG x[4];
+    LONG y[4];
+    BOOL transpose;
+    BOOL mirror_x;
+    BOOL mirror_y;
+    SURFOBJ *surf_obj;
+    HSURF hsurf;
+    RECTL local_src;
+    BOOL ret;
+
+    ASSERT(NULL, src && dest);
+    if (dest->iType == STYPE_BITMAP) {
+        return EngPlgBlt(dest, src, mask, clip, color_trans, color_adjust, brush_pos, points,
+                         src_rect, mask_pos, mode);
+    }
+    pdev = (PDev *)dest->dhpdev;
+
+    PUNT_IF_DISABLED(pdev);
+
+    CountCall(pdev, CALL_COUNTER_PLG_BLT);
+
+    DEBUG_PRINT((pdev, 3, "%s\n", __FUNCTION__));
+
+    if (mask) {
+        DEBUG_PRINT((pdev, 5, "%s: mask\n", __FUNCTION__));
+        goto punt;
+    }
+
+    // points are the dest of the upper left, upper right and lower left corners of src
+    ab.x = points[1].x - points[0].x;
+    ab.y = points[1].y - points[0].y;
+    ac.x = points[2].x - points[0].x;
+    ac.y = points[2].y - points[0].y;
+
+    if (!ab.y && !ac.x && ab.x && ac.y) {
+        transpose = FALSE;
+        mirror_x = ab.x < 0;
+        mirror_y = ac.y < 0;
+    } else if (!ab.x && !ac.y && ab.y && ac.x) {
+        transpose = TRUE;
+        mirror_x = ab.y < 0;
+        mirror_y = ac.x < 0;
+    } else {
+        DEBUG_PRINT((pdev, 5, "%s: not axis aligned\n", __FUNCTION__));
+        goto punt;
+    }
+
+    x[0] = points[0].x;
+    y[0] = points[0].y;
+    x[1] = points[1].x;
+    y[1] = points[1].y;
+    x[2] = points[2].x;
+    y[2] = points[2].y;
+    x[3] = points[1].x + ac.x;
+    y[3] = points[1].y + ac.y;
+    dest_rect.left = (MIN(MIN(x[0], x[1]), MIN(x[2], x[3])) + 8) >> 4;
+    dest_rect.right = (MAX(MAX(x[0], x[1]), MAX(x[2], x[3])) + 8) >> 4;
+    dest_rect.top = (MIN(MIN(y[0], y[1]), MIN(y[2], y[3])) + 8) >> 4;
+    dest_rect.bottom = (MAX(MAX(y[0], y[1]), MAX(y[2], y[3])) + 8) >> 4;
+    if (IsEmptyRect(&dest_rect)) {
+        return TRUE;
+    }
+
+    if (!transpose && !mirror_x && !mirror_y) {
+        return DrvStretchBlt(dest, src, NULL, clip, color_trans, color_adjust, brush_pos,
+                             &dest_rect, src_rect, NULL, mode);
+    }
+
+    if (src->iType != STYPE_BITMAP) {
+        DEBUG_PRINT((pdev, 5, "%s: rotated device src\n", __FUNCTION__));
+        goto punt;
+    }
+
+    if (!(surf_obj = PlgBltTransformSrc(pdev, src, src_rect, transpose, mirror_x, mirror_y,
+                                        &hsurf))) {
+        goto punt;
+    }
+    local_src.left = local_src.top = 0;
+    local_src.right = surf_obj->sizlBitmap.cx;
+    local_src.bottom = surf_obj->sizlBitmap.cy;
+    ret = DrvStretchBlt(dest, surf_obj, NULL, clip, color_trans, color_adjust, brush_pos,
+                        &dest_rect, &local_src, NULL, mode);
+    EngUnlockSurface(surf_obj);
+    EngDeleteSurface(hsurf);
+    DEBUG_PRINT((pdev, 4, "%s: done\n", __FUNCTION__));
+    return ret;
+
+punt:
+    return EngPlgBlt(dest, src, mask, clip, color_trans, color_adjust, brush_pos, points,
+                     src_rect, mask_pos, mode);
+}
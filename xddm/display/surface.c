@@ -43,12 +43,14 @@ static BOOL CreateDrawArea(PDev *pdev, UINT8 *base_mem, ULONG format, UINT32 cx,
                            UINT32 stride, UINT32 surface_id)
 {
     SIZEL  size;
+    SurfaceInfo *surface_info;
     DrawArea *drawarea;
 
     size.cx = cx;
     size.cy = cy;
 
-    drawarea = &GetSurfaceInfo(pdev, surface_id)->draw_area;
+    surface_info = GetSurfaceInfo(pdev, surface_id);
+    drawarea = &surface_info->draw_area;
 
     if (!(drawarea->bitmap = (HSURF)EngCreateBitmap(size, stride, format, 0, base_mem))) {
         DEBUG_PRINT((pdev, 0, "%s: EngCreateBitmap failed\n", __FUNCTION__));
@@ -66,6 +68,10 @@ static BOOL CreateDrawArea(PDev *pdev, UINT8 *base_mem, ULONG format, UINT32 cx,
     }
 
     drawarea->base_mem = base_mem;
+    /* nothing is known about what the device holds for this surface yet */
+    surface_info->dirty.left = surface_info->dirty.top = 0;
+    surface_info->dirty.right = cx;
+    surface_info->dirty.bottom = cy;
 
     return TRUE;
 error:
@@ -227,6 +233,101 @@ VOID DeleteDeviceBitmap(PDev *pdev, UINT32 surface_id, UINT8 allocation_type)
     }
 }
 
+/* Device bitmaps are created in VRAM right away only when most of the earlier ones of their
+ * size and format were reused. The others are created in RAM and managed by GDI like saved
+ * surfaces, and RestoreSurfacesOnCall moves them to VRAM once they are used by ADMIT_USES
+ * drawing calls. */
+#define ADMIT_USES 2
+#define ADMIT_MIN_CREATED 4
+#define ADMIT_MAX_CREATED 64
+// one in this many bitmaps of a reused shape is still created in RAM to follow its use
+#define ADMIT_PROBE_INTERVAL 8
+
+static AdmitHistory *GetAdmitHistory(PDev *pdev, SIZEL size, ULONG format)
+{
+    AdmitHistory *history;
+
+    history = &pdev->admit_history[((ULONG)size.cx * 31 + (ULONG)size.cy + format) %
+                                   ADMIT_HISTORY_SIZE];
+    if (history->size.cx != size.cx || history->size.cy != size.cy ||
+        history->format != format) {
+        RtlZeroMemory(history, sizeof(*history));
+        history->size = size;
+        history->format = format;
+    }
+    return history;
+}
+
+BOOL AdmitDeviceBitmap(PDev *pdev, SIZEL size, ULONG format)
+{
+    AdmitHistory *history = GetAdmitHistory(pdev, size, format);
+
+    if (history->created >= ADMIT_MIN_CREATED && history->promoted * 2 >= history->created &&
+        ++history->admitted % ADMIT_PROBE_INTERVAL) {
+        return TRUE;
+    }
+    if (history->created == ADMIT_MAX_CREATED) {
+        history->created /= 2;
+        history->promoted /= 2;
+    }
+    history->created++;
+    return FALSE;
+}
+
+HBITMAP CreatePendingDeviceBitmap(PDev *pdev, SIZEL size, ULONG format, UINT32 surface_id)
+{
+    SurfaceInfo *surface_info = GetSurfaceInfo(pdev, surface_id);
+    UINT32 surface_format, depth;
+    QXLPHYSICAL phys_mem;
+    HBITMAP hbitmap;
+    INT32 stride;
+    UINT8 *copy;
+
+    DEBUG_PRINT((pdev, 9, "%s: %p: %d, (%dx%d), %d\n", __FUNCTION__, pdev, surface_id,
+                size.cx, size.cy, format));
+    BitmapFormatToDepthAndSurfaceFormat(format, &depth, &surface_format);
+    ASSERT(pdev, depth != 0);
+    QXLGetSurface(pdev, &phys_mem, size.cx, size.cy, depth, &stride, &copy,
+                  DEVICE_BITMAP_ALLOCATION_TYPE_RAM);
+    if (!copy) {
+        DEBUG_PRINT((pdev, 0, "%s: %p: %d: allocation failed\n", __FUNCTION__, pdev,
+                     surface_id));
+        goto out_error1;
+    }
+
+    if (!(hbitmap = EngCreateDeviceBitmap((DHSURF)surface_info, size, format))) {
+        DEBUG_PRINT((pdev, 0, "%s: EngCreateDeviceBitmap failed, pdev 0x%lx, surface_id=%d\n",
+                    __FUNCTION__, pdev, surface_id));
+        goto out_error2;
+    }
+
+    // bottom up as the VRAM surfaces are, so that MoveSurfaceToVideoRam copies it as is
+    if (!EngModifySurface((HSURF)hbitmap, pdev->eng, 0, 0, (DHSURF)surface_info,
+                          copy + stride * (size.cy - 1), -stride, NULL)) {
+        DEBUG_PRINT((pdev, 0, "%s: EngModifySurface failed\n", __FUNCTION__));
+        goto out_error3;
+    }
+    surface_info->u.pdev = pdev;
+    surface_info->hbitmap = hbitmap;
+    surface_info->copy = copy;
+    surface_info->size = size;
+    surface_info->bitmap_format = format;
+    surface_info->stride = stride;
+    surface_info->draw_area.base_mem = copy;
+    surface_info->last_use = pdev->surface_use_clock;
+    surface_info->admit_pending = TRUE;
+    surface_info->admit_uses = 0;
+    pdev->admit_pending_surfaces++;
+    return hbitmap;
+
+out_error3:
+    EngDeleteSurface((HSURF)hbitmap);
+out_error2:
+    QXLDelSurface(pdev, copy, DEVICE_BITMAP_ALLOCATION_TYPE_RAM);
+out_error1:
+    return 0;
+}
+
 static void CleanupSurfaceInfo(PDev *pdev, UINT32 surface_id, UINT8 allocation_type)
 {
     SurfaceInfo *surface_info = GetSurfaceInfo(pdev, surface_id);
@@ -237,6 +338,9 @@ static void CleanupSurfaceInfo(PDev *pdev, UINT32 surface_id, UINT8 allocation_t
     }
 }
 
+// RAM shadows of surfaces restored to VRAM are kept up to this many bytes in total
+#define SURFACE_SHADOW_MAX_BYTES (64 * 1024 * 1024)
+
 BOOL MoveSurfaceToVideoRam(PDev *pdev, UINT32 surface_id)
 {
     QXLSurfaceCmd *surface;
@@ -264,14 +368,25 @@ BOOL MoveSurfaceToVideoRam(PDev *pdev, UINT32 surface_id)
         DEBUG_PRINT((pdev, 0, "%s: %p: %d: EngModifySurface failed\n",
             __FUNCTION__, pdev, surface_id));
         CleanupSurfaceInfo(pdev, surface_id, DEVICE_BITMAP_ALLOCATION_TYPE_VRAM);
+        // GDI still draws to the copy
+        surface_info->draw_area.base_mem = surface_info->copy;
         return FALSE;
     }
     DEBUG_PRINT((pdev, 3, "%s: stride = %d, phys_mem = %0lX, base_mem = %p\n",
         __FUNCTION__, -stride, (uint64_t)phys_mem, base_mem));
     DEBUG_PRINT((pdev, 3, "%s: copy %d bytes to %d\n", __FUNCTION__, size, surface_id));
     // Everything allocated, nothing can fail (API wise) from this point
-    RtlCopyMemory(base_mem, surface_info->copy, size);
-    EngFreeMem(surface_info->copy);
+    CopyBulk(pdev, base_mem, surface_info->copy, size);
+    ASSERT(pdev, !surface_info->shadow);
+    if (abs(stride) == abs(surface_info->stride) &&
+        pdev->shadow_bytes + size <= SURFACE_SHADOW_MAX_BYTES) {
+        // keep the copy, the next save only has to copy what gets drawn meanwhile
+        surface_info->shadow = surface_info->copy;
+        pdev->shadow_bytes += SURFACE_SHADOW_SIZE(surface_info);
+        RtlZeroMemory(&surface_info->save_dirty, sizeof(surface_info->save_dirty));
+    } else {
+        EngFreeMem(surface_info->copy);
+    }
     surface_info->copy = NULL;
     SendSurfaceCreateCommand(pdev, surface_id, surface_info->size, surface_format,
                              -stride, phys_mem, 1);
@@ -281,16 +396,191 @@ BOOL MoveSurfaceToVideoRam(PDev *pdev, UINT32 surface_id)
 /* when we return from S3 we need to resend all the surface creation commands.
  * Actually moving the memory vram<->guest is not strictly neccessary since vram
  * is not reset during the suspend, so contents are not lost */
+#define RESTORE_SURFACE(item) CONTAINEROF(item, SurfaceInfo, restore_link)
+
+// with lazy restore, the most recently used surfaces are restored on mode enable anyway
+#define RESTORE_EAGER_SURFACES 16
+#define RESTORE_SURFACES_PER_CALL 2
+
+/* Sorts the restore queue most recently used first. A bottom up merge sort of the items
+ * chained by their next links, equal ones keep their order, the prev links are rebuilt at
+ * the end. */
+static void SortRestoreQueue(PDev *pdev)
+{
+    Ring *ring = &pdev->restore_surfaces;
+    RingItem *list;
+    RingItem *tail;
+    RingItem *item;
+    RingItem *p;
+    RingItem *q;
+    int merges;
+    int run;
+    int p_size;
+    int q_size;
+
+    if (RingIsEmpty(pdev, ring)) {
+        return;
+    }
+    list = ring->next;
+    ring->prev->next = NULL;
+    for (run = 1;; run *= 2) {
+        p = list;
+        list = tail = NULL;
+        merges = 0;
+        while (p) {
+            merges++;
+            q = p;
+            for (p_size = 0; p_size < run && q; p_size++) {
+                q = q->next;
+            }
+            q_size = run;
+            while (p_size || (q_size && q)) {
+                if (p_size && (!q_size || !q ||
+                    RESTORE_SURFACE(p)->last_use >= RESTORE_SURFACE(q)->last_use)) {
+                    item = p;
+                    p = p->next;
+                    p_size--;
+                } else {
+                    item = q;
+                    q = q->next;
+                    q_size--;
+                }
+                if (tail) {
+                    tail->next = item;
+                } else {
+                    list = item;
+                }
+                tail = item;
+            }
+            p = q;
+        }
+        tail->next = NULL;
+        if (merges <= 1) {
+            break;
+        }
+    }
+
+    tail = ring;
+    for (item = list; item; item = item->next) {
+        item->prev = tail;
+        tail->next = item;
+        tail = item;
+    }
+    tail->next = ring;
+    ring->prev = tail;
+}
+
+static void RestoreQueuedSurface(PDev *pdev, SurfaceInfo *surface_info)
+{
+    UINT32 surface_id = GetLiveSurfaceId(pdev, surface_info);
+
+    RingRemove(pdev, &surface_info->restore_link);
+    if (!MoveSurfaceToVideoRam(pdev, surface_id)) {
+        DEBUG_PRINT((pdev, 0, "%s: %p: %d: failed moving to vram\n", __FUNCTION__,
+                     pdev, surface_id));
+        // a pending bitmap is queued again once it is reused again
+        surface_info->admit_uses = 0;
+        return;
+    }
+    if (surface_info->admit_pending) {
+        AdmitHistory *history = GetAdmitHistory(pdev, surface_info->size,
+                                                surface_info->bitmap_format);
+
+        if (history->promoted < history->created) {
+            history->promoted++;
+        }
+        surface_info->admit_pending = FALSE;
+        pdev->admit_pending_surfaces--;
+    }
+}
+
+static _inline BOOL SurfaceIs(SurfaceInfo *surface_info, SURFOBJ *surf)
+{
+    return surf && surf->dhsurf == (DHSURF)surface_info;
+}
+
+static void CountAdmitUse(PDev *pdev, SURFOBJ *surf)
+{
+    SurfaceInfo *surface_info = surf ? (SurfaceInfo *)surf->dhsurf : NULL;
+
+    if (surface_info < pdev->surfaces_info ||
+        surface_info >= pdev->surfaces_info + pdev->n_surfaces ||
+        !surface_info->admit_pending) {
+        return;
+    }
+    if (++surface_info->admit_uses >= ADMIT_USES &&
+        !RingItemIsLinked(&surface_info->restore_link)) {
+        DEBUG_PRINT((pdev, 9, "%s: %d: reused, queued for vram\n", __FUNCTION__,
+                     GetLiveSurfaceId(pdev, surface_info)));
+        RingAdd(pdev, &pdev->restore_surfaces, &surface_info->restore_link);
+    }
+}
+
+/* Called on entry of the outermost drawing call while surfaces wait for a lazy restore or
+ * for admission to VRAM. Uses of pending device bitmaps are counted, a queued surface used
+ * as source is moved to the front of the queue, and a few queued surfaces that this call
+ * doesn't use (GDI holds those locked) are moved to VRAM. */
+void RestoreSurfacesOnCall(PDev *pdev, SURFOBJ *dest, SURFOBJ *src, SURFOBJ *mask)
+{
+    SurfaceInfo *surface_info;
+    RingItem *item;
+    RingItem *next;
+    int budget = RESTORE_SURFACES_PER_CALL;
+
+    if (!pdev->enabled) {
+        return;
+    }
+
+    if (pdev->admit_pending_surfaces) {
+        CountAdmitUse(pdev, dest);
+        CountAdmitUse(pdev, src);
+        CountAdmitUse(pdev, mask);
+    }
+
+    surface_info = src ? (SurfaceInfo *)src->dhsurf : NULL;
+    if (surface_info >= pdev->surfaces_info &&
+        surface_info < pdev->surfaces_info + pdev->n_surfaces &&
+        RingItemIsLinked(&surface_info->restore_link)) {
+        DEBUG_PRINT((pdev, 9, "%s: %d: first use\n", __FUNCTION__,
+                     GetLiveSurfaceId(pdev, surface_info)));
+        RingRemove(pdev, &surface_info->restore_link);
+        RingAdd(pdev, &pdev->restore_surfaces, &surface_info->restore_link);
+    }
+
+    BeginSurfaceWalk(pdev);
+    for (item = RingGetHead(pdev, &pdev->restore_surfaces); item && budget; item = next) {
+        next = RingNext(pdev, &pdev->restore_surfaces, item);
+        surface_info = RESTORE_SURFACE(item);
+        if (!surface_info->draw_area.base_mem || SurfaceIs(surface_info, dest) ||
+            SurfaceIs(surface_info, src) || SurfaceIs(surface_info, mask)) {
+            continue;
+        }
+        RestoreQueuedSurface(pdev, surface_info);
+        budget--;
+    }
+    EndSurfaceWalk(pdev);
+}
+
 int MoveAllSurfacesToVideoRam(PDev *pdev)
 {
     UINT32 surface_id;
     SurfaceInfo *surface_info;
+    RingItem *item;
+    RingItem *next;
+    int count;
 
-    /* brute force implementation - alternative is to keep an updated used_surfaces list */
     DEBUG_PRINT((pdev, 3, "%s %p\n", __FUNCTION__, pdev));
 
-    for (surface_id = 1 ; surface_id < pdev->n_surfaces ; ++surface_id) {
-        surface_info = GetSurfaceInfo(pdev, surface_id);
+    // surfaces still queued from the previous enable are queued again below
+    while ((item = RingGetHead(pdev, &pdev->restore_surfaces))) {
+        RingRemove(pdev, item);
+    }
+
+    BeginSurfaceWalk(pdev);
+    for (item = RingGetHead(pdev, &pdev->live_surfaces); item; item = next) {
+        next = RingNext(pdev, &pdev->live_surfaces, item);
+        surface_info = LIVE_SURFACE(item);
+        surface_id = GetLiveSurfaceId(pdev, surface_info);
         if (!surface_info->draw_area.base_mem) {
             continue;
         }
@@ -309,6 +599,15 @@ int MoveAllSurfacesToVideoRam(PDev *pdev)
                          pdev, surface_id));
             continue;
         }
+        if (surface_info->admit_pending) {
+            // not reused yet, stays in RAM
+            continue;
+        }
+        if (pdev->lazy_restore) {
+            // queued in walk order, sorted once the walk is done
+            RingAdd(pdev, pdev->restore_surfaces.prev, &surface_info->restore_link);
+            continue;
+        }
         if (!MoveSurfaceToVideoRam(pdev, surface_id)) {
             /* Some of the surfaces have not been moved to video ram.
              * they will remain managed by GDI. */
@@ -316,25 +615,30 @@ int MoveAllSurfacesToVideoRam(PDev *pdev)
                          pdev, surface_id));
         }
     }
+    EndSurfaceWalk(pdev);
+    SortRestoreQueue(pdev);
+
+    for (count = 0; count < RESTORE_EAGER_SURFACES &&
+                    (item = RingGetHead(pdev, &pdev->restore_surfaces)); count++) {
+        RestoreQueuedSurface(pdev, RESTORE_SURFACE(item));
+    }
     return TRUE;
 }
 
-/* to_surface_id is exclusive */
-static void SendSurfaceRangeCreateCommand(PDev *pdev, UINT32 from_surface_id, UINT32 to_surface_id)
+/* resend the creates of the live surfaces from item to the end of the live ring */
+static void SendSurfaceRangeCreateCommand(PDev *pdev, RingItem *item)
 {
-    UINT32 surface_id;
-
-    ASSERT(pdev, from_surface_id < to_surface_id);
-    ASSERT(pdev, to_surface_id <= pdev->n_surfaces);
-
-    for (surface_id = from_surface_id; surface_id < to_surface_id; surface_id++) {
+    BeginSurfaceWalk(pdev);
+    for (; item; item = RingNext(pdev, &pdev->live_surfaces, item)) {
         SurfaceInfo *surface_info;
         SURFOBJ *surf_obj;
         QXLPHYSICAL phys_mem;
+        UINT32 surface_id;
         UINT32 surface_format;
         UINT32 depth;
 
-        surface_info = GetSurfaceInfo(pdev, surface_id);
+        surface_info = LIVE_SURFACE(item);
+        surface_id = GetLiveSurfaceId(pdev, surface_info);
         if (!surface_info->draw_area.base_mem) {
             continue;
         }
@@ -353,6 +657,48 @@ static void SendSurfaceRangeCreateCommand(PDev *pdev, UINT32 from_surface_id, UI
                                  /* the surface is still there, tell server not to erase */
                                  1);
     }
+    EndSurfaceWalk(pdev);
+}
+
+/* Bring the shadow of a surface up to date by copying only the rows, and the columns within
+ * them, drawn since it was last in sync. Returns the number of bytes copied. */
+static UINT32 SyncSurfaceShadow(PDev *pdev, SurfaceInfo *surface_info, SURFOBJ *surf_obj)
+{
+    UINT8 *shadow = surface_info->shadow;
+    UINT8 *base_mem = surface_info->draw_area.base_mem;
+    LONG stride = abs(surf_obj->lDelta);
+    LONG cy = surf_obj->sizlBitmap.cy;
+    UINT32 surface_format;
+    UINT32 depth;
+    UINT32 offset;
+    UINT32 line_size;
+    RECTL bounds;
+    RECTL band;
+    LONG y;
+
+    bounds.left = bounds.top = 0;
+    bounds.right = surf_obj->sizlBitmap.cx;
+    bounds.bottom = cy;
+    SectRect(&surface_info->save_dirty, &bounds, &band);
+    if (IsEmptyRect(&band)) {
+        return 0;
+    }
+    BitmapFormatToDepthAndSurfaceFormat(surface_info->bitmap_format, &depth, &surface_format);
+
+    if (band.left == 0 && band.right == bounds.right) {
+        // whole rows are contiguous, bottom up surfaces store them in reverse
+        offset = (surf_obj->lDelta > 0 ? band.top : cy - band.bottom) * stride;
+        line_size = (band.bottom - band.top) * stride;
+        CopyBulk(pdev, shadow + offset, base_mem + offset, line_size);
+        return line_size;
+    }
+
+    line_size = (band.right - band.left) * (depth >> 3);
+    for (y = band.top; y < band.bottom; y++) {
+        offset = (surf_obj->lDelta > 0 ? y : cy - 1 - y) * stride + band.left * (depth >> 3);
+        RtlCopyMemory(shadow + offset, base_mem + offset, line_size);
+    }
+    return line_size * (band.bottom - band.top);
 }
 
 BOOL MoveAllSurfacesToRam(PDev *pdev)
@@ -364,9 +710,13 @@ BOOL MoveAllSurfacesToRam(PDev *pdev)
     UINT8 *line0;
     int size;
     QXLPHYSICAL phys_mem;
+    RingItem *item;
 
-    for (surface_id = 1 ; surface_id < pdev->n_surfaces ; ++surface_id) {
-        surface_info = GetSurfaceInfo(pdev, surface_id);
+    BeginSurfaceWalk(pdev);
+    for (item = RingGetHead(pdev, &pdev->live_surfaces); item;
+         item = RingNext(pdev, &pdev->live_surfaces, item)) {
+        surface_info = LIVE_SURFACE(item);
+        surface_id = GetLiveSurfaceId(pdev, surface_info);
         if (!surface_info->draw_area.base_mem) {
             continue;
         }
@@ -376,10 +726,21 @@ BOOL MoveAllSurfacesToRam(PDev *pdev)
             continue;
         }
         size = surf_obj->sizlBitmap.cy * abs(surf_obj->lDelta);
-        copy = EngAllocMem(0, size, ALLOC_TAG);
-        DEBUG_PRINT((pdev, 3, "%s: %d: copying #%d to %p (%d)\n", __FUNCTION__, surface_id, size,
-            copy, surf_obj->lDelta));
-        RtlCopyMemory(copy, surface_info->draw_area.base_mem, size);
+        if (surface_info->shadow && abs(surf_obj->lDelta) == abs(surface_info->stride)) {
+            UINT32 synced = SyncSurfaceShadow(pdev, surface_info, surf_obj);
+
+            DEBUG_PRINT((pdev, 3, "%s: %d: synced %u of %d bytes of shadow %p\n", __FUNCTION__,
+                         surface_id, synced, size, surface_info->shadow));
+            copy = surface_info->shadow;
+            surface_info->shadow = NULL;
+            pdev->shadow_bytes -= SURFACE_SHADOW_SIZE(surface_info);
+        } else {
+            SurfaceFreeShadow(pdev, surface_info);
+            copy = EngAllocMem(0, size, ALLOC_TAG);
+            DEBUG_PRINT((pdev, 3, "%s: %d: copying #%d to %p (%d)\n", __FUNCTION__, surface_id,
+                         size, copy, surf_obj->lDelta));
+            CopyBulk(pdev, copy, surface_info->draw_area.base_mem, size);
+        }
         surface_info->copy = copy;
         line0 = surf_obj->lDelta > 0 ? copy : copy + abs(surf_obj->lDelta) *
                 (surf_obj->sizlBitmap.cy - 1);
@@ -394,14 +755,16 @@ BOOL MoveAllSurfacesToRam(PDev *pdev)
             /* Send a create messsage for this surface - we previously did a destroy all. */
             EngFreeMem(surface_info->copy);
             surface_info->copy = NULL;
-            DEBUG_PRINT((pdev, 0, "%s: %d: EngModifySurface failed, sending create for %d-%d\n",
-                         __FUNCTION__, surface_id, surface_id, pdev->n_surfaces - 1));
-            SendSurfaceRangeCreateCommand(pdev, surface_id, pdev->n_surfaces);
+            DEBUG_PRINT((pdev, 0, "%s: %d: EngModifySurface failed, sending create for the "
+                         "remaining surfaces\n", __FUNCTION__, surface_id));
+            SendSurfaceRangeCreateCommand(pdev, item);
+            EndSurfaceWalk(pdev);
             return FALSE;
         }
         QXLDelSurface(pdev, surface_info->draw_area.base_mem, DEVICE_BITMAP_ALLOCATION_TYPE_VRAM);
         surface_info->draw_area.base_mem = copy;
         FreeDrawArea(&surface_info->draw_area);
     }
+    EndSurfaceWalk(pdev);
     return TRUE;
 }
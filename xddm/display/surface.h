@@ -4,18 +4,12 @@
 #include "qxldd.h"
 
 /* Hooks supported by our surfaces. */
-#ifdef CALL_TEST
-#define QXL_SURFACE_HOOKS_CALL_TEST \
-    (HOOK_PLGBLT | HOOK_FILLPATH | HOOK_STROKEANDFILLPATH | HOOK_LINETO |  \
-    HOOK_GRADIENTFILL)
-#else
-#define QXL_SURFACE_HOOKS_CALL_TEST (0)
-#endif
-
 #define QXL_SURFACE_HOOKS \
     (HOOK_SYNCHRONIZE | HOOK_COPYBITS |                                 \
     HOOK_BITBLT | HOOK_TEXTOUT | HOOK_STROKEPATH | HOOK_STRETCHBLT |    \
-    HOOK_STRETCHBLTROP | HOOK_TRANSPARENTBLT | HOOK_ALPHABLEND | QXL_SURFACE_HOOKS_CALL_TEST)
+    HOOK_STRETCHBLTROP | HOOK_TRANSPARENTBLT | HOOK_ALPHABLEND |        \
+    HOOK_FILLPATH | HOOK_STROKEANDFILLPATH | HOOK_GRADIENTFILL |        \
+    HOOK_LINETO | HOOK_PLGBLT)
 
 
 static _inline UINT32 GetSurfaceIdFromInfo(SurfaceInfo *info)
@@ -48,6 +42,32 @@ static _inline UINT32 GetSurfaceId(SURFOBJ *surf)
     return GetSurfaceIdFromInfo(surface);
 }
 
+#define SURFACE_SHADOW_SIZE(surface) (abs((surface)->stride) * (surface)->size.cy)
+
+static _inline void SurfaceFreeShadow(PDev *pdev, SurfaceInfo *surface)
+{
+    if (surface->shadow) {
+        EngFreeMem(surface->shadow);
+        surface->shadow = NULL;
+        pdev->shadow_bytes -= SURFACE_SHADOW_SIZE(surface);
+    }
+}
+
+static _inline void UnlinkSurfaceInfo(PDev *pdev, SurfaceInfo *surface)
+{
+    RingRemove(pdev, &surface->live_link);
+    if (RingItemIsLinked(&surface->restore_link)) {
+        RingRemove(pdev, &surface->restore_link);
+    }
+    if (surface->admit_pending) {
+        surface->admit_pending = FALSE;
+        pdev->admit_pending_surfaces--;
+    }
+    SurfaceFreeShadow(pdev, surface);
+    surface->u.next_free = pdev->free_surfaces;
+    pdev->free_surfaces = surface;
+}
+
 static _inline void FreeSurfaceInfo(PDev *pdev, UINT32 surface_id)
 {
     SurfaceInfo *surface;
@@ -58,14 +78,52 @@ static _inline void FreeSurfaceInfo(PDev *pdev, UINT32 surface_id)
 
     DEBUG_PRINT((pdev, 9, "%s: %p: %d\n", __FUNCTION__, pdev, surface_id));
     surface = &pdev->surfaces_info[surface_id];
-    if (surface->draw_area.base_mem == NULL) {
+    if (!RingItemIsLinked(&surface->live_link) || surface->free_pending) {
         DEBUG_PRINT((pdev, 9, "%s: %p: %d: double free. safely ignored\n", __FUNCTION__,
                      pdev, surface_id));
         return;
     }
     surface->draw_area.base_mem = NULL; /* Mark as not used */
-    surface->u.next_free = pdev->free_surfaces;
-    pdev->free_surfaces = surface;
+    if (pdev->surface_walks) {
+        /* Allocations in a walk flush the release ring, which frees surfaces. Unlinking
+         * this one now would end the walk early if it holds this surface. */
+        surface->free_pending = TRUE;
+        surface->u.next_free = pdev->walk_freed_surfaces;
+        pdev->walk_freed_surfaces = surface;
+        return;
+    }
+    UnlinkSurfaceInfo(pdev, surface);
+}
+
+/* Walks of the live and restore rings that can allocate device memory are bracketed by
+ * these, walks skip the surfaces with no base_mem. */
+static _inline void BeginSurfaceWalk(PDev *pdev)
+{
+    pdev->surface_walks++;
+}
+
+static _inline void EndSurfaceWalk(PDev *pdev)
+{
+    SurfaceInfo *surface;
+
+    ASSERT(pdev, pdev->surface_walks);
+    if (--pdev->surface_walks) {
+        return;
+    }
+    while ((surface = pdev->walk_freed_surfaces)) {
+        pdev->walk_freed_surfaces = surface->u.next_free;
+        surface->free_pending = FALSE;
+        UnlinkSurfaceInfo(pdev, surface);
+    }
+}
+
+#define LIVE_SURFACE(item) CONTAINEROF(item, SurfaceInfo, live_link)
+
+/* Id of a surface taken from the live ring, u.pdev is not set yet right after
+ * GetFreeSurface so GetSurfaceIdFromInfo can't be used. */
+static _inline UINT32 GetLiveSurfaceId(PDev *pdev, SurfaceInfo *surface)
+{
+    return (UINT32)(surface - pdev->surfaces_info);
 }
 
 static UINT32 GetFreeSurface(PDev *pdev)
@@ -79,6 +137,7 @@ static UINT32 GetFreeSurface(PDev *pdev)
         id = 0;
     } else {
       pdev->free_surfaces = surface->u.next_free;
+      RingAdd(pdev, &pdev->live_surfaces, &surface->live_link);
 
       id = (UINT32)(surface - pdev->surfaces_info);
     }
@@ -96,8 +155,11 @@ enum {
 HBITMAP CreateDeviceBitmap(PDev *pdev, SIZEL size, ULONG format, QXLPHYSICAL *phys_mem,
                            UINT8 **base_mem, UINT32 surface_id, UINT8 allocation_type);
 VOID DeleteDeviceBitmap(PDev *pdev, UINT32 surface_id, UINT8 allocation_type);
+BOOL AdmitDeviceBitmap(PDev *pdev, SIZEL size, ULONG format);
+HBITMAP CreatePendingDeviceBitmap(PDev *pdev, SIZEL size, ULONG format, UINT32 surface_id);
 
 int MoveAllSurfacesToVideoRam(PDev *pdev);
+void RestoreSurfacesOnCall(PDev *pdev, SURFOBJ *dest, SURFOBJ *src, SURFOBJ *mask);
 BOOL MoveAllSurfacesToRam(PDev *pdev);
 
 #endif
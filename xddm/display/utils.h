@@ -43,6 +43,15 @@ static __inline void SectRect(RECTL *r1, RECTL *r2, RECTL *dest)
     dest->right = MAX(MIN(r1->right, r2->right), dest->left);
 }
 
+static __inline void UnionRect(RECTL *r1, RECTL *r2, RECTL *dest)
+{
+    dest->top = MIN(r1->top, r2->top);
+    dest->bottom = MAX(r1->bottom, r2->bottom);
+
+    dest->left = MIN(r1->left, r2->left);
+    dest->right = MAX(r1->right, r2->right);
+}
+
 static _inline LONG RectSize(RECTL *rect)
 {
     return (rect->right - rect->left) * (rect->bottom - rect->top);
@@ -127,5 +127,280 @@ typedef struct QXLDriverInfo {
     QXLPHYSICAL * monitors_config;
 } QXLDriverInfo;
 
+/* Driver private DrvEscape codes, above the QXL_ESCAPE_* range of qxl_windows.h */
+#define QXL_ESCAPE_UPDATE_FREQ_PARAMS 0x10100 /* in: QXLUpdateFreqParams */
+#define QXL_ESCAPE_UPDATE_FREQ_QUERY 0x10101  /* out: QXLUpdateFreqQuery */
+
+/* Copies to the primary surface that keep updating the same region faster
+ * than fast_interval are treated as a stream and are not hashed and cached. */
+typedef struct QXLUpdateFreqParams {
+    UINT32 min_pixels;    /* smaller sources are always cached */
+    UINT32 fast_interval; /* ms, updates closer than this count as fast */
+    UINT32 enter_count;   /* fast updates before a region is treated as a stream */
+    UINT32 leave_count;   /* a stream whose count decays below this is static again */
+    UINT32 quiet_time;    /* ms without updates that resets a region */
+} QXLUpdateFreqParams;
+
+typedef struct QXLUpdateFreqStats {
+    UINT32 tests;
+    UINT32 streamed;     /* copies that were not cached */
+    UINT32 stream_start; /* static -> stream transitions */
+    UINT32 stream_end;   /* stream -> static transitions */
+    UINT32 trace_hits;   /* decisions inherited from a moved source */
+} QXLUpdateFreqStats;
+
+typedef struct QXLUpdateFreqQuery {
+    QXLUpdateFreqParams params;
+    QXLUpdateFreqStats stats;
+} QXLUpdateFreqQuery;
+
+#define QXL_ESCAPE_PERF_CONTROL 0x10102 /* in: UINT32 QXL_PERF_* command */
+#define QXL_ESCAPE_PERF_QUERY 0x10103   /* out: QXLPerfStats */
+
+enum {
+    QXL_PERF_STOP,
+    QXL_PERF_START,
+    QXL_PERF_RESET,
+};
+
+enum {
+    QXL_PERF_WAIT_CMD_RING,
+    QXL_PERF_WAIT_RELEASE_RING,
+    QXL_PERF_WAIT_QUIC_SEM,
+    QXL_PERF_WAIT_MALLOC_SEM,
+
+    QXL_PERF_NUM_WAITS,
+};
+
+#define QXL_ESCAPE_TRACE_CONTROL 0x10104 /* in: UINT32 QXL_TRACE_* command */
+#define QXL_ESCAPE_TRACE_DRAIN 0x10105   /* out: QXLTraceHeader followed by records */
+
+enum {
+    QXL_TRACE_STOP,
+    QXL_TRACE_START,
+};
+
+enum {
+    QXL_TRACE_RING_CMD,
+    QXL_TRACE_RING_CURSOR,
+    QXL_TRACE_RING_SURFACE,
+};
+
+#define QXL_TRACE_ENCODE_QUIC (1 << 0)
+#define QXL_TRACE_ENCODE_BITMAP (1 << 1)
+#define QXL_TRACE_ENCODE_SURFACE (1 << 2)
+
+#define QXL_TRACE_VERSION 1
+
+/* One record per command pushed to a ring, times are in performance counter ticks. */
+typedef struct QXLTraceRecord {
+    UINT64 time;          /* when the command was pushed */
+    UINT64 start;         /* when the drawable was started, 0 for other commands */
+    UINT32 surface_id;
+    UINT8 ring;           /* QXL_TRACE_RING_* */
+    UINT8 type;           /* drawable, cursor or surface command type */
+    UINT8 encode;         /* QXL_TRACE_ENCODE_* of the images the command references */
+    UINT8 num_res;
+    UINT16 cache_hits;    /* images found in the image cache */
+    UINT16 cache_misses;  /* images encoded for the command */
+    UINT32 bytes;         /* size of the encoded images */
+    QXLRect bbox;
+} QXLTraceRecord;
+
+typedef struct QXLTraceHeader {
+    UINT32 version;
+    UINT32 record_size;
+    UINT32 count;         /* records following the header */
+    UINT32 dropped;       /* records lost to a full trace ring since the last drain */
+    UINT64 frequency;     /* ticks per second */
+} QXLTraceHeader;
+
+#define QXL_ESCAPE_CAPTURE_CONTROL 0x10106 /* in: UINT32 QXL_CAPTURE_* command */
+#define QXL_ESCAPE_CAPTURE_DRAIN 0x10107   /* out: QXLCaptureHeader followed by records */
+
+enum {
+    QXL_CAPTURE_STOP,
+    QXL_CAPTURE_START,
+};
+
+/* calls below 0x100 are indices into QXLPerfStats call_names */
+#define QXL_CAPTURE_CALL_MOVE_POINTER 0x100
+
+#define QXL_CAPTURE_DEST_DEVICE (1 << 0)     /* dest_surface_id is a device surface */
+#define QXL_CAPTURE_SRC_DEVICE (1 << 1)      /* src_surface_id is a device surface */
+#define QXL_CAPTURE_SRC_PIXELS (1 << 2)      /* source rows follow the palette */
+#define QXL_CAPTURE_SRC_TRUNCATED (1 << 3)   /* source bitmap too large, pixels not captured */
+#define QXL_CAPTURE_CLIP_TRUNCATED (1 << 4)  /* more than QXL_CAPTURE_MAX_CLIP_RECTS clip rects */
+#define QXL_CAPTURE_MASK (1 << 5)            /* the call had a mask, it is not captured */
+#define QXL_CAPTURE_PATH_TRUNCATED (1 << 6)  /* the path didn't fit, its tail is missing */
+#define QXL_CAPTURE_GLYPHS_TRUNCATED (1 << 7) /* the string didn't fit, its tail is missing */
+
+#define QXL_CAPTURE_MAX_CLIP_RECTS 64
+/* a drain buffer of this size holds the largest record */
+#define QXL_CAPTURE_DRAIN_SIZE (512 * 1024)
+
+#define QXL_CAPTURE_VERSION 2
+
+/*
+ * One record per drawing call reaching the driver. The record is followed by
+ * num_clip_rects QXLRect, num_palette UINT32 translation entries and, with
+ * QXL_CAPTURE_SRC_PIXELS, src_height rows of src_stride bytes of the source
+ * bitmap (src_format is the BMF_* format, rows start at the byte holding
+ * src_rect.left). Then come, from the next multiple of 4, num_path_segs
+ * QXLCapturePathSeg of path calls and num_glyphs QXLCaptureGlyph of
+ * DrvTextOut. size covers all of it and is a multiple of 8. The src_rect of
+ * DrvLineTo holds the line end points.
+ *
+ * Masks, pattern brushes and the contents of device surfaces are not captured,
+ * the QXL_CAPTURE_MASK, brush_color and *_DEVICE fields tell where they were used.
+ */
+typedef struct QXLCaptureRecord {
+    UINT32 size;
+    UINT32 seq;
+    UINT64 time;              /* performance counter ticks */
+    UINT16 call;
+    UINT16 flags;             /* QXL_CAPTURE_* */
+    UINT32 dest_surface_id;
+    UINT32 src_surface_id;
+    UINT32 rop;               /* rop4 or mix */
+    UINT32 mode;              /* stretch mode, blend function or transparent color */
+    UINT32 brush_color;       /* iSolidColor, ~0 for pattern brushes */
+    UINT32 src_format;
+    UINT32 src_stride;
+    UINT32 src_height;
+    UINT32 num_palette;
+    UINT32 num_clip_rects;
+    UINT32 clip_complexity;   /* DC_TRIVIAL, DC_RECT or DC_COMPLEX */
+    UINT32 num_path_segs;
+    UINT32 num_glyphs;
+    UINT32 glyph_bpp;         /* 1 or 4, 0 for fonts that aren't rasterized by GDI */
+    QXLRect dest_rect;
+    QXLRect src_rect;
+    QXLRect clip_bounds;
+} QXLCaptureRecord;
+
+/* A PATHDATA of the path, followed by count points of two 28.4 fixed INT32. */
+typedef struct QXLCapturePathSeg {
+    UINT32 flags;             /* PD_* */
+    UINT32 count;
+} QXLCapturePathSeg;
+
+/* A glyph at its position in the string, followed by height rows of
+ * (width * glyph_bpp + 7) / 8 bytes, top down, padded to a multiple of 4. */
+typedef struct QXLCaptureGlyph {
+    INT32 x;
+    INT32 y;
+    INT32 origin_x;
+    INT32 origin_y;
+    UINT32 width;
+    UINT32 height;
+} QXLCaptureGlyph;
+
+typedef struct QXLCaptureHeader {
+    UINT32 version;
+    UINT32 count;             /* records following the header */
+    UINT32 dropped;           /* records lost to a full capture buffer, or too large for the
+                               * drain buffer, since the last drain */
+    UINT32 bytes;             /* of the records following the header */
+    UINT64 frequency;         /* ticks per second */
+} QXLCaptureHeader;
+
+#define QXL_ESCAPE_SURFACE_RESTORE 0x10108 /* in: UINT32 QXL_RESTORE_* mode */
+
+enum {
+    QXL_RESTORE_EAGER,  /* all saved surfaces are moved back to VRAM on mode enable */
+    QXL_RESTORE_LAZY,   /* the most recently used ones are, the rest on first use or later */
+};
+
+#define QXL_ESCAPE_VRAM_QUERY 0x10109 /* out: QXLVRAMStats */
+
+enum {
+    QXL_VRAM_CLASS_SCREEN, /* half the screen or more */
+    QXL_VRAM_CLASS_WINDOW,
+    QXL_VRAM_CLASS_ICON,   /* QXL_VRAM_ICON_MAX_BYTES or less */
+
+    QXL_VRAM_NUM_CLASSES,
+};
+
+#define QXL_VRAM_ICON_MAX_BYTES (128 * 128 * 4)
+
+/* A request is placed when it got memory from its own class pool, overflowed
+ * when only another pool had room and failed when the surface had to be kept
+ * in DEVRAM or RAM instead. */
+typedef struct QXLVRAMClassStats {
+    UINT32 requests;
+    UINT32 placed;
+    UINT32 overflowed;
+    UINT32 failed;
+} QXLVRAMClassStats;
+
+typedef struct QXLVRAMStats {
+    UINT32 version;
+    UINT32 num_classes;
+    UINT64 pool_size[QXL_VRAM_NUM_CLASSES];
+    QXLVRAMClassStats classes[QXL_VRAM_NUM_CLASSES];
+} QXLVRAMStats;
+
+#define QXL_VRAM_STATS_VERSION 1
+
+#define QXL_ESCAPE_CURSOR_MOVES 0x1010a /* in: UINT32 QXL_CURSOR_MOVES_* mode */
+
+enum {
+    QXL_CURSOR_MOVES_EACH,     /* every pointer move is pushed */
+    QXL_CURSOR_MOVES_COALESCE, /* moves update the last move the device didn't consume yet */
+};
+
+#define QXL_ESCAPE_CURSOR_CACHE_QUERY 0x1010b /* out: QXLCursorCacheStats */
+
+/* Cursor shapes are looked up by surface and iUniq first, then by a hash of
+ * their content, shape, mask and hot spot, so the ones that different
+ * surfaces hold are shared. */
+typedef struct QXLCursorCacheStats {
+    UINT32 size;
+    UINT32 count;
+    UINT32 surface_hits;
+    UINT32 content_hits;
+    UINT32 misses;
+    UINT32 evictions;
+} QXLCursorCacheStats;
+
+#define QXL_ESCAPE_PALETTE_CACHE_QUERY 0x1010c /* out: QXLPaletteCacheStats */
+#define QXL_ESCAPE_PALETTE_CACHE_SIZE 0x1010d  /* in: UINT32 number of cached palettes */
+
+/* Palettes are cached by a hash of their entries, whatever XLATEOBJ they
+ * come from. */
+typedef struct QXLPaletteCacheStats {
+    UINT32 size;
+    UINT32 count;
+    UINT32 hits;
+    UINT32 misses;
+    UINT32 evictions;
+} QXLPaletteCacheStats;
+
+#define QXL_PERF_STATS_VERSION 1
+#define QXL_PERF_HIST_BUCKETS 32
+#define QXL_PERF_MAX_CALLS 32
+#define QXL_PERF_NAME_SIZE 24
+
+/* Durations are in performance counter ticks, bucket n counts the ones of
+ * [2^n, 2^(n+1)) ticks and the last bucket all the longer ones. */
+typedef struct QXLPerfHist {
+    UINT32 count;
+    UINT64 total;
+    UINT64 max;
+    UINT32 buckets[QXL_PERF_HIST_BUCKETS];
+} QXLPerfHist;
+
+typedef struct QXLPerfStats {
+    UINT32 version;
+    UINT32 enabled;
+    UINT32 num_calls;
+    UINT32 num_waits;
+    UINT64 frequency; /* ticks per second */
+    char call_names[QXL_PERF_MAX_CALLS][QXL_PERF_NAME_SIZE];
+    QXLPerfHist calls[QXL_PERF_MAX_CALLS];
+    QXLPerfHist waits[QXL_PERF_NUM_WAITS];
+} QXLPerfStats;
+
 #endif
 
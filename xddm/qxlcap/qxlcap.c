@@ -0,0 +1,413 @@
+/*
+   Copyright (C) 2009 Red Hat, Inc.
+
+   This software is licensed under the GNU General Public License,
+   version 2 (GPLv2) (see COPYING for details), subject to the
+   following clarification.
+
+   With respect to binaries built using the Microsoft(R) Windows
+   Driver Kit (WDK), GPLv2 does not extend to any code contained in or
+   derived from the WDK ("WDK Code").  As to WDK Code, by using or
+   distributing such binaries you agree to be bound by the Microsoft
+   Software License Terms for the WDK.  All WDK Code is considered by
+   the GPLv2 licensors to qualify for the special exception stated in
+   section 3 of GPLv2 (commonly known as the system library
+   exception).
+
+   There is NO WARRANTY for this software, express or implied,
+   including the implied warranties of NON-INFRINGEMENT, TITLE,
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * Controls the drawing call capture, perf and trace escapes of the display
+ * driver, saves captured records to a file and decodes them.
+ *
+ *   qxlcap start        start capture, tracing and perf counting
+ *   qxlcap stop         stop them
+ *   qxlcap save FILE    drain the captured records into FILE
+ *   qxlcap dump FILE    decode the records of FILE and sum them up per call
+ *   qxlcap report       print the perf counters and drain the trace ring
+ *
+ * A saved file is a sequence of drain blocks, each a QXLCaptureHeader
+ * followed by its bytes of records.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qxl_driver.h"
+
+#define MAX_CALLS (QXL_CAPTURE_CALL_MOVE_POINTER + 1)
+#define TRACE_DRAIN_SIZE (64 * 1024)
+
+typedef struct CallSummary {
+    UINT32 count;
+    UINT64 bytes;
+    UINT64 src_bytes;
+    UINT32 clip_rects;
+    UINT32 points;
+    UINT32 glyphs;
+    UINT32 truncated;
+} CallSummary;
+
+static QXLPerfStats perf_stats;
+static BOOL have_names;
+static CallSummary summary[MAX_CALLS];
+
+static int Escape(int code, int in_size, const void *in, int out_size, void *out)
+{
+    HDC dc;
+    int ret;
+
+    if (!(dc = GetDC(NULL))) {
+        fprintf(stderr, "GetDC failed\n");
+        return -1;
+    }
+    ret = ExtEscape(dc, code, in_size, (LPCSTR)in, out_size, (LPSTR)out);
+    ReleaseDC(NULL, dc);
+    if (ret <= 0) {
+        fprintf(stderr, "escape 0x%x failed (%d), is the qxl display driver active?\n",
+                code, ret);
+    }
+    return ret;
+}
+
+static BOOL Control(int code, UINT32 command)
+{
+    return Escape(code, sizeof(command), &command, 0, NULL) > 0;
+}
+
+static const char *CallName(UINT32 call)
+{
+    static char name[16];
+
+    if (call == QXL_CAPTURE_CALL_MOVE_POINTER) {
+        return "MovePointer";
+    }
+    if (have_names && call < perf_stats.num_calls && perf_stats.call_names[call][0]) {
+        return perf_stats.call_names[call];
+    }
+    sprintf(name, "call %u", call);
+    return name;
+}
+
+static void PrintRect(const char *label, const QXLRect *rect)
+{
+    printf(" %s (%d,%d)-(%d,%d)", label, rect->left, rect->top, rect->right, rect->bottom);
+}
+
+static double Ms(UINT64 ticks, UINT64 frequency)
+{
+    return frequency ? (double)(INT64)ticks * 1000.0 / (double)(INT64)frequency : 0.0;
+}
+
+/* Decodes one record and adds it to the summary, returns FALSE if its size
+ * doesn't match its contents. */
+static BOOL DumpRecord(const QXLCaptureRecord *record, UINT64 frequency)
+{
+    const UINT8 *now = (const UINT8 *)(record + 1);
+    const UINT8 *end = (const UINT8 *)record + record->size;
+    CallSummary *sum;
+    UINT32 src_bytes = 0;
+    UINT32 points = 0;
+    UINT32 i;
+
+    printf("%8u %12.3f %-16s flags 0x%02x dest %u src %u rop 0x%x mode 0x%x brush 0x%x\n",
+           record->seq, Ms(record->time, frequency), CallName(record->call), record->flags,
+           record->dest_surface_id, record->src_surface_id, record->rop, record->mode,
+           record->brush_color);
+    printf("        ");
+    PrintRect("dest", &record->dest_rect);
+    PrintRect("src", &record->src_rect);
+    printf(" clip %u/%u", record->clip_complexity, record->num_clip_rects);
+    PrintRect("bounds", &record->clip_bounds);
+    printf("\n");
+
+    now += record->num_clip_rects * sizeof(QXLRect);
+    now += record->num_palette * sizeof(UINT32);
+    if (record->flags & QXL_CAPTURE_SRC_PIXELS) {
+        src_bytes = record->src_stride * record->src_height;
+        now += src_bytes;
+    }
+    if (now > end) {
+        return FALSE;
+    }
+    if (record->flags & (QXL_CAPTURE_SRC_PIXELS | QXL_CAPTURE_SRC_TRUNCATED) ||
+        record->num_palette) {
+        printf("         src format %u stride %u height %u palette %u%s\n", record->src_format,
+               record->src_stride, record->src_height, record->num_palette,
+               record->flags & QXL_CAPTURE_SRC_TRUNCATED ? " truncated" :
+               (record->flags & QXL_CAPTURE_SRC_PIXELS ? "" : " no pixels"));
+    }
+
+    now = (const UINT8 *)record + ((now - (const UINT8 *)record + 3) & ~3);
+    for (i = 0; i < record->num_path_segs; i++) {
+        const QXLCapturePathSeg *seg = (const QXLCapturePathSeg *)now;
+        const INT32 *point;
+
+        if (now + sizeof(*seg) > end || now + sizeof(*seg) + seg->count * 8 > end) {
+            return FALSE;
+        }
+        point = (const INT32 *)(seg + 1);
+        printf("         path seg flags 0x%x points %u", seg->flags, seg->count);
+        if (seg->count) {
+            printf(" first (%.2f,%.2f)", point[0] / 16.0, point[1] / 16.0);
+        }
+        printf("\n");
+        points += seg->count;
+        now += sizeof(*seg) + seg->count * 8;
+    }
+    for (i = 0; i < record->num_glyphs; i++) {
+        const QXLCaptureGlyph *glyph = (const QXLCaptureGlyph *)now;
+        UINT32 row;
+
+        if (now + sizeof(*glyph) > end) {
+            return FALSE;
+        }
+        row = ((glyph->width * record->glyph_bpp + 7) / 8 + 3) & ~3;
+        if (now + sizeof(*glyph) + row * glyph->height > end) {
+            return FALSE;
+        }
+        printf("         glyph at (%d,%d) origin (%d,%d) %ux%u\n", glyph->x, glyph->y,
+               glyph->origin_x, glyph->origin_y, glyph->width, glyph->height);
+        now += sizeof(*glyph) + row * glyph->height;
+    }
+
+    sum = &summary[record->call < MAX_CALLS ? record->call : MAX_CALLS - 1];
+    sum->count++;
+    sum->bytes += record->size;
+    sum->src_bytes += src_bytes;
+    sum->clip_rects += record->num_clip_rects;
+    sum->points += points;
+    sum->glyphs += record->num_glyphs;
+    if (record->flags & (QXL_CAPTURE_SRC_TRUNCATED | QXL_CAPTURE_CLIP_TRUNCATED |
+                         QXL_CAPTURE_PATH_TRUNCATED | QXL_CAPTURE_GLYPHS_TRUNCATED)) {
+        sum->truncated++;
+    }
+    return TRUE;
+}
+
+static int Dump(const char *file_name)
+{
+    QXLCaptureHeader header;
+    UINT8 *buf;
+    FILE *file;
+    UINT32 blocks = 0;
+    UINT32 dropped = 0;
+    UINT32 i;
+    int ret = 0;
+
+    if (!(file = fopen(file_name, "rb"))) {
+        fprintf(stderr, "can't open %s\n", file_name);
+        return 1;
+    }
+    if (!(buf = malloc(QXL_CAPTURE_DRAIN_SIZE))) {
+        fclose(file);
+        return 1;
+    }
+    // the call names are only known to a running driver
+    have_names = Escape(QXL_ESCAPE_PERF_QUERY, 0, NULL, sizeof(perf_stats), &perf_stats) > 0;
+
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        UINT32 offset = 0;
+
+        if (header.version != QXL_CAPTURE_VERSION ||
+            header.bytes > QXL_CAPTURE_DRAIN_SIZE - sizeof(header)) {
+            fprintf(stderr, "bad block header, version %u bytes %u\n", header.version,
+                    header.bytes);
+            ret = 1;
+            break;
+        }
+        if (fread(buf, 1, header.bytes, file) != header.bytes) {
+            fprintf(stderr, "truncated block\n");
+            ret = 1;
+            break;
+        }
+        blocks++;
+        dropped += header.dropped;
+        if (header.dropped) {
+            printf("--- %u records dropped ---\n", header.dropped);
+        }
+        for (i = 0; i < header.count; i++) {
+            QXLCaptureRecord *record = (QXLCaptureRecord *)(buf + offset);
+
+            if (offset + sizeof(*record) > header.bytes || record->size < sizeof(*record) ||
+                record->size > header.bytes - offset || !DumpRecord(record, header.frequency)) {
+                fprintf(stderr, "bad record %u of block %u\n", i, blocks);
+                ret = 1;
+                goto out;
+            }
+            offset += record->size;
+        }
+    }
+
+out:
+    printf("\n%u blocks, %u records dropped\n", blocks, dropped);
+    printf("%-16s %8s %10s %10s %8s %8s %8s %6s\n", "call", "count", "bytes", "src bytes",
+           "clips", "points", "glyphs", "trunc");
+    for (i = 0; i < MAX_CALLS; i++) {
+        CallSummary *sum = &summary[i];
+
+        if (!sum->count) {
+            continue;
+        }
+        printf("%-16s %8u %10I64u %10I64u %8u %8u %8u %6u\n", CallName(i), sum->count,
+               sum->bytes, sum->src_bytes, sum->clip_rects, sum->points, sum->glyphs,
+               sum->truncated);
+    }
+    free(buf);
+    fclose(file);
+    return ret;
+}
+
+static int Save(const char *file_name)
+{
+    QXLCaptureHeader *header;
+    FILE *file;
+    UINT32 records = 0;
+    UINT32 dropped = 0;
+    int ret = 0;
+    int size;
+
+    if (!(file = fopen(file_name, "wb"))) {
+        fprintf(stderr, "can't create %s\n", file_name);
+        return 1;
+    }
+    if (!(header = malloc(QXL_CAPTURE_DRAIN_SIZE))) {
+        fclose(file);
+        return 1;
+    }
+    for (;;) {
+        size = Escape(QXL_ESCAPE_CAPTURE_DRAIN, 0, NULL, QXL_CAPTURE_DRAIN_SIZE, header);
+        if (size <= 0) {
+            ret = 1;
+            break;
+        }
+        dropped += header->dropped;
+        if (!header->count && !header->dropped) {
+            break;
+        }
+        if (fwrite(header, 1, size, file) != (size_t)size) {
+            fprintf(stderr, "write to %s failed\n", file_name);
+            ret = 1;
+            break;
+        }
+        records += header->count;
+        if (!header->count) {
+            break;
+        }
+    }
+    printf("%u records saved, %u dropped\n", records, dropped);
+    free(header);
+    fclose(file);
+    return ret;
+}
+
+static int Report(void)
+{
+    static const char *ring_names[] = {"cmd", "cursor", "surface"};
+    struct {
+        UINT32 commands;
+        UINT32 cache_hits;
+        UINT32 cache_misses;
+        UINT64 bytes;
+        UINT64 latency;
+    } rings[QXL_TRACE_RING_SURFACE + 1];
+    QXLTraceHeader *trace;
+    UINT32 dropped = 0;
+    UINT32 i;
+    int size;
+
+    if (Escape(QXL_ESCAPE_PERF_QUERY, 0, NULL, sizeof(perf_stats), &perf_stats) <= 0) {
+        return 1;
+    }
+    printf("perf counting %s\n", perf_stats.enabled ? "on" : "off");
+    printf("%-24s %8s %12s %10s\n", "call", "count", "total ms", "max ms");
+    for (i = 0; i < perf_stats.num_calls && i < QXL_PERF_MAX_CALLS; i++) {
+        QXLPerfHist *hist = &perf_stats.calls[i];
+
+        if (!hist->count) {
+            continue;
+        }
+        printf("%-24.24s %8u %12.3f %10.3f\n", perf_stats.call_names[i], hist->count,
+               Ms(hist->total, perf_stats.frequency), Ms(hist->max, perf_stats.frequency));
+    }
+
+    if (!(trace = malloc(TRACE_DRAIN_SIZE))) {
+        return 1;
+    }
+    memset(rings, 0, sizeof(rings));
+    for (;;) {
+        QXLTraceRecord *record;
+
+        size = Escape(QXL_ESCAPE_TRACE_DRAIN, 0, NULL, TRACE_DRAIN_SIZE, trace);
+        if (size <= 0 || trace->version != QXL_TRACE_VERSION ||
+            trace->record_size != sizeof(QXLTraceRecord)) {
+            break;
+        }
+        dropped += trace->dropped;
+        record = (QXLTraceRecord *)(trace + 1);
+        for (i = 0; i < trace->count; i++, record++) {
+            if (record->ring > QXL_TRACE_RING_SURFACE) {
+                continue;
+            }
+            rings[record->ring].commands++;
+            rings[record->ring].cache_hits += record->cache_hits;
+            rings[record->ring].cache_misses += record->cache_misses;
+            rings[record->ring].bytes += record->bytes;
+            if (record->start) {
+                rings[record->ring].latency += record->time - record->start;
+            }
+        }
+        if (!trace->count) {
+            break;
+        }
+    }
+    printf("\n%-8s %8s %10s %10s %12s %12s\n", "ring", "commands", "hits", "misses",
+           "enc bytes", "avg ms");
+    for (i = 0; i <= QXL_TRACE_RING_SURFACE; i++) {
+        printf("%-8s %8u %10u %10u %12I64u %12.4f\n", ring_names[i], rings[i].commands,
+               rings[i].cache_hits, rings[i].cache_misses, rings[i].bytes,
+               rings[i].commands ? Ms(rings[i].latency, perf_stats.frequency) /
+               rings[i].commands : 0.0);
+    }
+    printf("%u trace records dropped\n", dropped);
+    free(trace);
+    return 0;
+}
+
+static int Usage(void)
+{
+    fprintf(stderr, "usage: qxlcap start | stop | save FILE | dump FILE | report\n");
+    return 2;
+}
+
+int __cdecl main(int argc, char **argv)
+{
+    if (argc < 2) {
+        return Usage();
+    }
+    if (!strcmp(argv[1], "start")) {
+        return !(Control(QXL_ESCAPE_PERF_CONTROL, QXL_PERF_RESET) &&
+                 Control(QXL_ESCAPE_PERF_CONTROL, QXL_PERF_START) &&
+                 Control(QXL_ESCAPE_TRACE_CONTROL, QXL_TRACE_START) &&
+                 Control(QXL_ESCAPE_CAPTURE_CONTROL, QXL_CAPTURE_START));
+    }
+    if (!strcmp(argv[1], "stop")) {
+        return !(Control(QXL_ESCAPE_CAPTURE_CONTROL, QXL_CAPTURE_STOP) &&
+                 Control(QXL_ESCAPE_TRACE_CONTROL, QXL_TRACE_STOP) &&
+                 Control(QXL_ESCAPE_PERF_CONTROL, QXL_PERF_STOP));
+    }
+    if (!strcmp(argv[1], "save") && argc == 3) {
+        return Save(argv[2]);
+    }
+    if (!strcmp(argv[1], "dump") && argc == 3) {
+        return Dump(argv[2]);
+    }
+    if (!strcmp(argv[1], "report")) {
+        return Report();
+    }
+    return Usage();
+}